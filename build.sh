@@ -1,7 +1,7 @@
 #!/bin/sh -e
 
 #libdrm
-dependencies="libavcodec libavformat libavutil x11 xcomposite xrandr libpulse libswresample libavfilter"
+dependencies="libavcodec libavformat libavutil x11 xcomposite xrandr xdamage xfixes libpulse libswresample libavfilter"
 includes="$(pkg-config --cflags $dependencies)"
 libs="$(pkg-config --libs $dependencies) -ldl -pthread -lm"
 gcc -c src/capture/capture.c -O2 -g0 -DNDEBUG $includes
@@ -11,8 +11,15 @@ gcc -c src/capture/xcomposite_drm.c -O2 -g0 -DNDEBUG $includes
 gcc -c src/egl.c -O2 -g0 -DNDEBUG $includes
 gcc -c src/cuda.c -O2 -g0 -DNDEBUG $includes
 gcc -c src/window_texture.c -O2 -g0 -DNDEBUG $includes
+gcc -c src/damage.c -O2 -g0 -DNDEBUG $includes
 gcc -c src/time.c -O2 -g0 -DNDEBUG $includes
+gcc -c src/replay_buffer.c -O2 -g0 -DNDEBUG $includes
+gcc -c src/packet_queue.c -O2 -g0 -DNDEBUG $includes
+gcc -c src/file_writer.c -O2 -g0 -DNDEBUG $includes
+gcc -c src/bitrate_controller.c -O2 -g0 -DNDEBUG $includes
+gcc -c src/pipe_writer.c -O2 -g0 -DNDEBUG $includes
+gcc -c src/thread_config.c -O2 -g0 -DNDEBUG $includes
 g++ -c src/sound.cpp -O2 -g0 -DNDEBUG $includes
 g++ -c src/main.cpp -O2 -g0 -DNDEBUG $includes
-g++ -o gpu-screen-recorder -O2 capture.o nvfbc.o egl.o cuda.o window_texture.o time.o xcomposite_cuda.o xcomposite_drm.o sound.o main.o -s $libs
+g++ -o gpu-screen-recorder -O2 capture.o nvfbc.o egl.o cuda.o window_texture.o damage.o time.o replay_buffer.o packet_queue.o file_writer.o bitrate_controller.o pipe_writer.o thread_config.o xcomposite_cuda.o xcomposite_drm.o sound.o main.o -s $libs
 echo "Successfully built gpu-screen-recorder"
@@ -0,0 +1,52 @@
+#ifndef GSR_BITRATE_CONTROLLER_H
+#define GSR_BITRATE_CONTROLLER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+    Adjusts the video bitrate of a livestream to the bandwidth of the outputs. The bitrate is reduced quickly when data
+    is building up in the outputs (or writing to them blocks) and increased slowly again when the outputs keep up.
+    When the bitrate is at the minimum and the outputs still can't keep up, the frame rate is reduced as well.
+    The frame rate is restored before the bitrate is increased again.
+*/
+typedef struct gsr_bitrate_controller gsr_bitrate_controller;
+
+typedef struct {
+    int64_t max_bitrate; /* In bits per second. This is the starting bitrate */
+    int64_t min_bitrate; /* In bits per second */
+    int max_frame_rate_divisor; /* The frame rate is reduced to at most fps / |max_frame_rate_divisor|. 1 disables frame rate reduction */
+} gsr_bitrate_controller_params;
+
+/* The state of the outputs, measured since the controller was created */
+typedef struct {
+    int64_t backlog_bytes; /* Encoded data that has not been written to the output yet, the highest value of all outputs */
+    double write_secs; /* Total time spent writing to the output, the highest value of all outputs. Writes block when the connection is too slow */
+    bool disconnected; /* True if any output is reconnecting */
+} gsr_bitrate_controller_input;
+
+typedef struct {
+    int64_t bitrate; /* Current target bitrate */
+    int frame_rate_divisor; /* Only every nth frame is encoded */
+    double backlog_secs; /* |backlog_bytes| from the last update, in seconds of video at the current bitrate */
+    double write_load; /* Fraction of the time spent writing since the last update, from 0.0 to 1.0 */
+    bool congested;
+    uint64_t num_decreases;
+    uint64_t num_increases;
+    int64_t lowest_bitrate;
+    double reduced_frame_rate_secs; /* Total time the frame rate was reduced */
+} gsr_bitrate_controller_stats;
+
+gsr_bitrate_controller* gsr_bitrate_controller_create(const gsr_bitrate_controller_params *params, double time_now);
+void gsr_bitrate_controller_destroy(gsr_bitrate_controller *self);
+
+/*
+    Should be called regularly, for example after every video frame. Returns true if the bitrate or frame rate
+    divisor was changed, in which case the new values should be applied to the encoder.
+*/
+bool gsr_bitrate_controller_update(gsr_bitrate_controller *self, const gsr_bitrate_controller_input *input, double time_now);
+int64_t gsr_bitrate_controller_get_bitrate(const gsr_bitrate_controller *self);
+int gsr_bitrate_controller_get_frame_rate_divisor(const gsr_bitrate_controller *self);
+void gsr_bitrate_controller_get_stats(const gsr_bitrate_controller *self, gsr_bitrate_controller_stats *stats);
+
+#endif /* GSR_BITRATE_CONTROLLER_H */
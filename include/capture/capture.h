@@ -2,18 +2,30 @@
 #define GSR_CAPTURE_CAPTURE_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef struct AVCodecContext AVCodecContext;
 typedef struct AVFrame AVFrame;
 
 typedef struct gsr_capture gsr_capture;
 
+/* Totals since the capture was started */
+typedef struct {
+    uint64_t num_damage_updates; /* Number of times the content changed between captures */
+    uint64_t damaged_area; /* Sum of the changed areas, in pixels */
+    uint64_t num_copies;
+    uint64_t num_copies_skipped; /* Captures that didn't copy the content because nothing had changed */
+} gsr_capture_damage_stats;
+
 struct gsr_capture {
     /* These methods should not be called manually. Call gsr_capture_* instead */
     int (*start)(gsr_capture *cap, AVCodecContext *video_codec_context);
     void (*tick)(gsr_capture *cap, AVCodecContext *video_codec_context, AVFrame **frame); /* can be NULL */
     bool (*should_stop)(gsr_capture *cap, bool *err); /* can be NULL */
     int (*capture)(gsr_capture *cap, AVFrame *frame);
+    bool (*is_damaged)(gsr_capture *cap); /* can be NULL */
+    void (*clear_damage)(gsr_capture *cap); /* can be NULL */
+    void (*get_damage_stats)(gsr_capture *cap, gsr_capture_damage_stats *stats); /* can be NULL */
     void (*destroy)(gsr_capture *cap, AVCodecContext *video_codec_context);
 
     void *priv; /* can be NULL */
@@ -24,6 +36,11 @@ int gsr_capture_start(gsr_capture *cap, AVCodecContext *video_codec_context);
 void gsr_capture_tick(gsr_capture *cap, AVCodecContext *video_codec_context, AVFrame **frame);
 bool gsr_capture_should_stop(gsr_capture *cap, bool *err);
 int gsr_capture_capture(gsr_capture *cap, AVFrame *frame);
+/* Returns true if the captured content might have changed since the last call to |gsr_capture_clear_damage|. Always true if the capture method can't detect changes */
+bool gsr_capture_is_damaged(gsr_capture *cap);
+void gsr_capture_clear_damage(gsr_capture *cap);
+/* Returns false if the capture method doesn't track changes */
+bool gsr_capture_get_damage_stats(gsr_capture *cap, gsr_capture_damage_stats *stats);
 /* Calls |gsr_capture_stop| as well */
 void gsr_capture_destroy(gsr_capture *cap, AVCodecContext *video_codec_context);
 
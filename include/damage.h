@@ -0,0 +1,39 @@
+#ifndef GSR_DAMAGE_H
+#define GSR_DAMAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xdamage.h>
+
+/*
+    Tracks which parts of a window have changed with XDamage. If XDamage is not available
+    then the window is always treated as changed.
+*/
+typedef struct {
+    Display *display;
+    Window window;
+    Damage damage;
+    XserverRegion region; /* Receives the damaged area when the damage is subtracted */
+    int damage_event;
+    bool damaged;
+
+    uint64_t num_damage_updates; /* Number of times the window was damaged since the damage was last subtracted */
+    uint64_t damaged_area; /* Sum of all damaged areas, in pixels */
+} gsr_damage;
+
+/* Returns false if XDamage is not available, |self| can still be used */
+bool gsr_damage_init(gsr_damage *self, Display *display, Window window);
+void gsr_damage_deinit(gsr_damage *self);
+
+/* Starts tracking |window| instead, which is treated as changed */
+void gsr_damage_set_target(gsr_damage *self, Window window);
+/* Handles damage events. Should be called before every capture */
+void gsr_damage_update(gsr_damage *self);
+/* Marks the window as changed, for example when it has been resized */
+void gsr_damage_set_damaged(gsr_damage *self);
+/* Returns true if the window has changed since the last call to |gsr_damage_clear| */
+bool gsr_damage_is_damaged(const gsr_damage *self);
+void gsr_damage_clear(gsr_damage *self);
+
+#endif /* GSR_DAMAGE_H */
@@ -0,0 +1,42 @@
+#ifndef GSR_FILE_WRITER_H
+#define GSR_FILE_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct AVIOContext AVIOContext;
+
+/*
+    Writes a local file through a custom AVIOContext. Data is collected in large buffers that are written with one
+    system call each, either synchronously with pwrite or asynchronously with io_uring.
+*/
+typedef struct gsr_file_writer gsr_file_writer;
+
+typedef struct {
+    size_t buffer_size; /* Size of each write. Rounded up to a multiple of 4096 */
+    size_t preallocate_size; /* If not 0 then disk space is allocated in chunks of this size ahead of the data, to reduce fragmentation */
+    bool direct_io; /* Bypass the page cache with O_DIRECT. Falls back to normal writes if the filesystem doesn't support it */
+    bool io_uring; /* Submit writes with io_uring. Falls back to pwrite if io_uring is not available */
+} gsr_file_writer_params;
+
+typedef struct {
+    uint64_t num_write_syscalls; /* Synchronous writes (pwrite) */
+    uint64_t num_io_uring_enter_syscalls;
+    uint64_t num_fallocate_syscalls;
+    uint64_t bytes_written;
+} gsr_file_writer_stats;
+
+/* Creates (or truncates) the file at |filepath| */
+gsr_file_writer* gsr_file_writer_create(const char *filepath, const gsr_file_writer_params *params);
+/*
+    Writes the remaining data and closes the file. Returns false if any write failed. |avio_flush| has to be called on the AVIOContext before this.
+    If |stats| is not NULL then it's set to the final stats, including the last writes.
+*/
+bool gsr_file_writer_destroy(gsr_file_writer *self, gsr_file_writer_stats *stats);
+
+/* The AVIOContext is owned by the file writer. It's seekable, so it can be used for formats that update the header when they are done, such as mp4 */
+AVIOContext* gsr_file_writer_get_avio_context(gsr_file_writer *self);
+void gsr_file_writer_get_stats(const gsr_file_writer *self, gsr_file_writer_stats *stats);
+
+#endif /* GSR_FILE_WRITER_H */
@@ -0,0 +1,45 @@
+#ifndef GSR_PACKET_QUEUE_H
+#define GSR_PACKET_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct AVPacket AVPacket;
+
+/*
+    Bounded lock-free queue of packets. Any number of threads can push and pop packets at the same time.
+    Pushing a packet never takes a lock, threads only sleep when pushing to a full queue with |gsr_packet_queue_push|
+    or when popping from an empty queue.
+*/
+typedef struct gsr_packet_queue gsr_packet_queue;
+
+typedef struct {
+    size_t capacity;
+    size_t max_size; /* The highest number of packets that have been in the queue at the same time */
+    uint64_t num_push_waits; /* Number of times |gsr_packet_queue_push| had to wait because the queue was full */
+    double push_wait_secs; /* Total time spent waiting in |gsr_packet_queue_push| */
+} gsr_packet_queue_stats;
+
+/* |capacity| is rounded up to a power of two */
+gsr_packet_queue* gsr_packet_queue_create(size_t capacity);
+/* Frees the packets that are still in the queue */
+void gsr_packet_queue_destroy(gsr_packet_queue *self);
+
+/* Returns false if the queue is full. The queue takes ownership of the packet if true is returned */
+bool gsr_packet_queue_try_push(gsr_packet_queue *self, AVPacket *av_packet);
+/* Waits until there is space in the queue. The queue takes ownership of the packet */
+void gsr_packet_queue_push(gsr_packet_queue *self, AVPacket *av_packet);
+/*
+    Waits until there is a packet in the queue. The caller takes ownership of the returned packet.
+    Returns NULL when the queue has been closed and all packets have been popped.
+*/
+AVPacket* gsr_packet_queue_pop(gsr_packet_queue *self);
+/* Wakes up threads waiting in |gsr_packet_queue_pop|. Packets shouldn't be pushed after this */
+void gsr_packet_queue_close(gsr_packet_queue *self);
+
+size_t gsr_packet_queue_size(gsr_packet_queue *self);
+/* Can be called from any thread, the values are approximate while packets are pushed */
+void gsr_packet_queue_get_stats(gsr_packet_queue *self, gsr_packet_queue_stats *stats);
+
+#endif /* GSR_PACKET_QUEUE_H */
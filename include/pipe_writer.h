@@ -0,0 +1,41 @@
+#ifndef GSR_PIPE_WRITER_H
+#define GSR_PIPE_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct AVIOContext AVIOContext;
+
+/*
+    Writes to a pipe (such as stdout) through a custom AVIOContext. Data is collected in a bounded buffer and written
+    by a separate thread with non-blocking writes, so a slow consumer only blocks the muxer when the buffer is full.
+    Use |gsr_pipe_writer_get_free_space| before muxing a packet to avoid blocking.
+*/
+typedef struct gsr_pipe_writer gsr_pipe_writer;
+
+typedef struct {
+    uint64_t bytes_written;
+    uint64_t num_write_syscalls;
+    uint64_t num_would_block; /* Number of times the consumer wasn't reading fast enough and the pipe was full */
+    size_t max_buffered; /* The highest number of bytes that have been waiting to be written at the same time */
+    double full_wait_secs; /* Total time the muxer waited because the buffer was full */
+} gsr_pipe_writer_stats;
+
+/* Opens |filepath| (for example /dev/stdout) again as a non-blocking file. Returns NULL if the file can't be opened that way */
+gsr_pipe_writer* gsr_pipe_writer_create(const char *filepath, size_t buffer_size);
+/*
+    Waits until the remaining data has been written (for at most a few seconds if the consumer is not reading) and closes the file.
+    Returns false if any data couldn't be written. |avio_flush| has to be called on the AVIOContext before this.
+    If |stats| is not NULL then it's set to the final stats.
+*/
+bool gsr_pipe_writer_destroy(gsr_pipe_writer *self, gsr_pipe_writer_stats *stats);
+
+AVIOContext* gsr_pipe_writer_get_avio_context(gsr_pipe_writer *self);
+/* Number of bytes that can be written to the AVIOContext without blocking. Should only be called by the thread that writes to the AVIOContext */
+size_t gsr_pipe_writer_get_free_space(gsr_pipe_writer *self);
+/* Returns true if writing failed, for example because the consumer closed the pipe */
+bool gsr_pipe_writer_has_failed(gsr_pipe_writer *self);
+void gsr_pipe_writer_get_stats(gsr_pipe_writer *self, gsr_pipe_writer_stats *stats);
+
+#endif /* GSR_PIPE_WRITER_H */
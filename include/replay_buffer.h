@@ -0,0 +1,83 @@
+#ifndef GSR_REPLAY_BUFFER_H
+#define GSR_REPLAY_BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct AVPacket AVPacket;
+
+/*
+    Replay buffer backed by one contiguous arena that is allocated once, or by fixed-size segment files in a
+    spool directory. The arena is split into slabs (one slab per segment file) and packets (header + payload)
+    are written in place into the slabs, in the order they are received. Segment files are reused when
+    old data is removed and finished segments are released from memory, so only a few segments are in memory at a time.
+    Whole gops are removed from the start of the buffer when the packets get older than |duration_secs|
+    or when the arena is full. The start of every gop is kept in an index, so removing a gop doesn't
+    require scanning the packets. Slabs are reference counted so packets read from the buffer stay valid
+    after they have been removed from the buffer.
+*/
+typedef struct gsr_replay_buffer gsr_replay_buffer;
+
+typedef struct {
+    size_t max_size_bytes; /* Hard limit on the memory (or disk space if |spool_dir| is set) used for packet data */
+    bool preallocate; /* If true then the memory (or disk space) is committed when the buffer is created, otherwise the first time it's used */
+    bool lock_memory; /* If true and |preallocate| is true then the memory is locked so it's never swapped out. Segment files in |spool_dir| are never locked */
+    const char *spool_dir; /* If not NULL then packets are stored in segment files in this directory instead of in memory */
+    double duration_secs;
+    int video_stream_index;
+} gsr_replay_buffer_params;
+
+/*
+    A snapshot of the packets in the replay buffer, starting at the first video keyframe if packets have been removed from the buffer
+    or if the snapshot only contains the end of the buffer.
+    The snapshot keeps the slabs with the packets alive, so packets can be read from it while new packets are added to the buffer.
+*/
+typedef struct {
+    gsr_replay_buffer *replay_buffer;
+    size_t *slab_indices;
+    size_t *slab_sizes;
+    size_t num_slabs;
+    size_t slab_index;
+    size_t offset;
+    bool packets_erased; /* True if the snapshot doesn't start at the first packet that was added to the buffer */
+} gsr_replay_buffer_snapshot;
+
+gsr_replay_buffer* gsr_replay_buffer_create(const gsr_replay_buffer_params *params);
+void gsr_replay_buffer_destroy(gsr_replay_buffer *self);
+
+/*
+    Copies the packet (data, pts, dts, stream index and flags) into the buffer.
+    |timestamp| is the time the packet was received, in seconds.
+    Returns false if the packet was dropped. Video packets are dropped until the next keyframe after a video packet has been dropped.
+*/
+bool gsr_replay_buffer_append(gsr_replay_buffer *self, const AVPacket *av_packet, double timestamp);
+
+/*
+    Like |gsr_replay_buffer_append|, but either all of the packets are added or none of them are.
+    Used for data that is only valid as a whole, such as an fmp4 fragment that is split into multiple packets.
+    Returns false if the packets were dropped.
+*/
+bool gsr_replay_buffer_append_all(gsr_replay_buffer *self, const AVPacket *av_packets, size_t num_packets, double timestamp);
+
+/* Returns true if packets have been removed from the start of the buffer. The buffer then always starts with a video keyframe */
+bool gsr_replay_buffer_packets_erased(const gsr_replay_buffer *self);
+uint64_t gsr_replay_buffer_num_dropped_packets(const gsr_replay_buffer *self);
+
+/*
+    Has to be called while holding the same lock as |gsr_replay_buffer_append|. This only references the slabs in the buffer, so it takes the same amount of time regardless of how many packets are in the buffer.
+    If |duration_secs| is > 0 then the snapshot starts at the newest video keyframe that is at least |duration_secs| older than the newest packet,
+    or at the start of the buffer if the buffer is shorter than that. If |duration_secs| is 0 then the snapshot contains the whole buffer.
+    Returns false if the buffer doesn't contain a video keyframe (or on failure).
+*/
+bool gsr_replay_buffer_snapshot_init(gsr_replay_buffer *self, gsr_replay_buffer_snapshot *snapshot, double duration_secs);
+/* Can be called from any thread. Packets returned by |gsr_replay_buffer_snapshot_next_packet| stay valid after this */
+void gsr_replay_buffer_snapshot_deinit(gsr_replay_buffer_snapshot *snapshot);
+/*
+    Can be called without holding the lock.
+    Returns false when there are no more packets (or on failure).
+    |av_packet| references the packet data in the buffer (no copy is made) and has to be unreferenced with av_packet_unref.
+*/
+bool gsr_replay_buffer_snapshot_next_packet(gsr_replay_buffer_snapshot *snapshot, AVPacket *av_packet);
+
+#endif /* GSR_REPLAY_BUFFER_H */
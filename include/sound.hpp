@@ -20,12 +20,31 @@
 
 #include <vector>
 #include <string>
+#include <stdint.h>
+
+extern "C" {
+#include "thread_config.h"
+}
+
+struct AVBufferRef;
+
+/* A connection to pulseaudio that is shared by all sound devices */
+typedef struct {
+    void *handle;
+} SoundContext;
 
 typedef struct {
     void *handle;
     unsigned int frames;
 } SoundDevice;
 
+typedef struct {
+    double latency_secs; /* How long the audio waits in pulseaudio before it's received. Negative if it's not known yet */
+    uint64_t num_overflows; /* Number of times audio was lost because it wasn't received or read fast enough */
+    uint64_t num_holes; /* Number of gaps in the audio from pulseaudio */
+    uint64_t num_copies; /* Number of times audio was copied. Audio is only copied when it's received, usually once per chunk */
+} SoundDeviceStats;
+
 struct AudioInput {
     std::string name;
     std::string description;
@@ -41,21 +60,39 @@ typedef enum {
     F32
 } AudioFormat;
 
+/*
+    Connects to pulseaudio. The context should be destroyed with @sound_context_destroy
+    after all devices have been closed.
+    Audio is received on a pulseaudio thread that runs with the scheduling and cpu affinity in @thread_config.
+    Returns 0 on success, or a negative value on failure.
+*/
+int sound_context_create(SoundContext *context, const gsr_thread_config *thread_config);
+void sound_context_destroy(SoundContext *context);
+/*
+    Audio is received on a separate thread. This waits until any of the devices of the context has received audio,
+    or until @timeout_ms has passed.
+    Returns 0 on success, or a negative value on failure.
+*/
+int sound_context_wait(SoundContext *context, int timeout_ms);
+
 /*
     Get a sound device by name, returning the device into the @device parameter.
     The device should be closed with @sound_device_close after it has been used
     to clean up internal resources.
     Returns 0 on success, or a negative value on failure.
 */
-int sound_device_get_by_name(SoundDevice *device, const char *device_name, const char *description, unsigned int num_channels, unsigned int period_frame_size, AudioFormat audio_format);
+int sound_device_get_by_name(SoundContext *context, SoundDevice *device, const char *device_name, const char *description, unsigned int num_channels, unsigned int period_frame_size, AudioFormat audio_format);
 
 void sound_device_close(SoundDevice *device);
 
 /*
-    Returns the next chunk of audio into @buffer.
-    Returns the number of frames read, or a negative value on failure.
+    Returns the next chunk of audio into @buffer, without waiting for audio that hasn't been received yet.
+    The caller owns the reference to @buffer and should unref it when it's no longer used, which returns it to the pool of chunks.
+    Each device should only be read from one thread at a time.
+    Returns the number of frames read, 0 if a whole chunk hasn't been received yet, or a negative value on failure.
 */
-int sound_device_read_next_chunk(SoundDevice *device, void **buffer);
+int sound_device_read_next_chunk(SoundDevice *device, AVBufferRef **buffer);
+void sound_device_get_stats(SoundDevice *device, SoundDeviceStats *stats);
 
 std::vector<AudioInput> get_pulseaudio_inputs();
 
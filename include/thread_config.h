@@ -0,0 +1,44 @@
+#ifndef GSR_THREAD_CONFIG_H
+#define GSR_THREAD_CONFIG_H
+
+#include <stdbool.h>
+
+#define GSR_THREAD_CONFIG_MAX_CPUS 256
+
+typedef enum {
+    GSR_THREAD_SCHEDULING_DEFAULT,
+    GSR_THREAD_SCHEDULING_FIFO,
+    GSR_THREAD_SCHEDULING_RR,
+    GSR_THREAD_SCHEDULING_NICE
+} gsr_thread_scheduling;
+
+/* Scheduling and cpu affinity of a thread */
+typedef struct {
+    gsr_thread_scheduling scheduling;
+    int priority; /* 1 to 99 for fifo and rr, the niceness (-20 to 19) for nice */
+    bool pin_cpus;
+    bool cpus[GSR_THREAD_CONFIG_MAX_CPUS];
+} gsr_thread_config;
+
+/* Saves the cpu affinity the process was started with (for example with taskset). Has to be called at startup, before any thread config is applied */
+void gsr_thread_config_save_process_affinity(void);
+void gsr_thread_config_init(gsr_thread_config *self);
+/* |str| is "fifo:<priority>", "rr:<priority>" or "nice:<niceness>". Returns false if |str| is invalid */
+bool gsr_thread_config_parse_scheduling(gsr_thread_config *self, const char *str);
+/* |str| is a list of cpus and ranges of cpus, for example "2,4-7". Returns false if |str| is invalid */
+bool gsr_thread_config_parse_cpus(gsr_thread_config *self, const char *str);
+/*
+    Applies the scheduling and cpu affinity to the calling thread and names it |name| (if not NULL).
+    If the process isn't allowed to change the scheduling then a warning is shown and the thread keeps running with the default scheduling.
+*/
+void gsr_thread_config_apply(const gsr_thread_config *self, const char *name);
+/*
+    Threads inherit the scheduling and cpu affinity of the thread that created them. This resets them to the defaults for the calling thread and names it |name| (if not NULL).
+    The cpu affinity is reset to the affinity saved with |gsr_thread_config_save_process_affinity|.
+*/
+void gsr_thread_config_apply_default(const char *name);
+
+/* Locks the memory that is currently mapped (including preallocated buffers) so it's never swapped out. Returns false on failure, after showing a warning */
+bool gsr_lock_memory(void);
+
+#endif /* GSR_THREAD_CONFIG_H */
@@ -1,6 +1,10 @@
 #ifndef GSR_TIME_H
 #define GSR_TIME_H
 
+#include <stdbool.h>
+
 double clock_get_monotonic_seconds();
+/* Sleeps until |clock_get_monotonic_seconds| reaches |deadline|. Returns false if the sleep was interrupted by a signal */
+bool clock_sleep_until_monotonic_seconds(double deadline);
 
 #endif /* GSR_TIME_H */
@@ -0,0 +1,162 @@
+#include "../include/bitrate_controller.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* How often the state of the outputs is checked */
+#define UPDATE_INTERVAL_SECS 0.5
+/* The outputs are congested when they have more than this much video queued or when they spend more than this fraction of the time writing */
+#define CONGESTED_BACKLOG_SECS 0.5
+#define CONGESTED_WRITE_LOAD 0.9
+/* The outputs are keeping up when they are below these values */
+#define CLEAR_BACKLOG_SECS 0.1
+#define CLEAR_WRITE_LOAD 0.7
+/* Waiting between changes gives the outputs time to drain the data that was encoded before the change */
+#define DECREASE_INTERVAL_SECS 1.0
+#define FRAME_RATE_DECREASE_INTERVAL_SECS 2.0
+#define INCREASE_INTERVAL_SECS 5.0
+#define DECREASE_FACTOR 0.7
+/* Fraction of the max bitrate that is added for every increase */
+#define INCREASE_STEP 0.1
+
+struct gsr_bitrate_controller {
+    gsr_bitrate_controller_params params;
+    int64_t bitrate;
+    int frame_rate_divisor;
+    double last_update_time;
+    double last_change_time;
+    double clear_since_time; /* Negative when the outputs are not keeping up */
+    double prev_write_secs;
+    gsr_bitrate_controller_stats stats;
+};
+
+static int64_t min_int64(int64_t a, int64_t b) {
+    return a < b ? a : b;
+}
+
+static int64_t max_int64(int64_t a, int64_t b) {
+    return a > b ? a : b;
+}
+
+gsr_bitrate_controller* gsr_bitrate_controller_create(const gsr_bitrate_controller_params *params, double time_now) {
+    if(params->max_bitrate <= 0 || params->min_bitrate <= 0 || params->min_bitrate > params->max_bitrate || params->max_frame_rate_divisor < 1) {
+        fprintf(stderr, "gsr error: gsr_bitrate_controller_create: invalid params\n");
+        return NULL;
+    }
+
+    gsr_bitrate_controller *self = calloc(1, sizeof(gsr_bitrate_controller));
+    if(!self) {
+        fprintf(stderr, "gsr error: gsr_bitrate_controller_create: failed to allocate bitrate controller\n");
+        return NULL;
+    }
+
+    self->params = *params;
+    self->bitrate = params->max_bitrate;
+    self->frame_rate_divisor = 1;
+    self->last_update_time = time_now;
+    self->last_change_time = time_now;
+    self->clear_since_time = -1.0;
+    self->stats.lowest_bitrate = params->max_bitrate;
+    return self;
+}
+
+void gsr_bitrate_controller_destroy(gsr_bitrate_controller *self) {
+    free(self);
+}
+
+static bool decrease(gsr_bitrate_controller *self, double time_now) {
+    const double since_last_change = time_now - self->last_change_time;
+    if(self->bitrate > self->params.min_bitrate) {
+        if(since_last_change < DECREASE_INTERVAL_SECS)
+            return false;
+        self->bitrate = max_int64(self->params.min_bitrate, (int64_t)(self->bitrate * DECREASE_FACTOR));
+        self->stats.lowest_bitrate = min_int64(self->stats.lowest_bitrate, self->bitrate);
+        ++self->stats.num_decreases;
+        return true;
+    }
+
+    /* Last resort, the bitrate can't be reduced further */
+    if(self->frame_rate_divisor < self->params.max_frame_rate_divisor && since_last_change >= FRAME_RATE_DECREASE_INTERVAL_SECS) {
+        self->frame_rate_divisor *= 2;
+        if(self->frame_rate_divisor > self->params.max_frame_rate_divisor)
+            self->frame_rate_divisor = self->params.max_frame_rate_divisor;
+        ++self->stats.num_decreases;
+        return true;
+    }
+
+    return false;
+}
+
+static bool increase(gsr_bitrate_controller *self, double time_now) {
+    if(time_now - self->clear_since_time < INCREASE_INTERVAL_SECS || time_now - self->last_change_time < INCREASE_INTERVAL_SECS)
+        return false;
+
+    /* The frame rate is restored first */
+    if(self->frame_rate_divisor > 1) {
+        self->frame_rate_divisor /= 2;
+        ++self->stats.num_increases;
+        return true;
+    }
+
+    if(self->bitrate < self->params.max_bitrate) {
+        self->bitrate = min_int64(self->params.max_bitrate, self->bitrate + (int64_t)(self->params.max_bitrate * INCREASE_STEP));
+        ++self->stats.num_increases;
+        return true;
+    }
+
+    return false;
+}
+
+bool gsr_bitrate_controller_update(gsr_bitrate_controller *self, const gsr_bitrate_controller_input *input, double time_now) {
+    const double elapsed = time_now - self->last_update_time;
+    if(elapsed < UPDATE_INTERVAL_SECS)
+        return false;
+    self->last_update_time = time_now;
+
+    if(self->frame_rate_divisor > 1)
+        self->stats.reduced_frame_rate_secs += elapsed;
+
+    double write_load = (input->write_secs - self->prev_write_secs) / elapsed;
+    if(write_load < 0.0)
+        write_load = 0.0;
+    else if(write_load > 1.0)
+        write_load = 1.0;
+    self->prev_write_secs = input->write_secs;
+
+    const double backlog_secs = (double)input->backlog_bytes * 8.0 / (double)self->bitrate;
+    const bool congested = input->disconnected || backlog_secs > CONGESTED_BACKLOG_SECS || write_load > CONGESTED_WRITE_LOAD;
+    const bool clear = !input->disconnected && backlog_secs < CLEAR_BACKLOG_SECS && write_load < CLEAR_WRITE_LOAD;
+
+    self->stats.backlog_secs = backlog_secs;
+    self->stats.write_load = write_load;
+    self->stats.congested = congested;
+
+    bool changed = false;
+    if(congested) {
+        self->clear_since_time = -1.0;
+        changed = decrease(self, time_now);
+    } else if(clear) {
+        if(self->clear_since_time < 0.0)
+            self->clear_since_time = time_now;
+        changed = increase(self, time_now);
+    } else {
+        self->clear_since_time = -1.0;
+    }
+
+    if(changed)
+        self->last_change_time = time_now;
+    return changed;
+}
+
+int64_t gsr_bitrate_controller_get_bitrate(const gsr_bitrate_controller *self) {
+    return self->bitrate;
+}
+
+int gsr_bitrate_controller_get_frame_rate_divisor(const gsr_bitrate_controller *self) {
+    return self->frame_rate_divisor;
+}
+
+void gsr_bitrate_controller_get_stats(const gsr_bitrate_controller *self, gsr_bitrate_controller_stats *stats) {
+    *stats = self->stats;
+    stats->bitrate = self->bitrate;
+    stats->frame_rate_divisor = self->frame_rate_divisor;
+}
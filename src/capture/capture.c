@@ -42,6 +42,24 @@ int gsr_capture_capture(gsr_capture *cap, AVFrame *frame) {
     return cap->capture(cap, frame);
 }
 
+bool gsr_capture_is_damaged(gsr_capture *cap) {
+    if(!cap->is_damaged)
+        return true;
+    return cap->is_damaged(cap);
+}
+
+void gsr_capture_clear_damage(gsr_capture *cap) {
+    if(cap->clear_damage)
+        cap->clear_damage(cap);
+}
+
+bool gsr_capture_get_damage_stats(gsr_capture *cap, gsr_capture_damage_stats *stats) {
+    if(!cap->get_damage_stats)
+        return false;
+    cap->get_damage_stats(cap, stats);
+    return true;
+}
+
 void gsr_capture_destroy(gsr_capture *cap, AVCodecContext *video_codec_context) {
     cap->destroy(cap, video_codec_context);
 }
@@ -23,6 +23,8 @@ typedef struct {
 
     gsr_cuda cuda;
     bool frame_initialized;
+    bool damaged;
+    CUdeviceptr_v2 grab_buffer; /* Set by NvFBC, the next grab writes to the same buffer */
 } gsr_capture_nvfbc;
 
 #if defined(_WIN64) || defined(__LP64__)
@@ -402,18 +404,59 @@ static int gsr_capture_nvfbc_capture(gsr_capture *cap, AVFrame *frame) {
         return -1;
     }
 
+    /* With NOWAIT the grab returns the last frame immediately, bIsNewFrame tells if the screen has been updated since the previous grab */
+    if(frame_info.bIsNewFrame)
+        cap_nvfbc->damaged = true;
+
     /*
         *byte_size = frame_info.dwByteSize;
 
-        TODO: Check bIsNewFrame
         TODO: Check dwWidth and dwHeight and update size in video output in ffmpeg. This can happen when xrandr is used to change monitor resolution
     */
 
+    /*
+        The frame is encoded directly from the NvFBC buffer, unless it has its own buffer (a frame from the hardware frame pool).
+        The NvFBC buffer is overwritten by the next grab, so it has to be copied when the frame is still being encoded at that point.
+    */
+    if(frame->data[0] && frame->data[0] != (uint8_t*)cap_nvfbc->grab_buffer) {
+        CUDA_MEMCPY2D memcpy_struct;
+        memset(&memcpy_struct, 0, sizeof(memcpy_struct));
+        memcpy_struct.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+        memcpy_struct.srcDevice = cu_device_ptr;
+        memcpy_struct.srcPitch = frame->width * 4;
+        memcpy_struct.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+        memcpy_struct.dstDevice = (CUdeviceptr_v2)frame->data[0];
+        memcpy_struct.dstPitch = frame->linesize[0];
+        memcpy_struct.WidthInBytes = frame->width * 4;
+        memcpy_struct.Height = frame->height;
+
+        CUcontext old_ctx;
+        cap_nvfbc->cuda.cuCtxPushCurrent_v2(cap_nvfbc->cuda.cu_ctx);
+        const CUresult res = cap_nvfbc->cuda.cuMemcpy2D_v2(&memcpy_struct);
+        cap_nvfbc->cuda.cuCtxPopCurrent_v2(&old_ctx);
+        if(res != CUDA_SUCCESS) {
+            fprintf(stderr, "gsr error: gsr_capture_nvfbc_capture: failed to copy the frame\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    cap_nvfbc->grab_buffer = cu_device_ptr;
     frame->data[0] = (uint8_t*)cu_device_ptr;
     frame->linesize[0] = frame->width * 4;
     return 0;
 }
 
+static bool gsr_capture_nvfbc_is_damaged(gsr_capture *cap) {
+    gsr_capture_nvfbc *cap_nvfbc = cap->priv;
+    return cap_nvfbc->damaged;
+}
+
+static void gsr_capture_nvfbc_clear_damage(gsr_capture *cap) {
+    gsr_capture_nvfbc *cap_nvfbc = cap->priv;
+    cap_nvfbc->damaged = false;
+}
+
 static void gsr_capture_nvfbc_destroy(gsr_capture *cap, AVCodecContext *video_codec_context) {
     gsr_capture_nvfbc *cap_nvfbc = cap->priv;
     gsr_capture_nvfbc_destroy_session(cap);
@@ -463,12 +506,15 @@ gsr_capture* gsr_capture_nvfbc_create(const gsr_capture_nvfbc_params *params) {
     cap_nvfbc->params = *params;
     cap_nvfbc->params.display_to_capture = display_to_capture;
     cap_nvfbc->params.fps = max_int(cap_nvfbc->params.fps, 1);
+    cap_nvfbc->damaged = true;
     
     *cap = (gsr_capture) {
         .start = gsr_capture_nvfbc_start,
         .tick = gsr_capture_nvfbc_tick,
         .should_stop = NULL,
         .capture = gsr_capture_nvfbc_capture,
+        .is_damaged = gsr_capture_nvfbc_is_damaged,
+        .clear_damage = gsr_capture_nvfbc_clear_damage,
         .destroy = gsr_capture_nvfbc_destroy,
         .priv = cap_nvfbc
     };
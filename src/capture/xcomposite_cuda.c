@@ -3,6 +3,7 @@
 #include "../../include/cuda.h"
 #include "../../include/window_texture.h"
 #include "../../include/time.h"
+#include "../../include/damage.h"
 #include <X11/extensions/Xcomposite.h>
 #include <libavutil/hwcontext.h>
 #include <libavutil/hwcontext_cuda.h>
@@ -28,6 +29,12 @@ typedef struct {
     WindowTexture window_texture;
     Atom net_active_window_atom;
 
+    gsr_damage damage;
+    bool frame_damaged; /* Cleared by |gsr_capture_clear_damage| */
+    uint64_t num_copies;
+    uint64_t num_copies_skipped;
+    uint8_t *last_copy_data; /* The frame buffer the window was last copied to */
+
     CUgraphicsResource cuda_graphics_resource;
     CUarray mapped_array;
 
@@ -184,6 +191,8 @@ static int gsr_capture_xcomposite_cuda_start(gsr_capture *cap, AVCodecContext *v
 
     XSelectInput(cap_xcomp->dpy, cap_xcomp->window, StructureNotifyMask | ExposureMask);
 
+    gsr_damage_init(&cap_xcomp->damage, cap_xcomp->dpy, cap_xcomp->window);
+
     if(!gsr_egl_load(&cap_xcomp->egl, cap_xcomp->dpy)) {
         fprintf(stderr, "gsr error: gsr_capture_xcomposite_cuda_start: failed to load opengl\n");
         return -1;
@@ -269,6 +278,7 @@ static void gsr_capture_xcomposite_cuda_stop(gsr_capture *cap, AVCodecContext *v
 
     gsr_egl_unload(&cap_xcomp->egl);
     if(cap_xcomp->dpy) {
+        gsr_damage_deinit(&cap_xcomp->damage);
         XCloseDisplay(cap_xcomp->dpy);
         cap_xcomp->dpy = NULL;
     }
@@ -305,6 +315,8 @@ static void gsr_capture_xcomposite_cuda_tick(gsr_capture *cap, AVCodecContext *v
         cap_xcomp->window_resized = true;
     }
 
+    gsr_damage_update(&cap_xcomp->damage);
+
     if(XCheckTypedWindowEvent(cap_xcomp->dpy, cap_xcomp->window, ConfigureNotify, &cap_xcomp->xev) && cap_xcomp->xev.xconfigure.window == cap_xcomp->window) {
         while(XCheckTypedWindowEvent(cap_xcomp->dpy, cap_xcomp->window, ConfigureNotify, &cap_xcomp->xev)) {}
 
@@ -324,6 +336,7 @@ static void gsr_capture_xcomposite_cuda_tick(gsr_capture *cap, AVCodecContext *v
             XSelectInput(cap_xcomp->dpy, cap_xcomp->window, 0);
             cap_xcomp->window = focused_window;
             XSelectInput(cap_xcomp->dpy, cap_xcomp->window, StructureNotifyMask | ExposureMask);
+            gsr_damage_set_target(&cap_xcomp->damage, cap_xcomp->window);
 
             XWindowAttributes attr;
             attr.width = 0;
@@ -354,6 +367,8 @@ static void gsr_capture_xcomposite_cuda_tick(gsr_capture *cap, AVCodecContext *v
     const double window_resize_timeout = 1.0; // 1 second
     if(cap_xcomp->window_resized && clock_get_monotonic_seconds() - cap_xcomp->window_resize_timer >= window_resize_timeout) {
         cap_xcomp->window_resized = false;
+        /* The texture and frame are recreated below so the window has to be copied again */
+        gsr_damage_set_damaged(&cap_xcomp->damage);
         if(window_texture_on_resize(&cap_xcomp->window_texture) != 0) {
             fprintf(stderr, "gsr error: gsr_capture_xcomposite_cuda_tick: window_texture_on_resize failed\n");
             //cap_xcomp->should_stop = true;
@@ -420,6 +435,19 @@ static bool gsr_capture_xcomposite_cuda_should_stop(gsr_capture *cap, bool *err)
 static int gsr_capture_xcomposite_cuda_capture(gsr_capture *cap, AVFrame *frame) {
     gsr_capture_xcomposite_cuda *cap_xcomp = cap->priv;
 
+    /* The frame still contains the last copy of the window when nothing has changed, unless a different frame from the pool is used */
+    const bool damaged = gsr_damage_is_damaged(&cap_xcomp->damage);
+    if(!damaged && frame->data[0] == cap_xcomp->last_copy_data) {
+        ++cap_xcomp->num_copies_skipped;
+        return 0;
+    }
+    if(damaged) {
+        gsr_damage_clear(&cap_xcomp->damage);
+        cap_xcomp->frame_damaged = true;
+    }
+    ++cap_xcomp->num_copies;
+    cap_xcomp->last_copy_data = frame->data[0];
+
     vec2i source_pos = { 0, 0 };
     vec2i source_size = cap_xcomp->texture_size;
 
@@ -461,6 +489,24 @@ static int gsr_capture_xcomposite_cuda_capture(gsr_capture *cap, AVFrame *frame)
     return 0;
 }
 
+static bool gsr_capture_xcomposite_cuda_is_damaged(gsr_capture *cap) {
+    gsr_capture_xcomposite_cuda *cap_xcomp = cap->priv;
+    return cap_xcomp->frame_damaged;
+}
+
+static void gsr_capture_xcomposite_cuda_clear_damage(gsr_capture *cap) {
+    gsr_capture_xcomposite_cuda *cap_xcomp = cap->priv;
+    cap_xcomp->frame_damaged = false;
+}
+
+static void gsr_capture_xcomposite_cuda_get_damage_stats(gsr_capture *cap, gsr_capture_damage_stats *stats) {
+    gsr_capture_xcomposite_cuda *cap_xcomp = cap->priv;
+    stats->num_damage_updates = cap_xcomp->damage.num_damage_updates;
+    stats->damaged_area = cap_xcomp->damage.damaged_area;
+    stats->num_copies = cap_xcomp->num_copies;
+    stats->num_copies_skipped = cap_xcomp->num_copies_skipped;
+}
+
 static void gsr_capture_xcomposite_cuda_destroy(gsr_capture *cap, AVCodecContext *video_codec_context) {
     if(cap->priv) {
         gsr_capture_xcomposite_cuda_stop(cap, video_codec_context);
@@ -502,6 +548,9 @@ gsr_capture* gsr_capture_xcomposite_cuda_create(const gsr_capture_xcomposite_cud
         .tick = gsr_capture_xcomposite_cuda_tick,
         .should_stop = gsr_capture_xcomposite_cuda_should_stop,
         .capture = gsr_capture_xcomposite_cuda_capture,
+        .is_damaged = gsr_capture_xcomposite_cuda_is_damaged,
+        .clear_damage = gsr_capture_xcomposite_cuda_clear_damage,
+        .get_damage_stats = gsr_capture_xcomposite_cuda_get_damage_stats,
         .destroy = gsr_capture_xcomposite_cuda_destroy,
         .priv = cap_xcomp
     };
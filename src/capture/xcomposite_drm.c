@@ -2,6 +2,7 @@
 #include "../../include/egl.h"
 #include "../../include/window_texture.h"
 #include "../../include/time.h"
+#include "../../include/damage.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <X11/Xlib.h>
@@ -27,6 +28,11 @@ typedef struct {
     
     WindowTexture window_texture;
 
+    gsr_damage damage;
+    bool frame_damaged; /* Cleared by |gsr_capture_clear_damage| */
+    uint64_t num_copies;
+    uint64_t num_copies_skipped;
+
     gsr_egl egl;
 
     int fourcc;
@@ -397,6 +403,7 @@ static int gsr_capture_xcomposite_drm_start(gsr_capture *cap, AVCodecContext *vi
 
     // TODO: Get select and add these on top of it and then restore at the end. Also do the same in other xcomposite
     XSelectInput(cap_xcomp->dpy, cap_xcomp->params.window, StructureNotifyMask | ExposureMask);
+    gsr_damage_init(&cap_xcomp->damage, cap_xcomp->dpy, cap_xcomp->params.window);
 
     if(!gsr_egl_load(&cap_xcomp->egl, cap_xcomp->dpy)) {
         fprintf(stderr, "gsr error: gsr_capture_xcomposite_start: failed to load opengl\n");
@@ -720,7 +727,10 @@ static void gsr_capture_xcomposite_drm_tick(gsr_capture *cap, AVCodecContext *vi
         // Clear texture with black background because the source texture (window_texture_get_opengl_texture_id(&cap_xcomp->window_texture))
         // might be smaller than cap_xcomp->target_texture_id
         cap_xcomp->egl.glClearTexImage(cap_xcomp->target_texture_id, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        gsr_damage_set_damaged(&cap_xcomp->damage);
     }
+
+    gsr_damage_update(&cap_xcomp->damage);
 }
 
 static bool gsr_capture_xcomposite_drm_should_stop(gsr_capture *cap, bool *err) {
@@ -779,6 +789,15 @@ static int gsr_capture_xcomposite_drm_capture(gsr_capture *cap, AVFrame *frame)
     gsr_capture_xcomposite_drm *cap_xcomp = cap->priv;
     vec2i source_size = cap_xcomp->texture_size;
 
+    /* The target texture (which the frame is mapped to) still contains the last copy of the window when nothing has changed */
+    if(!gsr_damage_is_damaged(&cap_xcomp->damage)) {
+        ++cap_xcomp->num_copies_skipped;
+        return 0;
+    }
+    gsr_damage_clear(&cap_xcomp->damage);
+    cap_xcomp->frame_damaged = true;
+    ++cap_xcomp->num_copies;
+
     #if 1
     /* TODO: Remove this copy, which is only possible by using nvenc directly and encoding window_pixmap.target_texture_id */
     cap_xcomp->egl.glCopyImageSubData(
@@ -823,9 +842,29 @@ static int gsr_capture_xcomposite_drm_capture(gsr_capture *cap, AVFrame *frame)
     return 0;
 }
 
+static bool gsr_capture_xcomposite_drm_is_damaged(gsr_capture *cap) {
+    gsr_capture_xcomposite_drm *cap_xcomp = cap->priv;
+    return cap_xcomp->frame_damaged;
+}
+
+static void gsr_capture_xcomposite_drm_clear_damage(gsr_capture *cap) {
+    gsr_capture_xcomposite_drm *cap_xcomp = cap->priv;
+    cap_xcomp->frame_damaged = false;
+}
+
+static void gsr_capture_xcomposite_drm_get_damage_stats(gsr_capture *cap, gsr_capture_damage_stats *stats) {
+    gsr_capture_xcomposite_drm *cap_xcomp = cap->priv;
+    stats->num_damage_updates = cap_xcomp->damage.num_damage_updates;
+    stats->damaged_area = cap_xcomp->damage.damaged_area;
+    stats->num_copies = cap_xcomp->num_copies;
+    stats->num_copies_skipped = cap_xcomp->num_copies_skipped;
+}
+
 static void gsr_capture_xcomposite_drm_destroy(gsr_capture *cap, AVCodecContext *video_codec_context) {
     (void)video_codec_context;
     if(cap->priv) {
+        gsr_capture_xcomposite_drm *cap_xcomp = cap->priv;
+        gsr_damage_deinit(&cap_xcomp->damage);
         free(cap->priv);
         cap->priv = NULL;
     }
@@ -864,6 +903,9 @@ gsr_capture* gsr_capture_xcomposite_drm_create(const gsr_capture_xcomposite_drm_
         .tick = gsr_capture_xcomposite_drm_tick,
         .should_stop = gsr_capture_xcomposite_drm_should_stop,
         .capture = gsr_capture_xcomposite_drm_capture,
+        .is_damaged = gsr_capture_xcomposite_drm_is_damaged,
+        .clear_damage = gsr_capture_xcomposite_drm_clear_damage,
+        .get_damage_stats = gsr_capture_xcomposite_drm_get_damage_stats,
         .destroy = gsr_capture_xcomposite_drm_destroy,
         .priv = cap_xcomp
     };
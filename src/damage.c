@@ -0,0 +1,96 @@
+#include "../include/damage.h"
+#include <stdio.h>
+#include <string.h>
+
+bool gsr_damage_init(gsr_damage *self, Display *display, Window window) {
+    memset(self, 0, sizeof(*self));
+    self->display = display;
+    self->damaged = true;
+
+    int damage_error = 0;
+    int fixes_event = 0;
+    int fixes_error = 0;
+    if(!XDamageQueryExtension(display, &self->damage_event, &damage_error) || !XFixesQueryExtension(display, &fixes_event, &fixes_error)) {
+        fprintf(stderr, "gsr warning: gsr_damage_init: XDamage is not available, all frames will be treated as changed\n");
+        self->damage_event = 0;
+        return false;
+    }
+
+    self->region = XFixesCreateRegion(display, NULL, 0);
+    gsr_damage_set_target(self, window);
+    return true;
+}
+
+void gsr_damage_deinit(gsr_damage *self) {
+    if(self->damage) {
+        XDamageDestroy(self->display, self->damage);
+        self->damage = None;
+    }
+
+    if(self->region) {
+        XFixesDestroyRegion(self->display, self->region);
+        self->region = None;
+    }
+}
+
+void gsr_damage_set_target(gsr_damage *self, Window window) {
+    self->damaged = true;
+    self->window = window;
+    if(!self->damage_event)
+        return;
+
+    if(self->damage) {
+        XDamageDestroy(self->display, self->damage);
+        self->damage = None;
+    }
+
+    if(window)
+        self->damage = XDamageCreate(self->display, window, XDamageReportNonEmpty);
+}
+
+static uint64_t region_get_area(Display *display, XserverRegion region) {
+    int num_rects = 0;
+    XRectangle *rects = XFixesFetchRegion(display, region, &num_rects);
+    if(!rects)
+        return 0;
+
+    uint64_t area = 0;
+    for(int i = 0; i < num_rects; ++i) {
+        area += (uint64_t)rects[i].width * (uint64_t)rects[i].height;
+    }
+    XFree(rects);
+    return area;
+}
+
+void gsr_damage_update(gsr_damage *self) {
+    if(!self->damage_event)
+        return;
+
+    /* With XDamageReportNonEmpty there is only one event until the damage is subtracted */
+    XEvent xev;
+    bool damage_notify = false;
+    while(XCheckTypedEvent(self->display, self->damage_event + XDamageNotify, &xev)) {
+        damage_notify = true;
+    }
+
+    if(!damage_notify || !self->damage)
+        return;
+
+    /* The damage is subtracted right away so that changes made after this generate a new event */
+    XDamageSubtract(self->display, self->damage, None, self->region);
+    self->damaged = true;
+    ++self->num_damage_updates;
+    self->damaged_area += region_get_area(self->display, self->region);
+}
+
+void gsr_damage_set_damaged(gsr_damage *self) {
+    self->damaged = true;
+}
+
+bool gsr_damage_is_damaged(const gsr_damage *self) {
+    return !self->damage || self->damaged;
+}
+
+void gsr_damage_clear(gsr_damage *self) {
+    self->damaged = false;
+}
@@ -0,0 +1,462 @@
+#define _GNU_SOURCE
+#include "../include/file_writer.h"
+#include <libavformat/avformat.h>
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Alignment of buffers, sizes and file offsets required by O_DIRECT on all common filesystems */
+#define FILE_ALIGNMENT 4096
+/* Number of buffers that can be written asynchronously at the same time with io_uring */
+#define NUM_BUFFERS 4
+#define AVIO_BUFFER_SIZE (256 * 1024)
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    int64_t offset; /* File offset of the first byte in the buffer */
+    size_t submitted_size; /* Number of bytes from the start of the buffer that were submitted to io_uring */
+    bool in_flight; /* Submitted to io_uring and not completed yet */
+} gsr_file_writer_buffer;
+
+typedef struct {
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_sqe *sqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} gsr_io_uring;
+
+struct gsr_file_writer {
+    gsr_file_writer_params params;
+    int fd;
+    int direct_fd; /* -1 if O_DIRECT is not used */
+    AVIOContext *avio_context;
+
+    gsr_file_writer_buffer buffers[NUM_BUFFERS];
+    int buffer_index;
+
+    gsr_io_uring ring;
+    bool use_io_uring;
+
+    int64_t position; /* Where the next data from the AVIOContext is written */
+    int64_t file_size;
+    int64_t preallocated_size;
+    bool failed;
+    gsr_file_writer_stats stats;
+};
+
+static size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void io_uring_deinit(gsr_io_uring *self) {
+    if(self->sqes)
+        munmap(self->sqes, self->sqes_size);
+    if(self->cq_ring && self->cq_ring != self->sq_ring)
+        munmap(self->cq_ring, self->cq_ring_size);
+    if(self->sq_ring)
+        munmap(self->sq_ring, self->sq_ring_size);
+    if(self->fd > 0)
+        close(self->fd);
+    memset(self, 0, sizeof(*self));
+}
+
+static bool io_uring_init(gsr_io_uring *self, unsigned int num_entries) {
+    memset(self, 0, sizeof(*self));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    self->fd = sys_io_uring_setup(num_entries, &params);
+    if(self->fd < 0) {
+        self->fd = 0;
+        return false;
+    }
+
+    self->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    self->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(single_mmap) {
+        if(self->cq_ring_size > self->sq_ring_size)
+            self->sq_ring_size = self->cq_ring_size;
+        self->cq_ring_size = self->sq_ring_size;
+    }
+
+    self->sq_ring = mmap(NULL, self->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, self->fd, IORING_OFF_SQ_RING);
+    if(self->sq_ring == MAP_FAILED) {
+        self->sq_ring = NULL;
+        io_uring_deinit(self);
+        return false;
+    }
+
+    if(single_mmap) {
+        self->cq_ring = self->sq_ring;
+    } else {
+        self->cq_ring = mmap(NULL, self->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, self->fd, IORING_OFF_CQ_RING);
+        if(self->cq_ring == MAP_FAILED) {
+            self->cq_ring = NULL;
+            io_uring_deinit(self);
+            return false;
+        }
+    }
+
+    self->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    self->sqes = mmap(NULL, self->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, self->fd, IORING_OFF_SQES);
+    if(self->sqes == MAP_FAILED) {
+        self->sqes = NULL;
+        io_uring_deinit(self);
+        return false;
+    }
+
+    uint8_t *sq_ring = self->sq_ring;
+    self->sq_head = (unsigned int*)(sq_ring + params.sq_off.head);
+    self->sq_tail = (unsigned int*)(sq_ring + params.sq_off.tail);
+    self->sq_mask = (unsigned int*)(sq_ring + params.sq_off.ring_mask);
+    self->sq_array = (unsigned int*)(sq_ring + params.sq_off.array);
+
+    uint8_t *cq_ring = self->cq_ring;
+    self->cq_head = (unsigned int*)(cq_ring + params.cq_off.head);
+    self->cq_tail = (unsigned int*)(cq_ring + params.cq_off.tail);
+    self->cq_mask = (unsigned int*)(cq_ring + params.cq_off.ring_mask);
+    self->cqes = (struct io_uring_cqe*)(cq_ring + params.cq_off.cqes);
+    return true;
+}
+
+static bool write_sync(gsr_file_writer *self, int fd, const uint8_t *data, size_t size, int64_t offset) {
+    while(size > 0) {
+        ++self->stats.num_write_syscalls;
+        const ssize_t bytes_written = pwrite(fd, data, size, offset);
+        if(bytes_written == -1) {
+            if(errno == EINTR)
+                continue;
+            fprintf(stderr, "gsr error: gsr_file_writer: failed to write to file, error: %s\n", strerror(errno));
+            self->failed = true;
+            return false;
+        }
+        data += bytes_written;
+        size -= bytes_written;
+        offset += bytes_written;
+        self->stats.bytes_written += bytes_written;
+    }
+    return true;
+}
+
+static void preallocate(gsr_file_writer *self, int64_t end) {
+    if(self->params.preallocate_size == 0 || end <= self->preallocated_size)
+        return;
+
+    /* FALLOC_FL_KEEP_SIZE keeps the file size correct while recording, the space after the end of the file is released when the file is closed */
+    const int64_t new_preallocated_size = align_up(end, self->params.preallocate_size);
+    ++self->stats.num_fallocate_syscalls;
+    if(fallocate(self->fd, FALLOC_FL_KEEP_SIZE, self->preallocated_size, new_preallocated_size - self->preallocated_size) == -1) {
+        fprintf(stderr, "gsr warning: gsr_file_writer: failed to preallocate disk space, error: %s. Disabling preallocation\n", strerror(errno));
+        self->params.preallocate_size = 0;
+        return;
+    }
+    self->preallocated_size = new_preallocated_size;
+}
+
+static void process_completions(gsr_file_writer *self) {
+    gsr_io_uring *ring = &self->ring;
+    unsigned int head = *ring->cq_head;
+    const unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while(head != tail) {
+        const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        gsr_file_writer_buffer *buffer = &self->buffers[cqe->user_data];
+        const size_t size = buffer->submitted_size;
+        if(cqe->res < 0) {
+            /* For example if the kernel doesn't support IORING_OP_WRITE. Write it again synchronously and don't use io_uring anymore */
+            self->use_io_uring = false;
+            write_sync(self, self->fd, buffer->data, size, buffer->offset);
+        } else {
+            self->stats.bytes_written += cqe->res;
+            if((size_t)cqe->res < size)
+                write_sync(self, self->fd, buffer->data + cqe->res, size - cqe->res, buffer->offset + cqe->res);
+        }
+        buffer->in_flight = false;
+        ++head;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static bool has_buffers_in_flight(const gsr_file_writer *self) {
+    for(int i = 0; i < NUM_BUFFERS; ++i) {
+        if(self->buffers[i].in_flight)
+            return true;
+    }
+    return false;
+}
+
+/* Waits until |buffer| has been written, or all buffers if |buffer| is NULL */
+static void wait_for_buffers(gsr_file_writer *self, const gsr_file_writer_buffer *buffer) {
+    for(;;) {
+        process_completions(self);
+        if(buffer ? !buffer->in_flight : !has_buffers_in_flight(self))
+            return;
+
+        ++self->stats.num_io_uring_enter_syscalls;
+        if(sys_io_uring_enter(self->ring.fd, 0, 1, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR) {
+            fprintf(stderr, "gsr error: gsr_file_writer: io_uring_enter failed, error: %s\n", strerror(errno));
+            self->failed = true;
+            return;
+        }
+    }
+}
+
+static bool submit_io_uring_write(gsr_file_writer *self, int fd, gsr_file_writer_buffer *buffer, size_t size) {
+    gsr_io_uring *ring = &self->ring;
+    const unsigned int tail = *ring->sq_tail;
+    const unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer->data;
+    sqe->len = size;
+    sqe->off = buffer->offset;
+    sqe->user_data = buffer - self->buffers;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    buffer->submitted_size = size;
+    buffer->in_flight = true;
+    ++self->stats.num_io_uring_enter_syscalls;
+    int ret;
+    while((ret = sys_io_uring_enter(ring->fd, 1, 0, 0)) == -1 && errno == EINTR) {}
+    if(ret != 1) {
+        /* The submission is still in the ring if it wasn't consumed, don't use io_uring anymore and reclaim it */
+        fprintf(stderr, "gsr warning: gsr_file_writer: io_uring_enter failed, error: %s. Falling back to synchronous writes\n", ret == -1 ? strerror(errno) : "submission not consumed");
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        buffer->in_flight = false;
+        self->use_io_uring = false;
+        return false;
+    }
+    return true;
+}
+
+/* Starts writing |buffer| to the file. The buffer can't be modified until it's no longer in flight */
+static void submit_buffer(gsr_file_writer *self, gsr_file_writer_buffer *buffer) {
+    if(buffer->size == 0)
+        return;
+
+    preallocate(self, buffer->offset + buffer->size);
+
+    int fd = self->fd;
+    size_t size = buffer->size;
+    /* O_DIRECT requires aligned offsets and sizes. The unaligned end (at a seek or at the end of the file) is written through the page cache */
+    if(self->direct_fd != -1 && (buffer->offset % FILE_ALIGNMENT) == 0) {
+        const size_t direct_size = buffer->size & ~((size_t)FILE_ALIGNMENT - 1);
+        if(direct_size > 0) {
+            fd = self->direct_fd;
+            size = direct_size;
+        }
+    }
+
+    if(size < buffer->size)
+        write_sync(self, self->fd, buffer->data + size, buffer->size - size, buffer->offset + size);
+
+    if(self->use_io_uring && submit_io_uring_write(self, fd, buffer, size))
+        return;
+
+    write_sync(self, fd, buffer->data, size, buffer->offset);
+}
+
+static gsr_file_writer_buffer* get_current_buffer(gsr_file_writer *self) {
+    return &self->buffers[self->buffer_index];
+}
+
+/* Submits the current buffer and switches to the next buffer. The next buffer starts at |position| */
+static void next_buffer(gsr_file_writer *self) {
+    submit_buffer(self, get_current_buffer(self));
+    /* Synchronous writes are done when they return, so the same buffer can be used again */
+    if(self->use_io_uring)
+        self->buffer_index = (self->buffer_index + 1) % NUM_BUFFERS;
+
+    gsr_file_writer_buffer *buffer = get_current_buffer(self);
+    if(buffer->in_flight)
+        wait_for_buffers(self, buffer);
+    buffer->size = 0;
+    buffer->offset = self->position;
+}
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int avio_write_callback(void *opaque, const uint8_t *buf, int buf_size) {
+#else
+static int avio_write_callback(void *opaque, uint8_t *buf, int buf_size) {
+#endif
+    gsr_file_writer *self = opaque;
+    if(self->failed)
+        return AVERROR(EIO);
+
+    const int total_size = buf_size;
+    while(buf_size > 0) {
+        gsr_file_writer_buffer *buffer = get_current_buffer(self);
+        const size_t copy_size = FFMIN((size_t)buf_size, self->params.buffer_size - buffer->size);
+        memcpy(buffer->data + buffer->size, buf, copy_size);
+        buffer->size += copy_size;
+        buf += copy_size;
+        buf_size -= copy_size;
+        self->position += copy_size;
+        if(self->position > self->file_size)
+            self->file_size = self->position;
+
+        if(buffer->size == self->params.buffer_size)
+            next_buffer(self);
+    }
+
+    return self->failed ? AVERROR(EIO) : total_size;
+}
+
+static int64_t avio_seek_callback(void *opaque, int64_t offset, int whence) {
+    gsr_file_writer *self = opaque;
+    whence &= ~AVSEEK_FORCE;
+    if(whence == AVSEEK_SIZE)
+        return self->file_size;
+
+    int64_t new_position = 0;
+    switch(whence) {
+        case SEEK_SET: new_position = offset; break;
+        case SEEK_CUR: new_position = self->position + offset; break;
+        case SEEK_END: new_position = self->file_size + offset; break;
+        default: return AVERROR(EINVAL);
+    }
+
+    if(new_position < 0)
+        return AVERROR(EINVAL);
+
+    if(new_position != self->position) {
+        self->position = new_position;
+        next_buffer(self);
+        /* Writes to the same part of the file have to complete in order */
+        if(self->ring.fd > 0)
+            wait_for_buffers(self, NULL);
+    }
+    return new_position;
+}
+
+gsr_file_writer* gsr_file_writer_create(const char *filepath, const gsr_file_writer_params *params) {
+    gsr_file_writer *self = calloc(1, sizeof(gsr_file_writer));
+    if(!self) {
+        fprintf(stderr, "gsr error: gsr_file_writer_create: failed to allocate file writer\n");
+        return NULL;
+    }
+
+    self->params = *params;
+    self->params.buffer_size = align_up(params->buffer_size > 0 ? params->buffer_size : FILE_ALIGNMENT, FILE_ALIGNMENT);
+    self->direct_fd = -1;
+
+    self->fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(self->fd == -1) {
+        fprintf(stderr, "gsr error: gsr_file_writer_create: failed to open %s, error: %s\n", filepath, strerror(errno));
+        free(self);
+        return NULL;
+    }
+
+    if(params->direct_io) {
+        self->direct_fd = open(filepath, O_WRONLY | O_DIRECT | O_CLOEXEC);
+        if(self->direct_fd == -1)
+            fprintf(stderr, "gsr warning: gsr_file_writer_create: O_DIRECT is not supported for %s, error: %s. Writing through the page cache instead\n", filepath, strerror(errno));
+    }
+
+    if(params->io_uring) {
+        self->use_io_uring = io_uring_init(&self->ring, NUM_BUFFERS);
+        if(!self->use_io_uring)
+            fprintf(stderr, "gsr warning: gsr_file_writer_create: io_uring is not available, using synchronous writes instead\n");
+    }
+
+    /* Without io_uring the buffer is written synchronously, so only one buffer is needed */
+    const int num_buffers = self->use_io_uring ? NUM_BUFFERS : 1;
+    for(int i = 0; i < num_buffers; ++i) {
+        if(posix_memalign((void**)&self->buffers[i].data, FILE_ALIGNMENT, self->params.buffer_size) != 0) {
+            fprintf(stderr, "gsr error: gsr_file_writer_create: failed to allocate %zu bytes for write buffer\n", self->params.buffer_size);
+            gsr_file_writer_destroy(self, NULL);
+            return NULL;
+        }
+    }
+
+    uint8_t *avio_buffer = av_malloc(AVIO_BUFFER_SIZE);
+    if(avio_buffer)
+        self->avio_context = avio_alloc_context(avio_buffer, AVIO_BUFFER_SIZE, 1, self, NULL, avio_write_callback, avio_seek_callback);
+    if(!self->avio_context) {
+        fprintf(stderr, "gsr error: gsr_file_writer_create: failed to create AVIOContext\n");
+        av_free(avio_buffer);
+        gsr_file_writer_destroy(self, NULL);
+        return NULL;
+    }
+
+    return self;
+}
+
+bool gsr_file_writer_destroy(gsr_file_writer *self, gsr_file_writer_stats *stats) {
+    if(self->avio_context) {
+        submit_buffer(self, get_current_buffer(self));
+        get_current_buffer(self)->size = 0;
+    }
+
+    if(self->ring.fd > 0) {
+        wait_for_buffers(self, NULL);
+        io_uring_deinit(&self->ring);
+    }
+
+    /* Release the preallocated space after the end of the file */
+    if(self->preallocated_size > self->file_size && ftruncate(self->fd, self->file_size) == -1)
+        fprintf(stderr, "gsr warning: gsr_file_writer_destroy: failed to truncate file, error: %s\n", strerror(errno));
+
+    if(self->avio_context) {
+        av_freep(&self->avio_context->buffer);
+        avio_context_free(&self->avio_context);
+    }
+
+    if(self->direct_fd != -1)
+        close(self->direct_fd);
+    if(self->fd != -1 && close(self->fd) == -1) {
+        fprintf(stderr, "gsr error: gsr_file_writer_destroy: failed to close file, error: %s\n", strerror(errno));
+        self->failed = true;
+    }
+
+    for(int i = 0; i < NUM_BUFFERS; ++i) {
+        free(self->buffers[i].data);
+    }
+
+    if(stats)
+        *stats = self->stats;
+
+    const bool success = !self->failed;
+    free(self);
+    return success;
+}
+
+AVIOContext* gsr_file_writer_get_avio_context(gsr_file_writer *self) {
+    return self->avio_context;
+}
+
+void gsr_file_writer_get_stats(const gsr_file_writer *self, gsr_file_writer_stats *stats) {
+    *stats = self->stats;
+}
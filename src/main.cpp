@@ -4,9 +4,16 @@ extern "C" {
 #include "../include/capture/xcomposite_drm.h"
 #include "../include/egl.h"
 #include "../include/time.h"
+#include "../include/replay_buffer.h"
+#include "../include/packet_queue.h"
+#include "../include/file_writer.h"
+#include "../include/bitrate_controller.h"
+#include "../include/pipe_writer.h"
+#include "../include/thread_config.h"
 }
 
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
@@ -14,7 +21,11 @@ extern "C" {
 #include <unordered_map>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <map>
+#include <deque>
+#include <algorithm>
+#include <atomic>
 #include <signal.h>
 #include <sys/stat.h>
 
@@ -38,7 +49,6 @@ extern "C" {
 #include <libavfilter/buffersrc.h>
 }
 
-#include <deque>
 #include <future>
 
 typedef enum {
@@ -154,14 +164,813 @@ static int x11_io_error_handler(Display *dpy) {
     return 0;
 }
 
-// |stream| is only required for non-replay mode
-static void receive_frames(AVCodecContext *av_codec_context, int stream_index, AVStream *stream, AVFrame *frame,
-                           AVFormatContext *av_format_context,
-                           double replay_start_time,
-                           std::deque<AVPacket> &frame_data_queue,
-                           int replay_buffer_size_secs,
-                           bool &frames_erased,
-						   std::mutex &write_output_mutex) {
+// Without -rm the replay buffer is only limited by its duration. It's then sized for the duration at this bitrate (far above what the encoders output),
+// and the memory (or disk space) is only used as the buffer fills up
+#define REPLAY_BUFFER_MAX_BITRATE (400LL * 1000LL * 1000LL)
+// The replay buffer contains slightly more than its duration since only whole gops are removed from it
+#define REPLAY_BUFFER_MAX_GOP_SECS 10
+
+// Fragments are added to the replay buffer in parts of at most this size, so that a large fragment (a long gop at a high bitrate) fits in a replay buffer slab
+#define REPLAY_FRAGMENT_PART_MAX_SIZE (1024 * 1024)
+
+// Muxes the packets in replay mode into fragmented mp4 when they are received instead of when a replay is saved.
+// Every fragment starts at a video keyframe and is stored in the replay buffer, so saving a replay only requires writing the init segment and the fragments to a file
+struct ReplayFragmentMuxer {
+    AVFormatContext *format_context = nullptr;
+    std::unordered_map<int, AVStream*> stream_index_to_stream_map;
+    std::vector<uint8_t> init_segment;
+    std::vector<uint8_t> fragment_data;
+    int video_stream_index = 0;
+    std::vector<AVPacket> fragment_parts;
+    int num_fragment_packets = 0;
+    bool fragment_starts_with_keyframe = false;
+    double fragment_timestamp = 0.0;
+    uint64_t num_dropped_fragments = 0;
+};
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int replay_fragment_muxer_write(void *opaque, const uint8_t *buf, int buf_size) {
+#else
+static int replay_fragment_muxer_write(void *opaque, uint8_t *buf, int buf_size) {
+#endif
+    ReplayFragmentMuxer *self = (ReplayFragmentMuxer*)opaque;
+    self->fragment_data.insert(self->fragment_data.end(), buf, buf + buf_size);
+    return buf_size;
+}
+
+// Ends the current fragment and adds it to the replay buffer. Has to be called while holding the replay buffer lock
+static void replay_fragment_muxer_flush(ReplayFragmentMuxer *self, gsr_replay_buffer *replay_buffer) {
+    if(self->num_fragment_packets == 0)
+        return;
+
+    av_write_frame(self->format_context, nullptr);
+    avio_flush(self->format_context->pb);
+
+    self->fragment_parts.clear();
+    for(size_t offset = 0; offset < self->fragment_data.size(); offset += REPLAY_FRAGMENT_PART_MAX_SIZE) {
+        AVPacket av_packet;
+        memset(&av_packet, 0, sizeof(av_packet));
+        av_packet.data = self->fragment_data.data() + offset;
+        av_packet.size = std::min((size_t)REPLAY_FRAGMENT_PART_MAX_SIZE, self->fragment_data.size() - offset);
+        av_packet.pts = av_packet.dts = AV_NOPTS_VALUE;
+        // The replay buffer starts replays at video keyframes, so only the first part of a fragment that starts with a keyframe is marked as one
+        av_packet.stream_index = self->video_stream_index;
+        av_packet.flags = (offset == 0 && self->fragment_starts_with_keyframe) ? AV_PKT_FLAG_KEY : 0;
+        self->fragment_parts.push_back(av_packet);
+    }
+
+    // A fragment that is only partially in the replay buffer would corrupt the saved replay, so the parts are added all at once or not at all
+    if(!gsr_replay_buffer_append_all(replay_buffer, self->fragment_parts.data(), self->fragment_parts.size(), self->fragment_timestamp))
+        ++self->num_dropped_fragments;
+
+    self->fragment_data.clear();
+    self->num_fragment_packets = 0;
+}
+
+// Has to be called while holding the replay buffer lock
+static void replay_fragment_muxer_write_packet(ReplayFragmentMuxer *self, gsr_replay_buffer *replay_buffer, AVPacket *av_packet, AVCodecContext *codec_context, double timestamp) {
+    const bool is_video_keyframe = av_packet->stream_index == self->video_stream_index && (av_packet->flags & AV_PKT_FLAG_KEY);
+    if(is_video_keyframe)
+        replay_fragment_muxer_flush(self, replay_buffer);
+
+    if(self->num_fragment_packets == 0) {
+        self->fragment_starts_with_keyframe = is_video_keyframe;
+        self->fragment_timestamp = timestamp;
+    }
+
+    AVStream *stream = self->stream_index_to_stream_map[av_packet->stream_index];
+    av_packet_rescale_ts(av_packet, codec_context->time_base, stream->time_base);
+    av_packet->stream_index = stream->index;
+    int ret = av_write_frame(self->format_context, av_packet);
+    if(ret < 0)
+        fprintf(stderr, "Error: Failed to write frame index %d to replay fragment muxer, reason: %s (%d)\n", av_packet->stream_index, av_error_to_string(ret), ret);
+    ++self->num_fragment_packets;
+}
+
+// Maximum number of packets waiting to be written to the output. This is a few seconds of video and audio
+#define OUTPUT_QUEUE_SIZE 1024
+
+// What to do when a packet is received and the output queue is full
+enum class OutputQueuePolicy {
+    BLOCK,
+    DROP_SILENCE,
+    DROP_VIDEO
+};
+
+// What to do when the program reading from a pipe output (such as stdout) is slower than the recording
+enum class PipePolicy {
+    BLOCK,
+    DROP, // Drop video until the next keyframe once the consumer has caught up
+    ABORT // Stop recording
+};
+
+// Size of the buffer between the muxer and a pipe output
+#define PIPE_BUFFER_SIZE (16 * 1024 * 1024)
+// A packet is only muxed into a pipe output with the drop policy if there is room for the packet and this much container overhead
+#define PIPE_PACKET_OVERHEAD (64 * 1024)
+
+// Network outputs are reconnected when writing to them fails. The delay between attempts is doubled after every failed attempt
+#define OUTPUT_RECONNECT_MIN_DELAY_SECS 1.0
+#define OUTPUT_RECONNECT_MAX_DELAY_SECS 30.0
+// Network reads and writes that take longer than this fail, so that a dead connection is detected
+#define OUTPUT_NETWORK_TIMEOUT_US 5000000
+
+struct OutputSegmenter;
+
+// An output file or stream. Each output has its own muxer and its packets are written in a separate thread,
+// so that a slow disk or network doesn't stall capture and encoding and a failed output doesn't affect the other outputs
+struct OutputWriter {
+    std::string filepath;
+    AVFormatContext *format_context = nullptr; // Only describes the streams when |segmenter| is used
+    gsr_file_writer *file_writer = nullptr;
+    gsr_pipe_writer *pipe_writer = nullptr;
+    OutputSegmenter *segmenter = nullptr;
+    gsr_packet_queue *queue = nullptr;
+    std::thread thread;
+    OutputQueuePolicy policy = OutputQueuePolicy::BLOCK;
+    int video_stream_index = 0;
+    bool drop_video_until_keyframe = false; // Only used by the video thread
+    std::atomic<bool> failed{false}; // Set by the writer thread when the output can't be written to anymore, packets are dropped after that
+    std::atomic<uint64_t> num_dropped_audio_packets{0};
+    std::atomic<uint64_t> num_dropped_video_packets{0};
+    std::vector<AVRational> stream_time_bases; // Time base of the packets in the queue, for each stream. Doesn't change when the output is reconnected
+    // Pipe outputs. Only used by the writer thread, except for |abort_recording|
+    PipePolicy pipe_policy = PipePolicy::BLOCK;
+    bool pipe_drop_until_keyframe = false;
+    uint64_t num_pipe_full = 0; // Number of packets that didn't fit in the pipe buffer
+    uint64_t num_pipe_dropped_packets = 0;
+    double last_pipe_warning_time = 0.0;
+    std::atomic<bool> abort_recording{false};
+
+    // Measured for the bitrate controller
+    std::atomic<int64_t> queued_bytes{0};
+    std::atomic<uint64_t> write_ns{0};
+
+    // Reconnecting. Everything except |disconnected|, |stopping| and |num_dropped_bytes| is only used by the writer thread
+    bool reconnect = false;
+    AVDictionary *header_options = nullptr; // Used again when reconnecting
+    std::atomic<bool> disconnected{false};
+    std::atomic<bool> stopping{false}; // Cancels connection attempts when recording stops
+    std::deque<AVPacket*> backlog; // Packets received while disconnected. Always starts with a video keyframe
+    size_t backlog_size = 0;
+    size_t backlog_max_size = 0;
+    double reconnect_delay_secs = 0.0;
+    double next_reconnect_time = 0.0;
+    int64_t pts_offset = 0; // In the time base of the video stream. The output starts at timestamp 0 again after reconnecting
+    uint64_t num_reconnects = 0;
+    std::atomic<uint64_t> num_dropped_bytes{0};
+    size_t max_backlog_size = 0;
+    size_t max_backlog_packets = 0;
+};
+
+// A reference to |av_packet| is added to the output queue, the packet data is shared between all outputs. |av_packet| is in |time_base|.
+// |is_silence| is true if the packet was encoded from silence that was inserted because of missing audio
+static void output_writer_push(OutputWriter *self, const AVPacket *av_packet, AVRational time_base, bool is_silence) {
+    if(self->failed.load(std::memory_order_relaxed))
+        return;
+
+    // The writer thread might be stuck trying to connect. Capture and encoding have to keep going so packets are dropped instead of waiting
+    if(self->disconnected.load(std::memory_order_relaxed)) {
+        AVPacket *queued_packet = av_packet_alloc();
+        if(!queued_packet || av_packet_ref(queued_packet, av_packet) < 0) {
+            av_packet_free(&queued_packet);
+            return;
+        }
+        av_packet_rescale_ts(queued_packet, time_base, self->stream_time_bases[queued_packet->stream_index]);
+        const int packet_size = queued_packet->size;
+        if(gsr_packet_queue_try_push(self->queue, queued_packet)) {
+            self->queued_bytes += packet_size;
+        } else {
+            self->num_dropped_bytes += packet_size;
+            av_packet_free(&queued_packet);
+        }
+        return;
+    }
+
+    const bool is_video = av_packet->stream_index == self->video_stream_index;
+    if(is_video && self->drop_video_until_keyframe) {
+        if(!(av_packet->flags & AV_PKT_FLAG_KEY)) {
+            ++self->num_dropped_video_packets;
+            return;
+        }
+        self->drop_video_until_keyframe = false;
+    }
+
+    AVPacket *queued_packet = av_packet_alloc();
+    if(!queued_packet || av_packet_ref(queued_packet, av_packet) < 0) {
+        fprintf(stderr, "Error: Failed to allocate packet for the output queue\n");
+        av_packet_free(&queued_packet);
+        return;
+    }
+    av_packet_rescale_ts(queued_packet, time_base, self->stream_time_bases[queued_packet->stream_index]);
+
+    // Counted before pushing since the writer thread can pop the packet right away
+    const int packet_size = queued_packet->size;
+    self->queued_bytes += packet_size;
+    if(gsr_packet_queue_try_push(self->queue, queued_packet))
+        return;
+
+    switch(self->policy) {
+        case OutputQueuePolicy::BLOCK:
+            break;
+        case OutputQueuePolicy::DROP_SILENCE: {
+            if(is_silence) {
+                ++self->num_dropped_audio_packets;
+                self->queued_bytes -= packet_size;
+                av_packet_free(&queued_packet);
+                return;
+            }
+            break;
+        }
+        case OutputQueuePolicy::DROP_VIDEO: {
+            // Keyframes are never dropped. The video can't be decoded after a dropped frame until the next keyframe, unless the frame isn't used as a reference
+            if(is_video && !(queued_packet->flags & AV_PKT_FLAG_KEY)) {
+                if(!(queued_packet->flags & AV_PKT_FLAG_DISPOSABLE))
+                    self->drop_video_until_keyframe = true;
+                ++self->num_dropped_video_packets;
+                self->queued_bytes -= packet_size;
+                av_packet_free(&queued_packet);
+                return;
+            }
+            break;
+        }
+    }
+
+    gsr_packet_queue_push(self->queue, queued_packet);
+}
+
+// A part of a recording that is split into multiple files
+struct OutputSegment {
+    AVFormatContext *format_context = nullptr;
+    gsr_file_writer *file_writer = nullptr;
+    std::string filepath;
+    int64_t start_pts = 0; // Pts of the first video packet, in the time base of the video stream
+    int64_t size = 0;
+};
+
+// Splits the output into multiple files at video keyframes while the encoders keep running.
+// Each file starts at timestamp 0 where the previous file ended. Audio packets that are older than the first video packet of a new file
+// are still written to the previous file, which is closed once every audio stream has passed the split point
+struct OutputSegmenter {
+    // The streams of every file are copies of these streams. Packets are in the time base of these streams. The header is never written to this context
+    const AVFormatContext *stream_template = nullptr;
+    int video_stream_index = 0;
+    std::string filepath_prefix;
+    std::string file_extension;
+    AVDictionary *header_options = nullptr;
+    gsr_file_writer_params file_writer_params;
+    double segment_time_secs = 0.0; // 0 = no time limit
+    size_t segment_size = 0; // 0 = no size limit
+
+    int segment_index = 0;
+    OutputSegment current;
+    OutputSegment previous;
+    std::vector<bool> stream_passed_split;
+    gsr_file_writer_stats file_writer_stats;
+};
+
+static void print_file_writer_stats(const char *filepath, const gsr_file_writer_stats &stats) {
+    fprintf(stderr, "Info: file output %s: wrote %llu bytes with %llu write calls, %llu io_uring_enter calls and %llu fallocate calls\n",
+        filepath, (unsigned long long)stats.bytes_written, (unsigned long long)stats.num_write_syscalls,
+        (unsigned long long)stats.num_io_uring_enter_syscalls, (unsigned long long)stats.num_fallocate_syscalls);
+}
+
+static bool output_segment_open(OutputSegmenter *self, OutputSegment *segment, int64_t start_pts) {
+    ++self->segment_index;
+    char filepath[PATH_MAX];
+    snprintf(filepath, sizeof(filepath), "%s_%03d.%s", self->filepath_prefix.c_str(), self->segment_index, self->file_extension.c_str());
+
+    segment->filepath = filepath;
+    segment->start_pts = start_pts;
+    segment->size = 0;
+
+    avformat_alloc_output_context2(&segment->format_context, self->stream_template->oformat, nullptr, filepath);
+    if(!segment->format_context) {
+        fprintf(stderr, "Error: Failed to create output format context for segment '%s'\n", filepath);
+        return false;
+    }
+    segment->format_context->flags = self->stream_template->flags | AVFMT_FLAG_CUSTOM_IO;
+
+    for(unsigned int i = 0; i < self->stream_template->nb_streams; ++i) {
+        const AVStream *template_stream = self->stream_template->streams[i];
+        AVStream *stream = avformat_new_stream(segment->format_context, nullptr);
+        if(!stream) {
+            fprintf(stderr, "Error: Could not allocate stream\n");
+            exit(1);
+        }
+        stream->id = template_stream->id;
+        stream->time_base = template_stream->time_base;
+        stream->avg_frame_rate = template_stream->avg_frame_rate;
+        avcodec_parameters_copy(stream->codecpar, template_stream->codecpar);
+    }
+
+    segment->file_writer = gsr_file_writer_create(filepath, &self->file_writer_params);
+    if(!segment->file_writer) {
+        fprintf(stderr, "Error: Could not open '%s'\n", filepath);
+        avformat_free_context(segment->format_context);
+        segment->format_context = nullptr;
+        return false;
+    }
+    segment->format_context->pb = gsr_file_writer_get_avio_context(segment->file_writer);
+
+    AVDictionary *options = nullptr;
+    av_dict_copy(&options, self->header_options, 0);
+    int ret = avformat_write_header(segment->format_context, &options);
+    av_dict_free(&options);
+    if(ret < 0) {
+        fprintf(stderr, "Error occurred when writing header to output file '%s': %s\n", filepath, av_error_to_string(ret));
+        gsr_file_writer_destroy(segment->file_writer, nullptr);
+        segment->file_writer = nullptr;
+        segment->format_context->pb = nullptr;
+        avformat_free_context(segment->format_context);
+        segment->format_context = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+// Prints the filepath of the segment to stdout when the file is complete
+static void output_segment_close(OutputSegmenter *self, OutputSegment *segment) {
+    if(!segment->format_context)
+        return;
+
+    if(av_write_trailer(segment->format_context) != 0)
+        fprintf(stderr, "Failed to write trailer\n");
+
+    avio_flush(segment->format_context->pb);
+    gsr_file_writer_stats stats;
+    if(!gsr_file_writer_destroy(segment->file_writer, &stats))
+        fprintf(stderr, "Error: failed to write all data to '%s'\n", segment->filepath.c_str());
+    segment->format_context->pb = nullptr;
+    segment->file_writer = nullptr;
+
+    self->file_writer_stats.num_write_syscalls += stats.num_write_syscalls;
+    self->file_writer_stats.num_io_uring_enter_syscalls += stats.num_io_uring_enter_syscalls;
+    self->file_writer_stats.num_fallocate_syscalls += stats.num_fallocate_syscalls;
+    self->file_writer_stats.bytes_written += stats.bytes_written;
+
+    avformat_free_context(segment->format_context);
+    segment->format_context = nullptr;
+
+    puts(segment->filepath.c_str());
+    fflush(stdout);
+}
+
+// |output_filepath| is split into a prefix and an extension, the segments are named prefix_001.extension, prefix_002.extension...
+static bool output_segmenter_init(OutputSegmenter *self, const AVFormatContext *stream_template, int video_stream_index, const char *output_filepath, const std::string &default_file_extension) {
+    self->stream_template = stream_template;
+    self->video_stream_index = video_stream_index;
+    self->stream_passed_split.resize(stream_template->nb_streams, true);
+    memset(&self->file_writer_stats, 0, sizeof(self->file_writer_stats));
+
+    self->filepath_prefix = output_filepath;
+    self->file_extension = default_file_extension;
+    const size_t dot_index = self->filepath_prefix.rfind('.');
+    const size_t slash_index = self->filepath_prefix.rfind('/');
+    if(dot_index != std::string::npos && (slash_index == std::string::npos || dot_index > slash_index)) {
+        self->file_extension = self->filepath_prefix.substr(dot_index + 1);
+        self->filepath_prefix.erase(dot_index);
+    }
+
+    return output_segment_open(self, &self->current, 0);
+}
+
+static void output_segmenter_deinit(OutputSegmenter *self) {
+    output_segment_close(self, &self->previous);
+    output_segment_close(self, &self->current);
+    av_dict_free(&self->header_options);
+    const std::string filepath_pattern = self->filepath_prefix + "_*." + self->file_extension;
+    print_file_writer_stats(filepath_pattern.c_str(), self->file_writer_stats);
+}
+
+static bool output_segmenter_is_segment_full(const OutputSegmenter *self, const AVPacket *av_packet) {
+    // Try again if the file couldn't be created
+    if(!self->current.format_context)
+        return true;
+
+    const AVStream *video_stream = self->stream_template->streams[self->video_stream_index];
+    if(self->segment_time_secs > 0.0 && (double)(av_packet->pts - self->current.start_pts) * av_q2d(video_stream->time_base) >= self->segment_time_secs)
+        return true;
+    return self->segment_size > 0 && (size_t)self->current.size >= self->segment_size;
+}
+
+// Takes ownership of the packet data
+static void output_segmenter_write_packet(OutputSegmenter *self, AVPacket *av_packet) {
+    const AVStream *video_stream = self->stream_template->streams[self->video_stream_index];
+    const AVStream *stream = self->stream_template->streams[av_packet->stream_index];
+
+    OutputSegment *segment = &self->current;
+    if(av_packet->stream_index == self->video_stream_index) {
+        if((av_packet->flags & AV_PKT_FLAG_KEY) && output_segmenter_is_segment_full(self, av_packet)) {
+            // Audio hasn't caught up since the last split, which should never happen since silence is inserted when there is no audio
+            output_segment_close(self, &self->previous);
+            self->previous = self->current;
+            self->current = OutputSegment();
+            // Packets are dropped until the next keyframe if the file can't be created
+            if(!output_segment_open(self, &self->current, av_packet->pts)) {
+                av_packet_unref(av_packet);
+                return;
+            }
+
+            std::fill(self->stream_passed_split.begin(), self->stream_passed_split.end(), false);
+            self->stream_passed_split[self->video_stream_index] = true;
+            if(std::all_of(self->stream_passed_split.begin(), self->stream_passed_split.end(), [](bool passed) { return passed; }))
+                output_segment_close(self, &self->previous);
+        }
+    } else if(av_compare_ts(av_packet->pts, stream->time_base, self->current.start_pts, video_stream->time_base) < 0) {
+        if(!self->previous.format_context) {
+            // The previous file has already been closed
+            av_packet_unref(av_packet);
+            return;
+        }
+        segment = &self->previous;
+    } else if(self->previous.format_context && !self->stream_passed_split[av_packet->stream_index]) {
+        self->stream_passed_split[av_packet->stream_index] = true;
+        if(std::all_of(self->stream_passed_split.begin(), self->stream_passed_split.end(), [](bool passed) { return passed; }))
+            output_segment_close(self, &self->previous);
+    }
+
+    if(!segment->format_context) {
+        av_packet_unref(av_packet);
+        return;
+    }
+
+    const int64_t pts_offset = av_rescale_q_rnd(segment->start_pts, video_stream->time_base, stream->time_base, AV_ROUND_DOWN);
+    av_packet->pts -= pts_offset;
+    av_packet->dts -= pts_offset;
+    av_packet_rescale_ts(av_packet, stream->time_base, segment->format_context->streams[av_packet->stream_index]->time_base);
+    segment->size += av_packet->size;
+
+    int ret = av_interleaved_write_frame(segment->format_context, av_packet);
+    if(ret < 0)
+        fprintf(stderr, "Error: Failed to write frame index %d to muxer, reason: %s (%d)\n", av_packet->stream_index, av_error_to_string(ret), ret);
+}
+
+static bool is_network_output(const char *filepath) {
+    return strstr(filepath, "://") && strncmp(filepath, "file://", 7) != 0;
+}
+
+static int output_writer_interrupt_callback(void *userdata) {
+    const OutputWriter *self = (const OutputWriter*)userdata;
+    return self->stopping.load(std::memory_order_relaxed) && self->disconnected.load(std::memory_order_relaxed);
+}
+
+// Packets are kept in the backlog until the next connection attempt
+static void output_writer_schedule_reconnect(OutputWriter *self) {
+    self->disconnected = true;
+    self->reconnect_delay_secs = OUTPUT_RECONNECT_MIN_DELAY_SECS;
+    self->next_reconnect_time = clock_get_monotonic_seconds() + self->reconnect_delay_secs;
+}
+
+static bool output_writer_open_network(OutputWriter *self, AVFormatContext *format_context) {
+    format_context->interrupt_callback.callback = output_writer_interrupt_callback;
+    format_context->interrupt_callback.opaque = self;
+
+    AVDictionary *options = nullptr;
+    av_dict_set_int(&options, "rw_timeout", OUTPUT_NETWORK_TIMEOUT_US, 0);
+    int ret = avio_open2(&format_context->pb, self->filepath.c_str(), AVIO_FLAG_WRITE, &format_context->interrupt_callback, &options);
+    av_dict_free(&options);
+    if(ret < 0) {
+        fprintf(stderr, "Error: Could not open '%s': %s\n", self->filepath.c_str(), av_error_to_string(ret));
+        return false;
+    }
+    return true;
+}
+
+// Opens the file or stream and writes the header. Regular files are written with large buffers, anything else (stdout, pipes, urls) goes through ffmpeg.
+// Network outputs are reconnected if connecting or writing fails, up to |backlog_max_size| bytes of packets are kept in memory while reconnecting
+static bool output_writer_open(OutputWriter *self, const gsr_file_writer_params &file_writer_params, size_t backlog_max_size, AVDictionary **header_options) {
+    if(!(self->format_context->oformat->flags & AVFMT_NOFILE)) {
+        const char *filepath = self->filepath.c_str();
+        struct stat output_stat;
+        const bool output_exists = !strstr(filepath, "://") && stat(filepath, &output_stat) == 0;
+        const bool output_is_file = !strstr(filepath, "://") && (!output_exists || S_ISREG(output_stat.st_mode));
+        const bool output_is_pipe = output_exists && (S_ISFIFO(output_stat.st_mode) || S_ISCHR(output_stat.st_mode));
+        if(output_is_pipe)
+            self->pipe_writer = gsr_pipe_writer_create(filepath, PIPE_BUFFER_SIZE);
+
+        if(self->pipe_writer) {
+            self->format_context->pb = gsr_pipe_writer_get_avio_context(self->pipe_writer);
+            self->format_context->flags |= AVFMT_FLAG_CUSTOM_IO;
+        } else if(output_is_file) {
+            self->file_writer = gsr_file_writer_create(filepath, &file_writer_params);
+            if(!self->file_writer) {
+                fprintf(stderr, "Error: Could not open '%s'\n", filepath);
+                return false;
+            }
+            self->format_context->pb = gsr_file_writer_get_avio_context(self->file_writer);
+            self->format_context->flags |= AVFMT_FLAG_CUSTOM_IO;
+        } else if(is_network_output(filepath)) {
+            self->reconnect = true;
+            self->backlog_max_size = backlog_max_size;
+            av_dict_copy(&self->header_options, *header_options, 0);
+            // A server that is down when recording starts is handled the same way as a lost connection
+            if(!output_writer_open_network(self, self->format_context)) {
+                fprintf(stderr, "Warning: failed to connect to '%s', trying again in %.0f seconds\n", filepath, OUTPUT_RECONNECT_MIN_DELAY_SECS);
+                output_writer_schedule_reconnect(self);
+                return true;
+            }
+        } else {
+            if(output_is_pipe)
+                fprintf(stderr, "Warning: failed to open '%s' for non-blocking writes, writing to it directly instead\n", filepath);
+            int ret = avio_open(&self->format_context->pb, filepath, AVIO_FLAG_WRITE);
+            if (ret < 0) {
+                fprintf(stderr, "Error: Could not open '%s': %s\n", filepath, av_error_to_string(ret));
+                return false;
+            }
+        }
+    }
+
+    int ret = avformat_write_header(self->format_context, header_options);
+    if (ret < 0) {
+        fprintf(stderr, "Error occurred when writing header to output file '%s': %s\n", self->filepath.c_str(), av_error_to_string(ret));
+        if(self->reconnect) {
+            fprintf(stderr, "Warning: trying to connect to '%s' again in %.0f seconds\n", self->filepath.c_str(), OUTPUT_RECONNECT_MIN_DELAY_SECS);
+            avio_closep(&self->format_context->pb);
+            output_writer_schedule_reconnect(self);
+            return true;
+        }
+        return false;
+    }
+    return true;
+}
+
+// Creates a new muxer with the same streams, connects and writes the header
+static bool output_writer_connect(OutputWriter *self) {
+    AVFormatContext *format_context = nullptr;
+    avformat_alloc_output_context2(&format_context, self->format_context->oformat, nullptr, self->filepath.c_str());
+    if(!format_context)
+        return false;
+    format_context->flags = self->format_context->flags;
+
+    for(unsigned int i = 0; i < self->format_context->nb_streams; ++i) {
+        const AVStream *prev_stream = self->format_context->streams[i];
+        AVStream *stream = avformat_new_stream(format_context, nullptr);
+        if(!stream) {
+            avformat_free_context(format_context);
+            return false;
+        }
+        stream->id = prev_stream->id;
+        stream->time_base = self->stream_time_bases[i];
+        stream->avg_frame_rate = prev_stream->avg_frame_rate;
+        avcodec_parameters_copy(stream->codecpar, prev_stream->codecpar);
+    }
+
+    if(!output_writer_open_network(self, format_context)) {
+        avformat_free_context(format_context);
+        return false;
+    }
+
+    AVDictionary *options = nullptr;
+    av_dict_copy(&options, self->header_options, 0);
+    int ret = avformat_write_header(format_context, &options);
+    av_dict_free(&options);
+    if(ret < 0) {
+        fprintf(stderr, "Error occurred when writing header to output file '%s': %s\n", self->filepath.c_str(), av_error_to_string(ret));
+        avio_closep(&format_context->pb);
+        avformat_free_context(format_context);
+        return false;
+    }
+
+    avformat_free_context(self->format_context);
+    self->format_context = format_context;
+    return true;
+}
+
+// Returns false if the connection (or file) is broken
+static bool output_writer_write_packet(OutputWriter *self, AVPacket *av_packet) {
+    const AVRational packet_time_base = self->stream_time_bases[av_packet->stream_index];
+    if(self->pts_offset != 0) {
+        const int64_t pts_offset = av_rescale_q_rnd(self->pts_offset, self->stream_time_bases[self->video_stream_index], packet_time_base, AV_ROUND_DOWN);
+        av_packet->pts -= pts_offset;
+        av_packet->dts -= pts_offset;
+    }
+    av_packet_rescale_ts(av_packet, packet_time_base, self->format_context->streams[av_packet->stream_index]->time_base);
+
+    // TODO: Is av_interleaved_write_frame needed?
+    const double write_start = clock_get_monotonic_seconds();
+    int ret = av_interleaved_write_frame(self->format_context, av_packet);
+    self->write_ns += (uint64_t)((clock_get_monotonic_seconds() - write_start) * 1000000000.0);
+    if(ret < 0)
+        fprintf(stderr, "Error: Failed to write frame index %d to muxer, reason: %s (%d)\n", av_packet->stream_index, av_error_to_string(ret), ret);
+
+    return !self->format_context->pb || self->format_context->pb->error >= 0;
+}
+
+static void output_writer_disconnect(OutputWriter *self) {
+    fprintf(stderr, "Error: lost connection to '%s', reason: %s. Reconnecting\n", self->filepath.c_str(), av_error_to_string(self->format_context->pb->error));
+    avio_closep(&self->format_context->pb);
+    output_writer_schedule_reconnect(self);
+}
+
+static void output_writer_drop_backlog_front(OutputWriter *self) {
+    AVPacket *av_packet = self->backlog.front();
+    self->backlog.pop_front();
+    self->backlog_size -= av_packet->size;
+    self->num_dropped_bytes += av_packet->size;
+    av_packet_free(&av_packet);
+}
+
+static bool is_keyframe(const OutputWriter *self, const AVPacket *av_packet) {
+    return av_packet->stream_index == self->video_stream_index && (av_packet->flags & AV_PKT_FLAG_KEY);
+}
+
+// Takes ownership of the packet
+static void output_writer_add_to_backlog(OutputWriter *self, AVPacket *av_packet) {
+    // The output can only continue from a keyframe
+    if(self->backlog.empty() && !is_keyframe(self, av_packet)) {
+        self->num_dropped_bytes += av_packet->size;
+        av_packet_free(&av_packet);
+        return;
+    }
+
+    self->backlog.push_back(av_packet);
+    self->backlog_size += av_packet->size;
+
+    // Remove the oldest gop when the backlog is full
+    while(self->backlog_size > self->backlog_max_size && !self->backlog.empty()) {
+        output_writer_drop_backlog_front(self);
+        while(!self->backlog.empty() && !is_keyframe(self, self->backlog.front()))
+            output_writer_drop_backlog_front(self);
+    }
+
+    self->max_backlog_size = std::max(self->max_backlog_size, self->backlog_size);
+    self->max_backlog_packets = std::max(self->max_backlog_packets, self->backlog.size());
+}
+
+static void output_writer_try_reconnect(OutputWriter *self) {
+    const double now = clock_get_monotonic_seconds();
+    if(now < self->next_reconnect_time || self->backlog.empty())
+        return;
+
+    if(!output_writer_connect(self)) {
+        self->reconnect_delay_secs = std::min(self->reconnect_delay_secs * 2.0, OUTPUT_RECONNECT_MAX_DELAY_SECS);
+        self->next_reconnect_time = clock_get_monotonic_seconds() + self->reconnect_delay_secs;
+        fprintf(stderr, "Warning: failed to reconnect to '%s', trying again in %.0f seconds\n", self->filepath.c_str(), self->reconnect_delay_secs);
+        return;
+    }
+
+    ++self->num_reconnects;
+    fprintf(stderr, "Info: reconnected to '%s', sending %zu packets (%zu bytes) that were received while disconnected\n", self->filepath.c_str(), self->backlog.size(), self->backlog_size);
+    self->disconnected = false;
+
+    // The backlog starts with a keyframe, which becomes timestamp 0 of the new connection. Audio from before the keyframe can't be sent
+    self->pts_offset = self->backlog.front()->pts;
+    const AVRational video_time_base = self->stream_time_bases[self->video_stream_index];
+    while(!self->backlog.empty()) {
+        AVPacket *av_packet = self->backlog.front();
+        self->backlog.pop_front();
+        self->backlog_size -= av_packet->size;
+        if(av_compare_ts(av_packet->pts, self->stream_time_bases[av_packet->stream_index], self->pts_offset, video_time_base) < 0) {
+            self->num_dropped_bytes += av_packet->size;
+        } else if(!output_writer_write_packet(self, av_packet)) {
+            output_writer_disconnect(self);
+            // The rest of the backlog is kept for the next attempt, starting from the next keyframe
+            while(!self->backlog.empty() && !is_keyframe(self, self->backlog.front()))
+                output_writer_drop_backlog_front(self);
+        }
+        av_packet_free(&av_packet);
+        if(self->disconnected)
+            break;
+    }
+}
+
+// Applies the pipe policy when the consumer of the pipe is falling behind. Returns false if the packet should be dropped
+static bool output_writer_pipe_accepts_packet(OutputWriter *self, const AVPacket *av_packet) {
+    const bool is_video = av_packet->stream_index == self->video_stream_index;
+    if(self->pipe_drop_until_keyframe && is_video && !(av_packet->flags & AV_PKT_FLAG_KEY)) {
+        ++self->num_pipe_dropped_packets;
+        return false;
+    }
+
+    if(gsr_pipe_writer_get_free_space(self->pipe_writer) >= (size_t)av_packet->size + PIPE_PACKET_OVERHEAD) {
+        if(is_video)
+            self->pipe_drop_until_keyframe = false;
+        return true;
+    }
+
+    ++self->num_pipe_full;
+    const double now = clock_get_monotonic_seconds();
+    if(now - self->last_pipe_warning_time >= 1.0) {
+        self->last_pipe_warning_time = now;
+        fprintf(stderr, "Warning: the program reading from '%s' is too slow, the output buffer has been full %llu times\n", self->filepath.c_str(), (unsigned long long)self->num_pipe_full);
+    }
+
+    switch(self->pipe_policy) {
+        case PipePolicy::BLOCK:
+            // Writing waits until the consumer has read enough
+            return true;
+        case PipePolicy::DROP:
+            if(is_video)
+                self->pipe_drop_until_keyframe = true;
+            ++self->num_pipe_dropped_packets;
+            return false;
+        case PipePolicy::ABORT:
+            fprintf(stderr, "Error: the program reading from '%s' is too slow, stopping recording\n", self->filepath.c_str());
+            self->failed = true;
+            self->abort_recording = true;
+            return false;
+    }
+    return true;
+}
+
+static void output_writer_run(OutputWriter *self) {
+    pthread_setname_np(pthread_self(), "gsr-output");
+    AVPacket *av_packet = nullptr;
+    while((av_packet = gsr_packet_queue_pop(self->queue))) {
+        self->queued_bytes -= av_packet->size;
+        if(self->failed.load(std::memory_order_relaxed)) {
+            av_packet_free(&av_packet);
+            continue;
+        }
+
+        if(self->disconnected) {
+            output_writer_add_to_backlog(self, av_packet);
+            output_writer_try_reconnect(self);
+            continue;
+        }
+
+        if(self->pipe_writer && !output_writer_pipe_accepts_packet(self, av_packet)) {
+            av_packet_free(&av_packet);
+            continue;
+        }
+
+        if(self->segmenter) {
+            output_segmenter_write_packet(self->segmenter, av_packet);
+        } else if(!output_writer_write_packet(self, av_packet)) {
+            if(self->reconnect) {
+                output_writer_disconnect(self);
+            } else {
+                // Write errors (such as a full disk) can't be recovered from. The other outputs keep going
+                fprintf(stderr, "Error: failed to write to output '%s', reason: %s. Stopped writing to this output\n", self->filepath.c_str(), av_error_to_string(self->format_context->pb->error));
+                self->failed = true;
+            }
+        }
+        av_packet_free(&av_packet);
+    }
+}
+
+// Called after the writer thread has finished. Writes the trailer and closes the file or stream
+static void output_writer_close(OutputWriter *self) {
+    gsr_packet_queue_stats output_queue_stats;
+    gsr_packet_queue_get_stats(self->queue, &output_queue_stats);
+    fprintf(stderr, "Info: output queue for %s: max %zu/%zu packets, waited %.3f seconds for the output %llu times, dropped %llu audio and %llu video packets\n",
+        self->filepath.c_str(), output_queue_stats.max_size, output_queue_stats.capacity, output_queue_stats.push_wait_secs, (unsigned long long)output_queue_stats.num_push_waits,
+        (unsigned long long)self->num_dropped_audio_packets.load(), (unsigned long long)self->num_dropped_video_packets.load());
+    gsr_packet_queue_destroy(self->queue);
+    self->queue = nullptr;
+
+    if(self->reconnect) {
+        fprintf(stderr, "Info: network output %s: reconnected %llu times, dropped %llu bytes while disconnected, max backlog %zu packets (%zu bytes)\n",
+            self->filepath.c_str(), (unsigned long long)self->num_reconnects, (unsigned long long)self->num_dropped_bytes.load(), self->max_backlog_packets, self->max_backlog_size);
+        for(AVPacket *av_packet : self->backlog) {
+            av_packet_free(&av_packet);
+        }
+        self->backlog.clear();
+        av_dict_free(&self->header_options);
+    }
+
+    if(self->segmenter) {
+        output_segmenter_deinit(self->segmenter);
+        return;
+    }
+
+    if(!self->failed && !self->disconnected && av_write_trailer(self->format_context) != 0)
+        fprintf(stderr, "Failed to write trailer\n");
+
+    if(self->pipe_writer) {
+        avio_flush(self->format_context->pb);
+        gsr_pipe_writer_stats pipe_writer_stats;
+        if(!gsr_pipe_writer_destroy(self->pipe_writer, &pipe_writer_stats))
+            fprintf(stderr, "Error: failed to write all data to '%s'\n", self->filepath.c_str());
+        self->pipe_writer = nullptr;
+        self->format_context->pb = nullptr;
+        fprintf(stderr, "Info: pipe output %s: wrote %llu bytes with %llu writes, the pipe was full %llu times, max %zu bytes buffered, waited %.3f seconds for the reader."
+            " The output buffer was full %llu times, dropped %llu packets\n",
+            self->filepath.c_str(), (unsigned long long)pipe_writer_stats.bytes_written, (unsigned long long)pipe_writer_stats.num_write_syscalls,
+            (unsigned long long)pipe_writer_stats.num_would_block, pipe_writer_stats.max_buffered, pipe_writer_stats.full_wait_secs,
+            (unsigned long long)self->num_pipe_full, (unsigned long long)self->num_pipe_dropped_packets);
+    } else if(self->file_writer) {
+        avio_flush(self->format_context->pb);
+        gsr_file_writer_stats file_writer_stats;
+        if(!gsr_file_writer_destroy(self->file_writer, &file_writer_stats))
+            fprintf(stderr, "Error: failed to write all data to '%s'\n", self->filepath.c_str());
+        self->file_writer = nullptr;
+        self->format_context->pb = nullptr;
+        print_file_writer_stats(self->filepath.c_str(), file_writer_stats);
+    } else if(!(self->format_context->oformat->flags & AVFMT_NOFILE)) {
+        avio_close(self->format_context->pb);
+        self->format_context->pb = nullptr;
+    }
+}
+
+static void receive_frames(AVCodecContext *av_codec_context, int stream_index, AVFrame *frame,
+                           std::deque<OutputWriter> &output_writers,
+                           gsr_replay_buffer *replay_buffer,
+                           ReplayFragmentMuxer *replay_fragment_muxer,
+						   std::mutex &write_output_mutex,
+                           bool is_silence = false) {
     for (;;) {
         // TODO: Use av_packet_alloc instead because sizeof(av_packet) might not be future proof(?)
         AVPacket av_packet;
@@ -173,31 +982,19 @@ static void receive_frames(AVCodecContext *av_codec_context, int stream_index, A
             av_packet.stream_index = stream_index;
             av_packet.pts = av_packet.dts = frame->pts;
 
-            if(frame->flags & AV_FRAME_FLAG_DISCARD)
-                av_packet.flags |= AV_PKT_FLAG_DISCARD;
-
-            std::lock_guard<std::mutex> lock(write_output_mutex);
-            if(replay_buffer_size_secs != -1) {
-                double time_now = clock_get_monotonic_seconds();
-                double replay_time_elapsed = time_now - replay_start_time;
-
-                AVPacket new_pack;
-                av_packet_move_ref(&new_pack, &av_packet);
-                frame_data_queue.push_back(std::move(new_pack));
-                if(replay_time_elapsed >= replay_buffer_size_secs) {
-                    av_packet_unref(&frame_data_queue.front());
-                    frame_data_queue.pop_front();
-                    frames_erased = true;
-                }
+            if(replay_fragment_muxer) {
+                std::lock_guard<std::mutex> lock(write_output_mutex);
+                replay_fragment_muxer_write_packet(replay_fragment_muxer, replay_buffer, &av_packet, av_codec_context, clock_get_monotonic_seconds());
+                av_packet_unref(&av_packet);
+            } else if(replay_buffer) {
+                std::lock_guard<std::mutex> lock(write_output_mutex);
+                gsr_replay_buffer_append(replay_buffer, &av_packet, clock_get_monotonic_seconds());
                 av_packet_unref(&av_packet);
             } else {
-                av_packet_rescale_ts(&av_packet, av_codec_context->time_base, stream->time_base);
-                av_packet.stream_index = stream->index;
-                // TODO: Is av_interleaved_write_frame needed?
-                int ret = av_interleaved_write_frame(av_format_context, &av_packet);
-                if(ret < 0) {
-                    fprintf(stderr, "Error: Failed to write frame index %d to muxer, reason: %s (%d)\n", av_packet.stream_index, av_error_to_string(ret), ret);
+                for(OutputWriter &output_writer : output_writers) {
+                    output_writer_push(&output_writer, &av_packet, av_codec_context->time_base, is_silence);
                 }
+                av_packet_unref(&av_packet);
             }
         } else if (res == AVERROR(EAGAIN)) { // we have no packet
                                              // fprintf(stderr, "No packet!\n");
@@ -215,6 +1012,197 @@ static void receive_frames(AVCodecContext *av_codec_context, int stream_index, A
     }
 }
 
+static void encode_video_frame(AVCodecContext *video_codec_context, AVFrame *frame, std::deque<OutputWriter> &output_writers,
+                               gsr_replay_buffer *replay_buffer, ReplayFragmentMuxer *replay_fragment_muxer, std::mutex &write_output_mutex)
+{
+    int ret = avcodec_send_frame(video_codec_context, frame);
+    if (ret >= 0) {
+        receive_frames(video_codec_context, VIDEO_STREAM_INDEX, frame, output_writers,
+                    replay_buffer, replay_fragment_muxer, write_output_mutex);
+    } else {
+        fprintf(stderr, "Error: avcodec_send_frame failed, error: %s\n", av_error_to_string(ret));
+    }
+}
+
+// Captured video frames waiting for the encode thread
+struct VideoEncodeJob {
+    AVFrame *frame = nullptr;
+    double queued_time = 0.0;
+};
+
+// Video frames are encoded on a separate thread, so that the capture keeps its cadence when the encoder or the outputs are slow.
+// On NVIDIA frames are captured into frames from the hardware frame pool of the encoder, so capturing the next frame overlaps with encoding the previous one.
+// Vaapi frames are mapped to the texture the window is copied to, so there is only one frame that can't be captured to while it's being encoded.
+// At most |max_frames| frames are captured and not yet encoded. When all of them are in use the capture drops the frame instead of waiting
+struct VideoEncodePipeline {
+    AVCodecContext *codec_context = nullptr;
+    int max_frames = 0;
+    bool pooled = false; // False when the frame of the capture is used for every frame
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable frame_queued;
+    std::deque<VideoEncodeJob> queue;
+    std::vector<AVFrame*> free_frames; // Frames without a buffer. A buffer is taken from the pool when the frame is captured to
+    std::vector<AVFrame*> frames;
+    bool stop = false;
+    std::atomic<int64_t> pending_bitrate{0}; // The encoder is only touched by the encode thread, so bitrate changes are applied from there
+
+    // Protected by |mutex|
+    int num_frames_in_flight = 0;
+    int max_frames_in_flight = 0;
+    uint64_t num_frames_encoded = 0;
+    double encode_secs = 0.0;
+    double max_encode_secs = 0.0;
+    double queue_secs = 0.0; // Time frames waited in the queue before the encode thread took them
+    double max_queue_secs = 0.0;
+    uint64_t num_frames_dropped = 0; // Frames that weren't captured because all frames were waiting to be encoded
+};
+
+// |max_frames| is ignored when |pooled| is false
+static bool video_encode_pipeline_init(VideoEncodePipeline *self, AVCodecContext *codec_context, bool pooled, int max_frames) {
+    self->codec_context = codec_context;
+    self->pooled = pooled;
+    self->max_frames = pooled ? max_frames : 1;
+    if(!pooled)
+        return true;
+
+    for(int i = 0; i < max_frames; ++i) {
+        AVFrame *frame = av_frame_alloc();
+        if(!frame) {
+            fprintf(stderr, "Error: Failed to allocate frame\n");
+            return false;
+        }
+        self->frames.push_back(frame);
+        self->free_frames.push_back(frame);
+    }
+    return true;
+}
+
+static void video_encode_pipeline_run(VideoEncodePipeline *self, const gsr_thread_config *thread_config, std::deque<OutputWriter> &output_writers,
+                                      gsr_replay_buffer *replay_buffer, ReplayFragmentMuxer *replay_fragment_muxer, std::mutex &write_output_mutex)
+{
+    gsr_thread_config_apply(thread_config, "gsr-encode");
+    std::unique_lock<std::mutex> lock(self->mutex);
+    for(;;) {
+        self->frame_queued.wait(lock, [self]{ return self->stop || !self->queue.empty(); });
+        // Frames that are still queued when stopping are encoded first
+        if(self->queue.empty())
+            break;
+
+        VideoEncodeJob job = self->queue.front();
+        self->queue.pop_front();
+        lock.unlock();
+
+        const int64_t bitrate = self->pending_bitrate.exchange(0);
+        if(bitrate > 0) {
+            // Nvenc reconfigures the encoder on the next frame when these change
+            self->codec_context->bit_rate = bitrate;
+            self->codec_context->rc_max_rate = bitrate;
+            self->codec_context->rc_buffer_size = bitrate;
+        }
+
+        const double encode_start = clock_get_monotonic_seconds();
+        encode_video_frame(self->codec_context, job.frame, output_writers, replay_buffer, replay_fragment_muxer, write_output_mutex);
+        const double encode_end = clock_get_monotonic_seconds();
+        // The encoder keeps its own reference to the buffer while it's being used, so the buffer only goes back to the pool when the encoder is done with it
+        if(self->pooled)
+            av_frame_unref(job.frame);
+
+        lock.lock();
+        const double queue_time = encode_start - job.queued_time;
+        self->queue_secs += queue_time;
+        self->max_queue_secs = std::max(self->max_queue_secs, queue_time);
+        self->encode_secs += (encode_end - encode_start);
+        self->max_encode_secs = std::max(self->max_encode_secs, encode_end - encode_start);
+        ++self->num_frames_encoded;
+        if(self->pooled)
+            self->free_frames.push_back(job.frame);
+        --self->num_frames_in_flight;
+    }
+}
+
+/*
+    Sets |frame| to the frame to capture to, or to nullptr if all frames are waiting to be encoded. In that case the frame should be dropped.
+    |capture_frame| is the frame of the capture, which is used when frames are not pooled. Returns false on error.
+*/
+static bool video_encode_pipeline_get_frame(VideoEncodePipeline *self, AVFrame *capture_frame, AVFrame **frame) {
+    *frame = nullptr;
+    std::unique_lock<std::mutex> lock(self->mutex);
+    if(self->num_frames_in_flight >= self->max_frames) {
+        ++self->num_frames_dropped;
+        return true;
+    }
+
+    ++self->num_frames_in_flight;
+    self->max_frames_in_flight = std::max(self->max_frames_in_flight, self->num_frames_in_flight);
+    if(!self->pooled) {
+        *frame = capture_frame;
+        return true;
+    }
+
+    AVFrame *pool_frame = self->free_frames.back();
+    self->free_frames.pop_back();
+    lock.unlock();
+
+    const int res = av_hwframe_get_buffer(self->codec_context->hw_frames_ctx, pool_frame, 0);
+    if(res < 0) {
+        fprintf(stderr, "Error: av_hwframe_get_buffer failed, error: %s\n", av_error_to_string(res));
+        lock.lock();
+        self->free_frames.push_back(pool_frame);
+        --self->num_frames_in_flight;
+        return false;
+    }
+    pool_frame->color_range = AVCOL_RANGE_JPEG;
+    *frame = pool_frame;
+    return true;
+}
+
+// |frame| is encoded on the encode thread and is given back when it has been encoded
+static void video_encode_pipeline_submit(VideoEncodePipeline *self, AVFrame *frame) {
+    std::lock_guard<std::mutex> lock(self->mutex);
+    VideoEncodeJob job;
+    job.frame = frame;
+    job.queued_time = clock_get_monotonic_seconds();
+    self->queue.push_back(job);
+    self->frame_queued.notify_one();
+}
+
+// Gives back a frame from |video_encode_pipeline_get_frame| that won't be encoded
+static void video_encode_pipeline_cancel_frame(VideoEncodePipeline *self, AVFrame *frame) {
+    if(self->pooled)
+        av_frame_unref(frame);
+    std::lock_guard<std::mutex> lock(self->mutex);
+    if(self->pooled)
+        self->free_frames.push_back(frame);
+    --self->num_frames_in_flight;
+}
+
+// Number of frames that are waiting to be encoded, including the one being encoded
+static int video_encode_pipeline_get_num_frames_in_flight(VideoEncodePipeline *self) {
+    std::lock_guard<std::mutex> lock(self->mutex);
+    return self->num_frames_in_flight;
+}
+
+// Encodes the frames that are still queued and stops the encode thread
+static void video_encode_pipeline_stop(VideoEncodePipeline *self) {
+    {
+        std::lock_guard<std::mutex> lock(self->mutex);
+        self->stop = true;
+        self->frame_queued.notify_one();
+    }
+
+    if(self->thread.joinable())
+        self->thread.join();
+}
+
+static void video_encode_pipeline_deinit(VideoEncodePipeline *self) {
+    for(AVFrame *frame : self->frames) {
+        av_frame_free(&frame);
+    }
+    self->frames.clear();
+    self->free_frames.clear();
+}
+
 static const char* audio_codec_get_name(AudioCodec audio_codec) {
     switch(audio_codec) {
         case AudioCodec::AAC:  return "aac";
@@ -472,17 +1460,7 @@ static const AVCodec* find_h265_encoder(gpu_vendor vendor) {
     return checked_success ? codec : nullptr;
 }
 
-static AVFrame* open_audio(AVCodecContext *audio_codec_context) {
-    AVDictionary *options = nullptr;
-    av_dict_set(&options, "strict", "experimental", 0);
-
-    int ret;
-    ret = avcodec_open2(audio_codec_context, audio_codec_context->codec, &options);
-    if(ret < 0) {
-        fprintf(stderr, "failed to open codec, reason: %s\n", av_error_to_string(ret));
-        exit(1);
-    }
-
+static AVFrame* create_audio_frame(const AVCodecContext *audio_codec_context) {
     AVFrame *frame = av_frame_alloc();
     if(!frame) {
         fprintf(stderr, "failed to allocate audio frame\n");
@@ -499,7 +1477,7 @@ static AVFrame* open_audio(AVCodecContext *audio_codec_context) {
     av_channel_layout_copy(&frame->ch_layout, &audio_codec_context->ch_layout);
 #endif
 
-    ret = av_frame_get_buffer(frame, 0);
+    const int ret = av_frame_get_buffer(frame, 0);
     if(ret < 0) {
         fprintf(stderr, "failed to allocate audio data buffers, reason: %s\n", av_error_to_string(ret));
         exit(1);
@@ -508,7 +1486,23 @@ static AVFrame* open_audio(AVCodecContext *audio_codec_context) {
     return frame;
 }
 
+static AVFrame* open_audio(AVCodecContext *audio_codec_context) {
+    AVDictionary *options = nullptr;
+    av_dict_set(&options, "strict", "experimental", 0);
+
+    int ret;
+    ret = avcodec_open2(audio_codec_context, audio_codec_context->codec, &options);
+    if(ret < 0) {
+        fprintf(stderr, "failed to open codec, reason: %s\n", av_error_to_string(ret));
+        exit(1);
+    }
+
+    return create_audio_frame(audio_codec_context);
+}
+
+// Uses constant quality if |codec_context->rc_max_rate| is 0, otherwise the bitrate is limited (for livestreaming with adaptive bitrate)
 static void open_video(AVCodecContext *codec_context, VideoQuality video_quality, bool very_old_gpu) {
+    const bool constant_quality = codec_context->rc_max_rate == 0;
     bool supports_p4 = false;
     bool supports_p6 = false;
 
@@ -523,7 +1517,7 @@ static void open_video(AVCodecContext *codec_context, VideoQuality video_quality
     }
 
     AVDictionary *options = nullptr;
-    if(very_old_gpu) {
+    if(constant_quality && very_old_gpu) {
         switch(video_quality) {
             case VideoQuality::MEDIUM:
                 av_dict_set_int(&options, "qp", 37, 0);
@@ -538,7 +1532,7 @@ static void open_video(AVCodecContext *codec_context, VideoQuality video_quality
                 av_dict_set_int(&options, "qp", 21, 0);
                 break;
         }
-    } else {
+    } else if(constant_quality) {
         switch(video_quality) {
             case VideoQuality::MEDIUM:
                 av_dict_set_int(&options, "qp", 40, 0);
@@ -574,12 +1568,21 @@ static void open_video(AVCodecContext *codec_context, VideoQuality video_quality
     else
         av_dict_set(&options, "preset", supports_p6 ? "p6" : "slow", 0);
 
-    av_dict_set(&options, "tune", "hq", 0);
-    av_dict_set(&options, "rc", "constqp", 0);
+    if(constant_quality) {
+        av_dict_set(&options, "tune", "hq", 0);
+        av_dict_set(&options, "rc", "constqp", 0);
+    } else {
+        // Nvenc changes the bitrate without restarting when |codec_context->bit_rate| is changed, vaapi only uses the initial bitrate
+        av_dict_set(&options, "tune", "ll", 0);
+        av_dict_set(&options, "rc", "cbr", 0);
+        av_dict_set(&options, "rc_mode", "VBR", 0);
+    }
 
     if(codec_context->codec_id == AV_CODEC_ID_H264)
         av_dict_set(&options, "profile", "high", 0);
 
+    // Frames with pict_type set to AV_PICTURE_TYPE_I become idr frames, which are used to force keyframes in variable frame rate mode
+    av_dict_set_int(&options, "forced-idr", 1, 0);
     av_dict_set(&options, "strict", "experimental", 0);
 
     int ret = avcodec_open2(codec_context, codec_context->codec, &options);
@@ -590,7 +1593,7 @@ static void open_video(AVCodecContext *codec_context, VideoQuality video_quality
 }
 
 static void usage() {
-    fprintf(stderr, "usage: gpu-screen-recorder -w <window_id|monitor|focused> [-c <container_format>] [-s WxH] -f <fps> [-a <audio_input>...] [-q <quality>] [-r <replay_buffer_size_sec>] [-k h264|h265] [-ac aac|opus|flac] [-o <output_file>]\n");
+    fprintf(stderr, "usage: gpu-screen-recorder -w <window_id|monitor|focused> [-c <container_format>] [-s WxH] -f <fps> [-a <audio_input>...] [-q <quality>] [-r <replay_buffer_size_sec>] [-rm <replay_buffer_max_size>] [-rd <replay_buffer_directory>] [-rc <replay_clip_duration_sec>] [-rf true|false] [-mq block|drop-silence|drop-video] [-sp block|drop|abort] [-wb <write_buffer_size>] [-wp <preallocate_size>] [-wd true|false] [-wu true|false] [-fd <fragment_duration_sec>] [-fs true|false] [-st <segment_time_sec>] [-ss <segment_size>] [-hd <hls_segment_duration_sec>] [-hn <hls_playlist_size>] [-hs ts|fmp4] [-nb <network_backlog_size>] [-vb <max_video_bitrate_kbps>] [-fm cfr|vfr] [-mi <max_frame_interval_sec>] [-pd <pipeline_depth>] [-ts <thread_scheduling>] [-tc <cpu_list>] [-ta <cpu_list>] [-ml true|false] [-k h264|h265] [-ac aac|opus|flac] [-o <output_file>...]\n");
     fprintf(stderr, "OPTIONS:\n");
     fprintf(stderr, "  -w    Window to record, a display, \"screen\", \"screen-direct\", \"screen-direct-force\" or \"focused\". The display is the display (monitor) name in xrandr and if \"screen\" or \"screen-direct\" is selected then all displays are recorded. If this is \"focused\" then the currently focused window is recorded. When recording the focused window then the -s option has to be used as well.\n"
         "        \"screen-direct\"/\"screen-direct-force\" skips one texture copy for fullscreen applications so it may lead to better performance and it works with VRR monitors when recording fullscreen application but may break some applications, such as mpv in fullscreen mode. Direct mode doesn't capture cursor either. \"screen-direct-force\" is not recommended unless you use a VRR monitor because there might be driver issues that cause the video to stutter or record a black screen.\n");
@@ -603,26 +1606,122 @@ static void usage() {
     fprintf(stderr, "  -r    Replay buffer size in seconds. If this is set, then only the last seconds as set by this option will be stored"
         " and the video will only be saved when the gpu-screen-recorder is closed. This feature is similar to Nvidia's instant replay feature."
         " This option has be between 5 and 1200. Note that the replay buffer size will not always be precise, because of keyframes. Optional, disabled by default.\n");
+    fprintf(stderr, "  -rm   Maximum amount of memory the replay buffer can use, for example 512M or 2G (a number without a suffix is in megabytes). The memory is allocated when the program starts."
+        " If the replay buffer reaches this size then the oldest data is removed, even if it's not older than the replay buffer size (-r). Optional, by default the replay buffer is only limited by the replay buffer size (-r) and the memory is allocated as needed.\n");
+    fprintf(stderr, "  -rd   Store the replay buffer in files in this directory instead of in memory. The directory has to exist. Only a few megabytes of the replay buffer are kept in memory at a time, so this can be used for long replays at high quality."
+        " The -rm option is then the maximum amount of disk space to use. Optional, disabled by default.\n");
+    fprintf(stderr, "  -rc   Duration in seconds of replays saved with SIGUSR2. Only the last seconds as set by this option are saved, starting at the closest keyframe before that. This option has to be between 1 and 1200. Optional, defaults to 30.\n");
+    fprintf(stderr, "  -rf   Mux the replay buffer into fragmented mp4 while recording instead of when a replay is saved [true/false]. Saving a replay is then only a file copy, which makes saving long replays much faster at the cost of muxing all the time."
+        " Only available when -c is mp4. Optional, defaults to false.\n");
+    fprintf(stderr, "  -mq   What to do when the output (disk or network) is too slow and the queue of packets waiting to be written is full. Should be either 'block', 'drop-silence' or 'drop-video'."
+        " 'block' waits until there is space in the queue, which stalls recording. 'drop-silence' drops audio packets that only contain inserted silence and otherwise waits."
+        " 'drop-video' drops video frames until the next keyframe and otherwise waits. Not available in replay mode. Optional, defaults to 'block'.\n");
+    fprintf(stderr, "  -sp   What to do when the program reading the output from stdout (or from a pipe given with -o) is slower than the recording. Should be either 'block', 'drop' or 'abort'."
+        " The output is written from a separate thread with up to 16MB buffered. 'block' waits until the program has read enough, which stalls recording when the queue (-mq) is full as well."
+        " 'drop' drops packets until there is space and continues from the next keyframe. 'abort' stops recording with an error. A warning is printed when the program falls behind. Optional, defaults to 'block'.\n");
+    fprintf(stderr, "  -fd   Write the mp4/mov file as fragmented mp4 with fragments of at least this many seconds, for example 2 or 0.5. Fragments always start at a keyframe."
+        " The recording stays playable up to the last fragment if gpu-screen-recorder is killed or crashes and the memory usage doesn't grow during long recordings. Not available in replay mode. Optional, disabled by default.\n");
+    fprintf(stderr, "  -fs   Move the index of the mp4/mov file to the beginning of the file when the recording is done [true/false], so that the video can start playing before it has been downloaded completely."
+        " This rewrites the whole file when the recording stops. Not available with -fd or in replay mode. Optional, defaults to false.\n");
+    fprintf(stderr, "  -st   Split the recording into multiple files of at least this many seconds, without restarting the recording. A new file is started at the first keyframe after this time."
+        " The files are named after the output file with _001, _002 and so on added before the extension and the path to each file is printed to stdout when the file is complete. Not available in replay mode. Optional, disabled by default.\n");
+    fprintf(stderr, "  -ss   Split the recording into multiple files of about this size, for example 2G (a number without a suffix is in megabytes). A new file is started at the first keyframe after the size has been reached."
+        " Can be combined with -st. Not available in replay mode. Optional, disabled by default.\n");
+    fprintf(stderr, "  -hd   Duration of hls segments in seconds when the output is a hls playlist (an .m3u8 file or -c hls). Segments start at keyframes and the keyframe interval is reduced to this duration if it's shorter than 2 seconds."
+        " Lower values reduce latency. Has to be between 0.5 and 60. Optional, defaults to 2.\n");
+    fprintf(stderr, "  -hn   Number of segments in the hls playlist. Older segments are deleted. Has to be between 1 and 1000. Optional, defaults to 6.\n");
+    fprintf(stderr, "  -hs   Hls segment type. Should be either 'ts' (mpeg-ts) or 'fmp4' (fragmented mp4). Optional, defaults to 'ts'.\n");
+    fprintf(stderr, "  -nb   Maximum amount of encoded data to keep in memory while reconnecting to a network output (such as rtmp), for example 128M (a number without a suffix is in megabytes)."
+        " Network outputs are reconnected when the connection is lost and continue from the oldest keyframe in memory. Optional, defaults to 64M.\n");
+    fprintf(stderr, "  -vb   Maximum video bitrate in kbps when livestreaming. Enables adaptive bitrate: the video bitrate is lowered when data is building up in the network outputs and raised again when they keep up."
+        " If the bitrate can't be lowered further then the frame rate is lowered as well. Changing the bitrate while recording is only supported on NVIDIA, on other GPUs only the frame rate is changed."
+        " Optional, by default livestreams use constant quality (-q) like recordings.\n");
+    fprintf(stderr, "  -fm   Frame rate mode. Should be either 'cfr' (constant frame rate) or 'vfr' (variable frame rate). In 'vfr' mode frames are only encoded when the recorded window or screen has changed, which reduces the gpu usage and file size when little is happening on the screen."
+        " Changes are detected when recording a window and when recording a screen with nvfbc (NVIDIA), otherwise every frame is encoded. Some video players and editors handle variable frame rate videos badly. Optional, defaults to 'cfr'.\n");
+    fprintf(stderr, "  -mi   Maximum time in seconds between two encoded frames in 'vfr' mode, a frame is encoded after this time even if nothing has changed. Keyframes are still inserted at the normal interval."
+        " Has to be between 0.1 and 10. Optional, defaults to 1.\n");
+    fprintf(stderr, "  -pd   Number of video frames that can be captured while earlier frames are still being encoded. The video is encoded on a separate thread and if all frames are still waiting to be encoded"
+        " then the next frame is dropped, so a slow encoder doesn't delay capturing. Higher values help reaching high frame rates (such as 144 fps) when encoding a frame takes almost as long as the time between frames, but each frame uses video memory."
+        " Only supported on NVIDIA, on other GPUs one frame is encoded at a time. Has to be between 1 and 8. Optional, defaults to 3.\n");
+    fprintf(stderr, "  -ts   Scheduling of the capture, encoding and audio threads. Should be either 'fifo:<priority>' or 'rr:<priority>' (real-time scheduling with a priority between 1 and 99) or 'nice:<niceness>' (a niceness between -20 and 19)."
+        " Real-time scheduling and negative niceness require the CAP_SYS_NICE capability or a rtprio/nice limit for the user in limits.conf, otherwise a warning is shown and the default scheduling is used. Optional, uses the default scheduling by default.\n");
+    fprintf(stderr, "  -tc   Cpus the capture and encoding threads run on, for example '2' or '4-7,10'. Optional, the threads can run on any cpu by default.\n");
+    fprintf(stderr, "  -ta   Cpus the audio thread runs on, for example '3' or '0,1'. Optional, the threads can run on any cpu by default.\n");
+    fprintf(stderr, "  -ml   Lock the memory of the program when recording starts so that it's never swapped out, which can otherwise cause stutter. Should be either 'true' or 'false'."
+        " The replay buffer is only locked when it's preallocated with -rm, and never when it's stored on disk with -rd. Requires the CAP_IPC_LOCK capability or a large enough memlock limit for the user in limits.conf, otherwise a warning is shown. Optional, defaults to 'false'.\n");
     fprintf(stderr, "  -k    Video codec to use. Should be either 'auto', 'h264' or 'h265'. Defaults to 'auto' which defaults to 'h265' unless recording at a higher resolution than 3840x2160. Forcefully set to 'h264' if -c is 'flv'.\n");
     fprintf(stderr, "  -ac   Audio codec to use. Should be either 'aac', 'opus' or 'flac'. Defaults to 'opus' for .mp4/.mkv files, otherwise defaults to 'aac'. 'opus' and 'flac' is only supported by .mp4/.mkv files. 'opus' is recommended for best performance and smallest audio size.\n");
-    fprintf(stderr, "  -o    The output file path. If omitted then the encoded data is sent to stdout. Required in replay mode (when using -r). In replay mode this has to be an existing directory instead of a file.\n");
+    fprintf(stderr, "  -o    The output file path. If omitted then the encoded data is sent to stdout. Required in replay mode (when using -r). In replay mode this has to be an existing directory instead of a file.\n"
+        "        Can be specified multiple times to record to multiple files or streams at the same time, for example a local file and a livestream. The video and audio are only encoded once."
+        " The container format of each additional output is determined from the filename extension or can be set by adding it in brackets before the output, for example \"[flv]rtmp://live.twitch.tv/app/key\". rtmp outputs default to flv."
+        " Options such as -c, -fd, -fs, -st and -ss only apply to the first output. If writing to an output fails then the other outputs keep recording. Only one output can be used in replay mode.\n");
     fprintf(stderr, "NOTES:\n");
     fprintf(stderr, "  Send signal SIGINT (Ctrl+C) to gpu-screen-recorder to stop and save the recording (when not using replay mode).\n");
     fprintf(stderr, "  Send signal SIGUSR1 (killall -SIGUSR1 gpu-screen-recorder) to gpu-screen-recorder to save a replay.\n");
+    fprintf(stderr, "  Send signal SIGUSR2 (killall -SIGUSR2 gpu-screen-recorder) to gpu-screen-recorder to save a replay of the last seconds as set by -rc. The duration can instead be sent as the integer value of the signal with sigqueue.\n");
     fprintf(stderr, "EXAMPLES\n");
     fprintf(stderr, "  gpu-screen-recorder -w screen -f 60 -a \"$(pactl get-default-sink).monitor\" -o video.mp4\n");
     exit(1);
 }
 
 static sig_atomic_t running = 1;
-static sig_atomic_t save_replay = 0;
+// Duration of replays saved with SIGUSR2 when the signal doesn't have a value
+static sig_atomic_t save_replay_clip_duration_secs = 30;
+// Same range as -rc
+static const int SAVE_REPLAY_CLIP_MAX_DURATION_SECS = 1200;
+
+// Replays that have been requested with SIGUSR1/SIGUSR2 but not started yet, as a ring buffer.
+// Each value is the replay duration in seconds + 1 (a duration of 0 is the whole replay buffer), 0 if the request hasn't been written yet
+static const unsigned int SAVE_REPLAY_QUEUE_SIZE = 256;
+static std::atomic<int> save_replay_queue[SAVE_REPLAY_QUEUE_SIZE];
+static std::atomic<unsigned int> save_replay_queue_write_index(0);
+static std::atomic<unsigned int> save_replay_queue_read_index(0);
+// Requests that were dropped because the queue was full
+static std::atomic<unsigned int> save_replay_queue_num_dropped(0);
 
 static void int_handler(int) {
     running = 0;
 }
 
+static void queue_save_replay(int duration_secs) {
+    unsigned int index = save_replay_queue_write_index.load();
+    do {
+        // Don't overwrite requests that haven't been read yet
+        if(index - save_replay_queue_read_index.load() >= SAVE_REPLAY_QUEUE_SIZE) {
+            save_replay_queue_num_dropped.fetch_add(1);
+            return;
+        }
+    } while(!save_replay_queue_write_index.compare_exchange_weak(index, index + 1));
+    save_replay_queue[index % SAVE_REPLAY_QUEUE_SIZE].store(duration_secs + 1);
+}
+
 static void save_replay_handler(int) {
-    save_replay = 1;
+    queue_save_replay(0);
+}
+
+static void save_replay_clip_handler(int, siginfo_t *info, void*) {
+    int duration_secs = save_replay_clip_duration_secs;
+    if(info->si_code == SI_QUEUE && info->si_value.sival_int > 0)
+        duration_secs = std::min(info->si_value.sival_int, SAVE_REPLAY_CLIP_MAX_DURATION_SECS);
+    queue_save_replay(duration_secs);
+}
+
+// Returns false if there are no more requests. |duration_secs| is set to 0 if the whole replay buffer should be saved
+static bool pop_save_replay_request(int *duration_secs) {
+    const unsigned int read_index = save_replay_queue_read_index.load();
+    if(read_index == save_replay_queue_write_index.load())
+        return false;
+
+    std::atomic<int> &request = save_replay_queue[read_index % SAVE_REPLAY_QUEUE_SIZE];
+    const int value = request.load();
+    // The signal handler has reserved the slot but hasn't written to it yet
+    if(value == 0)
+        return false;
+
+    request.store(0);
+    save_replay_queue_read_index.store(read_index + 1);
+    *duration_secs = value - 1;
+    return true;
 }
 
 struct Arg {
@@ -666,6 +1765,30 @@ static std::string get_date_str() {
     return str; 
 }
 
+// Parses a size such as "512M", "2G" or "2048" (megabytes). Returns false on failure
+static bool parse_size_str(const char *str, size_t *size) {
+    char *end = nullptr;
+    errno = 0;
+    const unsigned long long value = strtoull(str, &end, 10);
+    if(errno != 0 || end == str || value == 0)
+        return false;
+
+    unsigned long long multiplier = 1024ULL * 1024ULL;
+    if(*end != '\0') {
+        switch(*end) {
+            case 'k': case 'K': multiplier = 1024ULL; break;
+            case 'm': case 'M': multiplier = 1024ULL * 1024ULL; break;
+            case 'g': case 'G': multiplier = 1024ULL * 1024ULL * 1024ULL; break;
+            default: return false;
+        }
+        if(end[1] != '\0')
+            return false;
+    }
+
+    *size = value * multiplier;
+    return true;
+}
+
 static AVStream* create_stream(AVFormatContext *av_format_context, AVCodecContext *codec_context) {
     AVStream *stream = avformat_new_stream(av_format_context, nullptr);
     if (!stream) {
@@ -682,12 +1805,25 @@ struct AudioDevice {
     SoundDevice sound_device;
     AudioInput audio_input;
     AVFilterContext *src_filter_ctx = nullptr;
-    std::thread thread; // TODO: Instead of having a thread for each track, have one thread for all threads and read the data with non-blocking read
+    SwrContext *swr = nullptr;
+    double received_audio_time = 0.0;
+
+    // Stats, only used by the audio thread
+    int64_t num_chunks = 0;
+    int64_t num_conversions = 0;
+    int64_t num_underruns = 0; // Number of times silence was inserted because no audio was received in time
+    int64_t num_silent_frames = 0;
+    int64_t num_latency_samples = 0;
+    double latency_sum_secs = 0.0;
+    double max_latency_secs = 0.0;
 };
 
 struct AudioTrack {
     AVCodecContext *codec_context = nullptr;
     AVFrame *frame = nullptr;
+    // Only used by the audio thread. Chunks of audio are given to the encoder in refcounted buffers, silence is the same frame every time
+    AVFrame *silence_frame = nullptr;
+    AVBufferPool *converted_buffer_pool = nullptr;
     AVStream *stream = nullptr;
 
     std::vector<AudioDevice> audio_devices;
@@ -697,55 +1833,419 @@ struct AudioTrack {
     int stream_index = 0;
 };
 
-static std::future<void> save_replay_thread;
-static std::vector<AVPacket> save_replay_packets;
-static std::string save_replay_output_filepath;
+static int audio_frame_get_num_channels(const AVFrame *frame) {
+#if LIBAVCODEC_VERSION_MAJOR < 60
+    return frame->channels;
+#else
+    return frame->ch_layout.nb_channels;
+#endif
+}
 
-static void save_replay_async(AVCodecContext *video_codec_context, int video_stream_index, std::vector<AudioTrack> &audio_tracks, const std::deque<AVPacket> &frame_data_queue, bool frames_erased, std::string output_dir, const char *container_format, const std::string &file_extension, std::mutex &write_output_mutex) {
-    if(save_replay_thread.valid())
-        return;
-    
-    size_t start_index = (size_t)-1;
-    int64_t video_pts_offset = 0;
-    int64_t audio_pts_offset = 0;
+// Makes |frame| use the samples in |buffer| without copying them. The frame takes over the reference to |buffer|
+static void audio_frame_set_buffer(AVFrame *frame, AVBufferRef *buffer) {
+    for(int i = 0; i < AV_NUM_DATA_POINTERS; ++i) {
+        av_buffer_unref(&frame->buf[i]);
+    }
+    frame->buf[0] = buffer;
+    av_samples_fill_arrays(frame->data, frame->linesize, buffer->data, audio_frame_get_num_channels(frame), frame->nb_samples, (AVSampleFormat)frame->format, 1);
+}
 
-    {
-        std::lock_guard<std::mutex> lock(write_output_mutex);
-        start_index = (size_t)-1;
-        for(size_t i = 0; i < frame_data_queue.size(); ++i) {
-            const AVPacket &av_packet = frame_data_queue[i];
-            if((av_packet.flags & AV_PKT_FLAG_KEY) && av_packet.stream_index == video_stream_index) {
-                start_index = i;
-                break;
-            }
+// Encodes |frame|, or adds it to the audio filter if the track mixes multiple devices.
+// The encoder and filter only reference the buffers of |frame|, so they are not copied
+static void audio_track_send_frame(AudioTrack &audio_track, AudioDevice &audio_device, AVFrame *frame, bool is_silence, std::mutex &audio_filter_mutex, std::deque<OutputWriter> &output_writers,
+                                   gsr_replay_buffer *replay_buffer, ReplayFragmentMuxer *replay_fragment_muxer, std::mutex &write_output_mutex)
+{
+    if(audio_track.graph) {
+        std::lock_guard<std::mutex> lock(audio_filter_mutex);
+        // TODO: av_buffersrc_add_frame
+        if(av_buffersrc_write_frame(audio_device.src_filter_ctx, frame) < 0) {
+            fprintf(stderr, "Error: failed to add audio frame to filter\n");
         }
+    } else {
+        frame->pts = audio_track.pts;
+        audio_track.pts += frame->nb_samples;
+        const int ret = avcodec_send_frame(audio_track.codec_context, frame);
+        if(ret >= 0){
+            receive_frames(audio_track.codec_context, audio_track.stream_index, frame, output_writers, replay_buffer, replay_fragment_muxer, write_output_mutex, is_silence);
+        } else {
+            fprintf(stderr, "Failed to encode audio!\n");
+        }
+    }
+}
 
-        if(start_index == (size_t)-1)
-            return;
+static void audio_track_send_silence(AudioTrack &audio_track, AudioDevice &audio_device, int64_t num_frames, std::mutex &audio_filter_mutex,
+                                     std::deque<OutputWriter> &output_writers, gsr_replay_buffer *replay_buffer, ReplayFragmentMuxer *replay_fragment_muxer, std::mutex &write_output_mutex)
+{
+    // TODO: Check if duplicate frame can be saved just by writing it with a different pts instead of sending it again
+    for(int64_t i = 0; i < num_frames; ++i) {
+        audio_track_send_frame(audio_track, audio_device, audio_track.silence_frame, true, audio_filter_mutex, output_writers, replay_buffer, replay_fragment_muxer, write_output_mutex);
+    }
+    audio_device.num_silent_frames += num_frames;
+}
 
-        if(frames_erased) {
-            video_pts_offset = frame_data_queue[start_index].pts;
-            
-            // Find the next audio packet to use as audio pts offset
-            for(size_t i = start_index; i < frame_data_queue.size(); ++i) {
-                const AVPacket &av_packet = frame_data_queue[i];
-                if(av_packet.stream_index != video_stream_index) {
-                    audio_pts_offset = av_packet.pts;
+// Encodes the audio that the device has received since the last call, or silence if the device hasn't received audio for a while
+static void audio_device_process(AudioTrack &audio_track, AudioDevice &audio_device, std::mutex &audio_filter_mutex, std::deque<OutputWriter> &output_writers,
+                                 gsr_replay_buffer *replay_buffer, ReplayFragmentMuxer *replay_fragment_muxer, std::mutex &write_output_mutex)
+{
+    const double frame_duration = (double)audio_track.frame->nb_samples / (double)audio_track.codec_context->sample_rate;
+    bool got_audio_data = false;
+    if(audio_device.sound_device.handle) {
+        AVBufferRef *chunk = nullptr;
+        while(sound_device_read_next_chunk(&audio_device.sound_device, &chunk) > 0) {
+            got_audio_data = true;
+            // TODO: Instead of converting audio, get float audio from alsa. Or does alsa do conversion internally to get this format?
+            if(audio_device.swr) {
+                AVBufferRef *converted_buffer = av_buffer_pool_get(audio_track.converted_buffer_pool);
+                if(!converted_buffer) {
+                    fprintf(stderr, "Error: failed to allocate audio buffer\n");
+                    av_buffer_unref(&chunk);
                     break;
                 }
+                audio_frame_set_buffer(audio_track.frame, converted_buffer);
+                const uint8_t *chunk_data = chunk->data;
+                swr_convert(audio_device.swr, audio_track.frame->extended_data, audio_track.frame->nb_samples, (const uint8_t**)&chunk_data, audio_track.codec_context->frame_size);
+                av_buffer_unref(&chunk);
+                ++audio_device.num_conversions;
+            } else {
+                audio_frame_set_buffer(audio_track.frame, chunk);
             }
-        } else {
-            start_index = 0;
+
+            audio_track_send_frame(audio_track, audio_device, audio_track.frame, false, audio_filter_mutex, output_writers, replay_buffer, replay_fragment_muxer, write_output_mutex);
+
+            ++audio_device.num_chunks;
+            SoundDeviceStats sound_device_stats;
+            sound_device_get_stats(&audio_device.sound_device, &sound_device_stats);
+            if(sound_device_stats.latency_secs >= 0.0) {
+                audio_device.latency_sum_secs += sound_device_stats.latency_secs;
+                audio_device.max_latency_secs = std::max(audio_device.max_latency_secs, sound_device_stats.latency_secs);
+                ++audio_device.num_latency_samples;
+            }
+        }
+    }
+
+    const double time_now = clock_get_monotonic_seconds();
+    if(got_audio_data) {
+        audio_device.received_audio_time = time_now;
+        return;
+    }
+
+    // Devices without an audio input are silent, at the same rate as audio would be received
+    if(!audio_device.sound_device.handle) {
+        const int64_t num_frames = (int64_t)((time_now - audio_device.received_audio_time) / frame_duration);
+        if(num_frames > 0) {
+            audio_device.received_audio_time += num_frames * frame_duration;
+            audio_track_send_silence(audio_track, audio_device, num_frames, audio_filter_mutex, output_writers, replay_buffer, replay_fragment_muxer, write_output_mutex);
+        }
+        return;
+    }
+
+    // Jesus is there a better way to do this? I JUST WANT TO KEEP VIDEO AND AUDIO SYNCED HOLY FUCK I WANT TO KILL MYSELF NOW.
+    // THIS PIECE OF SHIT WANTS EMPTY FRAMES OTHERWISE VIDEO PLAYS TOO FAST TO KEEP UP WITH AUDIO OR THE AUDIO PLAYS TOO EARLY.
+    // BUT WE CANT USE DELAYS TO GIVE DUMMY DATA BECAUSE PULSEAUDIO MIGHT GIVE AUDIO A BIG DELAYED!!!
+    const int64_t num_missing_frames = std::round((time_now - audio_device.received_audio_time) / frame_duration);
+    if(num_missing_frames >= 5) {
+        audio_device.received_audio_time = time_now;
+        ++audio_device.num_underruns;
+        audio_track_send_silence(audio_track, audio_device, num_missing_frames, audio_filter_mutex, output_writers, replay_buffer, replay_fragment_muxer, write_output_mutex);
+    }
+}
+
+// Reads the audio of all devices of all tracks on a single thread. The thread sleeps until any device has received audio
+static void audio_thread_run(std::vector<AudioTrack> &audio_tracks, SoundContext *sound_context, const gsr_thread_config *thread_config, std::mutex &audio_filter_mutex,
+                             std::deque<OutputWriter> &output_writers, gsr_replay_buffer *replay_buffer, ReplayFragmentMuxer *replay_fragment_muxer, std::mutex &write_output_mutex)
+{
+    gsr_thread_config_apply(thread_config, "gsr-audio");
+
+    // Silence has to be inserted for devices that don't receive audio, so the thread wakes up at least once per audio frame
+    double wait_timeout_secs = 1.0;
+    const double start_time = clock_get_monotonic_seconds();
+    for(AudioTrack &audio_track : audio_tracks) {
+        const AVSampleFormat sound_device_sample_format = audio_format_to_sample_format(audio_codec_context_get_audio_format(audio_track.codec_context));
+        const bool needs_audio_conversion = audio_track.codec_context->sample_fmt != sound_device_sample_format;
+        wait_timeout_secs = std::min(wait_timeout_secs, (double)audio_track.codec_context->frame_size / (double)audio_track.codec_context->sample_rate);
+
+        audio_track.silence_frame = create_audio_frame(audio_track.codec_context);
+        av_samples_set_silence(audio_track.silence_frame->extended_data, 0, audio_track.silence_frame->nb_samples, audio_frame_get_num_channels(audio_track.silence_frame), (AVSampleFormat)audio_track.silence_frame->format);
+
+        if(needs_audio_conversion) {
+            const int converted_buffer_size = av_samples_get_buffer_size(nullptr, audio_frame_get_num_channels(audio_track.frame), audio_track.frame->nb_samples, audio_track.codec_context->sample_fmt, 1);
+            audio_track.converted_buffer_pool = av_buffer_pool_init(converted_buffer_size, nullptr);
+            if(!audio_track.converted_buffer_pool) {
+                fprintf(stderr, "Error: failed to create audio buffer pool\n");
+                exit(1);
+            }
+        }
+
+        for(AudioDevice &audio_device : audio_track.audio_devices) {
+            audio_device.received_audio_time = start_time;
+            if(!needs_audio_conversion)
+                continue;
+
+            audio_device.swr = swr_alloc();
+            if(!audio_device.swr) {
+                fprintf(stderr, "Failed to create SwrContext\n");
+                exit(1);
+            }
+            av_opt_set_int(audio_device.swr, "in_channel_layout", AV_CH_LAYOUT_STEREO, 0);
+            av_opt_set_int(audio_device.swr, "out_channel_layout", AV_CH_LAYOUT_STEREO, 0);
+            av_opt_set_int(audio_device.swr, "in_sample_rate", audio_track.codec_context->sample_rate, 0);
+            av_opt_set_int(audio_device.swr, "out_sample_rate", audio_track.codec_context->sample_rate, 0);
+            av_opt_set_sample_fmt(audio_device.swr, "in_sample_fmt", sound_device_sample_format, 0);
+            av_opt_set_sample_fmt(audio_device.swr, "out_sample_fmt", audio_track.codec_context->sample_fmt, 0);
+            swr_init(audio_device.swr);
         }
+    }
+
+    const int wait_timeout_ms = std::max(1, (int)(wait_timeout_secs * 1000.0));
+    while(running) {
+        if(!sound_context->handle || sound_context_wait(sound_context, wait_timeout_ms) != 0)
+            usleep(wait_timeout_ms * 1000);
+
+        for(AudioTrack &audio_track : audio_tracks) {
+            for(AudioDevice &audio_device : audio_track.audio_devices) {
+                audio_device_process(audio_track, audio_device, audio_filter_mutex, output_writers, replay_buffer, replay_fragment_muxer, write_output_mutex);
+            }
+        }
+    }
+
+    for(AudioTrack &audio_track : audio_tracks) {
+        // Buffers that are still referenced by the encoder keep the pool alive until they are unreferenced
+        av_buffer_pool_uninit(&audio_track.converted_buffer_pool);
+        av_frame_free(&audio_track.silence_frame);
+
+        for(AudioDevice &audio_device : audio_track.audio_devices) {
+            if(audio_device.swr)
+                swr_free(&audio_device.swr);
+
+            if(!audio_device.sound_device.handle)
+                continue;
+
+            SoundDeviceStats sound_device_stats;
+            sound_device_get_stats(&audio_device.sound_device, &sound_device_stats);
+            const double avg_latency_secs = audio_device.num_latency_samples > 0 ? audio_device.latency_sum_secs / audio_device.num_latency_samples : 0.0;
+            fprintf(stderr, "Info: audio device %s: %lld chunks (%llu copies, %lld converted), latency avg %.1f ms, max %.1f ms. %lld underruns (%lld silent frames inserted), %llu overflows, %llu holes\n",
+                audio_device.audio_input.name.c_str(), (long long)audio_device.num_chunks, (unsigned long long)sound_device_stats.num_copies, (long long)audio_device.num_conversions,
+                avg_latency_secs * 1000.0, audio_device.max_latency_secs * 1000.0,
+                (long long)audio_device.num_underruns, (long long)audio_device.num_silent_frames,
+                (unsigned long long)sound_device_stats.num_overflows, (unsigned long long)sound_device_stats.num_holes);
+        }
+    }
+}
+
+static void replay_fragment_muxer_deinit(ReplayFragmentMuxer *self) {
+    if(!self->format_context)
+        return;
+
+    if(self->format_context->pb) {
+        av_freep(&self->format_context->pb->buffer);
+        avio_context_free(&self->format_context->pb);
+    }
+    avformat_free_context(self->format_context);
+    self->format_context = nullptr;
+}
+
+static bool replay_fragment_muxer_init(ReplayFragmentMuxer *self, AVCodecContext *video_codec_context, int video_stream_index, const std::vector<AudioTrack> &audio_tracks) {
+    avformat_alloc_output_context2(&self->format_context, nullptr, "mp4", nullptr);
+    if(!self->format_context) {
+        fprintf(stderr, "Error: Failed to create replay fragment muxer\n");
+        return false;
+    }
+
+    self->format_context->flags |= AVFMT_FLAG_GENPTS;
+    self->format_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    self->video_stream_index = video_stream_index;
+
+    AVStream *video_stream = create_stream(self->format_context, video_codec_context);
+    avcodec_parameters_from_context(video_stream->codecpar, video_codec_context);
+    self->stream_index_to_stream_map[video_stream_index] = video_stream;
+
+    for(const AudioTrack &audio_track : audio_tracks) {
+        AVStream *audio_stream = create_stream(self->format_context, audio_track.codec_context);
+        avcodec_parameters_from_context(audio_stream->codecpar, audio_track.codec_context);
+        self->stream_index_to_stream_map[audio_track.stream_index] = audio_stream;
+    }
+
+    const int io_buffer_size = 64 * 1024;
+    uint8_t *io_buffer = (uint8_t*)av_malloc(io_buffer_size);
+    if(io_buffer)
+        self->format_context->pb = avio_alloc_context(io_buffer, io_buffer_size, 1, self, nullptr, replay_fragment_muxer_write, nullptr);
+    if(!self->format_context->pb) {
+        fprintf(stderr, "Error: Failed to create replay fragment muxer output\n");
+        av_free(io_buffer);
+        replay_fragment_muxer_deinit(self);
+        return false;
+    }
+
+    AVDictionary *options = nullptr;
+    av_dict_set(&options, "strict", "experimental", 0);
+    // Every fragment has to be self-contained, so that any range of fragments can be saved after the init segment
+    av_dict_set(&options, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+
+    int ret = avformat_write_header(self->format_context, &options);
+    av_dict_free(&options);
+    if(ret < 0) {
+        fprintf(stderr, "Error occurred when writing header to replay fragment muxer: %s\n", av_error_to_string(ret));
+        replay_fragment_muxer_deinit(self);
+        return false;
+    }
+
+    avio_flush(self->format_context->pb);
+    self->init_segment = std::move(self->fragment_data);
+    self->fragment_data.clear();
+    return true;
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t size) {
+    while(size > 0) {
+        const ssize_t bytes_written = write(fd, data, size);
+        if(bytes_written == -1) {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        data += bytes_written;
+        size -= bytes_written;
+    }
+    return true;
+}
+
+// Saves a replay from a replay buffer that contains fragments from |replay_fragment_muxer|, this only copies the data to the file
+static void save_replay_fragments(const std::string &output_filepath, const std::vector<uint8_t> &init_segment, gsr_replay_buffer_snapshot *snapshot) {
+    const int fd = open(output_filepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd == -1) {
+        fprintf(stderr, "Error: Could not open '%s': %s. Make sure %s is an existing directory with write access\n", output_filepath.c_str(), strerror(errno), output_filepath.c_str());
+        gsr_replay_buffer_snapshot_deinit(snapshot);
+        return;
+    }
+
+    bool success = write_all(fd, init_segment.data(), init_segment.size());
+    for(;;) {
+        AVPacket av_packet;
+        memset(&av_packet, 0, sizeof(av_packet));
+        if(!gsr_replay_buffer_snapshot_next_packet(snapshot, &av_packet))
+            break;
+
+        if(success)
+            success = write_all(fd, av_packet.data, av_packet.size);
+        av_packet_unref(&av_packet);
+    }
+    gsr_replay_buffer_snapshot_deinit(snapshot);
+
+    if(!success)
+        fprintf(stderr, "Error: Failed to write replay to '%s': %s\n", output_filepath.c_str(), strerror(errno));
+    close(fd);
+}
+
+struct ReplaySave {
+    std::future<void> thread;
+    std::string output_filepath;
+};
+
+// Replays that are being saved, in the order they were requested. At most |REPLAY_SAVE_NUM_WORKERS| replays are saved at a time,
+// the other requests wait in the save request queue without taking a snapshot of the replay buffer (which would keep the replay buffer memory in use)
+static std::deque<ReplaySave> replay_saves;
+
+#define REPLAY_SAVE_NUM_WORKERS 2
+
+// Threads that save replays
+struct ReplaySaveWorkers {
+    std::mutex mutex;
+    std::condition_variable job_available;
+    std::deque<std::packaged_task<void()>> jobs;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+};
+
+static void replay_save_workers_run(ReplaySaveWorkers *self) {
+    // Saving runs with the default scheduling, so it doesn't compete with capturing when -ts or -tc is used
+    gsr_thread_config_apply_default("gsr-save");
+    for(;;) {
+        std::packaged_task<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(self->mutex);
+            self->job_available.wait(lock, [self]{ return self->stopping || !self->jobs.empty(); });
+            if(self->jobs.empty())
+                return;
+            job = std::move(self->jobs.front());
+            self->jobs.pop_front();
+        }
+        job();
+    }
+}
+
+static void replay_save_workers_start(ReplaySaveWorkers *self, int num_workers) {
+    for(int i = 0; i < num_workers; ++i) {
+        self->threads.push_back(std::thread(replay_save_workers_run, self));
+    }
+}
+
+// The jobs that have been added are finished before this returns
+static void replay_save_workers_stop(ReplaySaveWorkers *self) {
+    {
+        std::lock_guard<std::mutex> lock(self->mutex);
+        self->stopping = true;
+    }
+    self->job_available.notify_all();
+    for(std::thread &thread : self->threads) {
+        thread.join();
+    }
+    self->threads.clear();
+}
+
+template <typename F>
+static std::future<void> replay_save_workers_add_job(ReplaySaveWorkers *self, F &&func) {
+    std::packaged_task<void()> job(std::forward<F>(func));
+    std::future<void> future = job.get_future();
+    {
+        std::lock_guard<std::mutex> lock(self->mutex);
+        self->jobs.push_back(std::move(job));
+    }
+    self->job_available.notify_one();
+    return future;
+}
+
+// Multiple replays can be saved within the same second, so a number is added to the filename if the file already exists or is being saved
+static std::string get_replay_output_filepath(const std::string &output_dir, const std::string &file_extension) {
+    const std::string filepath_base = output_dir + "/Replay_" + get_date_str();
+    std::string filepath = filepath_base + "." + file_extension;
+    for(int i = 2; ; ++i) {
+        bool in_use = access(filepath.c_str(), F_OK) == 0;
+        for(const ReplaySave &replay_save : replay_saves) {
+            if(replay_save.output_filepath == filepath)
+                in_use = true;
+        }
+
+        if(!in_use)
+            return filepath;
+
+        filepath = filepath_base + "_" + std::to_string(i) + "." + file_extension;
+    }
+}
 
-        save_replay_packets.resize(frame_data_queue.size());
-        for(size_t i = 0; i < frame_data_queue.size(); ++i) {
-            av_packet_ref(&save_replay_packets[i], &frame_data_queue[i]);
-        }
+static void save_replay_async(ReplaySaveWorkers *replay_save_workers, AVCodecContext *video_codec_context, int video_stream_index, std::vector<AudioTrack> &audio_tracks, gsr_replay_buffer *replay_buffer, std::string output_dir, const char *container_format, const std::string &file_extension, ReplayFragmentMuxer *replay_fragment_muxer, std::mutex &write_output_mutex, int duration_secs) {
+    gsr_replay_buffer_snapshot snapshot;
+    {
+        std::lock_guard<std::mutex> lock(write_output_mutex);
+        // The current fragment is ended early so that the replay includes the newest packets
+        if(replay_fragment_muxer)
+            replay_fragment_muxer_flush(replay_fragment_muxer, replay_buffer);
+        if(!gsr_replay_buffer_snapshot_init(replay_buffer, &snapshot, duration_secs))
+            return;
+    }
+
+    ReplaySave replay_save;
+    replay_save.output_filepath = get_replay_output_filepath(output_dir, file_extension);
+    const std::string output_filepath = replay_save.output_filepath;
+    if(replay_fragment_muxer) {
+        const std::vector<uint8_t> *init_segment = &replay_fragment_muxer->init_segment;
+        replay_save.thread = replay_save_workers_add_job(replay_save_workers, [snapshot, output_filepath, init_segment]() mutable {
+            save_replay_fragments(output_filepath, *init_segment, &snapshot);
+        });
+        replay_saves.push_back(std::move(replay_save));
+        return;
     }
 
-    save_replay_output_filepath = output_dir + "/Replay_" + get_date_str() + "." + file_extension;
-    save_replay_thread = std::async(std::launch::async, [video_stream_index, container_format, start_index, video_pts_offset, audio_pts_offset, video_codec_context, &audio_tracks]() mutable {
+    replay_save.thread = replay_save_workers_add_job(replay_save_workers, [video_stream_index, container_format, snapshot, output_filepath, video_codec_context, &audio_tracks]() mutable {
         AVFormatContext *av_format_context;
         avformat_alloc_output_context2(&av_format_context, nullptr, container_format, nullptr);
 
@@ -755,17 +2255,18 @@ static void save_replay_async(AVCodecContext *video_codec_context, int video_str
         AVStream *video_stream = create_stream(av_format_context, video_codec_context);
         avcodec_parameters_from_context(video_stream->codecpar, video_codec_context);
 
-        std::unordered_map<int, AudioTrack*> stream_index_to_audio_track_map;
-        for(AudioTrack &audio_track : audio_tracks) {
-            stream_index_to_audio_track_map[audio_track.stream_index] = &audio_track;
+        // Multiple replays can be saved at the same time, so the audio streams are kept here instead of in the (shared) audio tracks
+        std::unordered_map<int, std::pair<AVStream*, AVCodecContext*>> stream_index_to_audio_stream_map;
+        for(const AudioTrack &audio_track : audio_tracks) {
             AVStream *audio_stream = create_stream(av_format_context, audio_track.codec_context);
             avcodec_parameters_from_context(audio_stream->codecpar, audio_track.codec_context);
-            audio_track.stream = audio_stream;
+            stream_index_to_audio_stream_map[audio_track.stream_index] = std::make_pair(audio_stream, audio_track.codec_context);
         }
 
-        int ret = avio_open(&av_format_context->pb, save_replay_output_filepath.c_str(), AVIO_FLAG_WRITE);
+        int ret = avio_open(&av_format_context->pb, output_filepath.c_str(), AVIO_FLAG_WRITE);
         if (ret < 0) {
-            fprintf(stderr, "Error: Could not open '%s': %s. Make sure %s is an existing directory with write access\n", save_replay_output_filepath.c_str(), av_error_to_string(ret), save_replay_output_filepath.c_str());
+            fprintf(stderr, "Error: Could not open '%s': %s. Make sure %s is an existing directory with write access\n", output_filepath.c_str(), av_error_to_string(ret), output_filepath.c_str());
+            gsr_replay_buffer_snapshot_deinit(&snapshot);
             return;
         }
 
@@ -775,22 +2276,43 @@ static void save_replay_async(AVCodecContext *video_codec_context, int video_str
         ret = avformat_write_header(av_format_context, &options);
         if (ret < 0) {
             fprintf(stderr, "Error occurred when writing header to output file: %s\n", av_error_to_string(ret));
+            gsr_replay_buffer_snapshot_deinit(&snapshot);
             return;
         }
 
-        for(size_t i = start_index; i < save_replay_packets.size(); ++i) {
-            AVPacket &av_packet = save_replay_packets[i];
+        // The snapshot starts at a video keyframe if packets have been removed from the replay buffer, the first video and audio packets from there become the new zero timestamps
+        const bool packets_erased = snapshot.packets_erased;
+        bool has_video_pts_offset = !packets_erased;
+        bool has_audio_pts_offset = !packets_erased;
+        int64_t video_pts_offset = 0;
+        int64_t audio_pts_offset = 0;
+
+        for(;;) {
+            AVPacket av_packet;
+            memset(&av_packet, 0, sizeof(av_packet));
+            if(!gsr_replay_buffer_snapshot_next_packet(&snapshot, &av_packet))
+                break;
 
             AVStream *stream = video_stream;
             AVCodecContext *codec_context = video_codec_context;
 
             if(av_packet.stream_index == video_stream_index) {
+                if(!has_video_pts_offset) {
+                    has_video_pts_offset = true;
+                    video_pts_offset = av_packet.pts;
+                }
+
                 av_packet.pts -= video_pts_offset;
                 av_packet.dts -= video_pts_offset;
             } else {
-                AudioTrack *audio_track = stream_index_to_audio_track_map[av_packet.stream_index];
-                stream = audio_track->stream;
-                codec_context = audio_track->codec_context;
+                const auto &audio_stream = stream_index_to_audio_stream_map[av_packet.stream_index];
+                stream = audio_stream.first;
+                codec_context = audio_stream.second;
+
+                if(!has_audio_pts_offset) {
+                    has_audio_pts_offset = true;
+                    audio_pts_offset = av_packet.pts;
+                }
 
                 av_packet.pts -= audio_pts_offset;
                 av_packet.dts -= audio_pts_offset;
@@ -802,7 +2324,9 @@ static void save_replay_async(AVCodecContext *video_codec_context, int video_str
             int ret = av_interleaved_write_frame(av_format_context, &av_packet);
             if(ret < 0)
                 fprintf(stderr, "Error: Failed to write frame index %d to muxer, reason: %s (%d)\n", stream->index, av_error_to_string(ret), ret);
+            av_packet_unref(&av_packet);
         }
+        gsr_replay_buffer_snapshot_deinit(&snapshot);
 
         if (av_write_trailer(av_format_context) != 0)
             fprintf(stderr, "Failed to write trailer\n");
@@ -810,11 +2334,8 @@ static void save_replay_async(AVCodecContext *video_codec_context, int video_str
         avio_close(av_format_context->pb);
         avformat_free_context(av_format_context);
         av_dict_free(&options);
-
-        for(AudioTrack &audio_track : audio_tracks) {
-            audio_track.stream = nullptr;
-        }
     });
+    replay_saves.push_back(std::move(replay_save));
 }
 
 static void split_string(const std::string &str, char delimiter, std::function<bool(const char*,size_t)> callback) {
@@ -847,6 +2368,49 @@ static std::vector<AudioInput> parse_audio_input_arg(const char *str) {
     return audio_inputs;
 }
 
+struct HlsParams {
+    double segment_duration_secs = 2.0;
+    int playlist_size = 6;
+    bool fmp4 = false;
+};
+
+static bool is_hls_output(const AVFormatContext *av_format_context) {
+    return strcmp(av_format_context->oformat->name, "hls") == 0;
+}
+
+// The hls muxer writes the segments next to the playlist and cuts segments at video keyframes.
+// Only the last |playlist_size| segments are kept, older segments are deleted. Files are written to a temporary file first and then renamed,
+// so that a web server never serves a partially written playlist or segment
+static void hls_add_header_options(AVDictionary **options, const HlsParams &hls_params) {
+    av_dict_set_int(options, "hls_list_size", hls_params.playlist_size, 0);
+    av_dict_set(options, "hls_time", std::to_string(hls_params.segment_duration_secs).c_str(), 0);
+    av_dict_set(options, "hls_flags", "independent_segments+delete_segments+temp_file", 0);
+    av_dict_set(options, "hls_segment_type", hls_params.fmp4 ? "fmp4" : "mpegts", 0);
+}
+
+// Additional outputs can select the container format with a prefix in brackets, for example "[flv]rtmp://live.twitch.tv/app/key".
+// Returns the output without the prefix. |container_format| is set to the format in the prefix, or is empty if there is no prefix
+static std::string parse_output_container_format(const char *output, std::string &container_format) {
+    container_format.clear();
+    const char *format_end = output[0] == '[' ? strchr(output, ']') : nullptr;
+    if(!format_end)
+        return output;
+
+    container_format.assign(output + 1, format_end - (output + 1));
+    return format_end + 1;
+}
+
+static std::string output_format_get_file_extension(const AVOutputFormat *output_format) {
+    if(!output_format->extensions)
+        return "";
+
+    std::string file_extension = output_format->extensions;
+    size_t comma_index = file_extension.find(',');
+    if(comma_index != std::string::npos)
+        file_extension = file_extension.substr(0, comma_index);
+    return file_extension;
+}
+
 // TODO: Does this match all livestreaming cases?
 static bool is_livestream_path(const char *str) {
     const int len = strlen(str);
@@ -1010,159 +2574,538 @@ static int init_filter_graph(AVCodecContext *audio_codec_context, AVFilterGraph
 }
 
 int main(int argc, char **argv) {
+    // Replays are saved with the cpu affinity the program was started with, so that has to be saved before the affinity of the main thread is changed
+    gsr_thread_config_save_process_affinity();
     signal(SIGINT, int_handler);
     signal(SIGUSR1, save_replay_handler);
 
-    //av_log_set_level(AV_LOG_TRACE);
+    struct sigaction save_replay_clip_action;
+    memset(&save_replay_clip_action, 0, sizeof(save_replay_clip_action));
+    save_replay_clip_action.sa_sigaction = save_replay_clip_handler;
+    save_replay_clip_action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&save_replay_clip_action.sa_mask);
+    sigaction(SIGUSR2, &save_replay_clip_action, nullptr);
+
+    //av_log_set_level(AV_LOG_TRACE);
+
+    std::map<std::string, Arg> args = {
+        //                optional?, list?
+        { "-w", Arg { {}, false, false } },
+        { "-c", Arg { {}, true, false } },
+        { "-e", Arg { {}, true, false } },
+        { "-f", Arg { {}, false, false } },
+        { "-s", Arg { {}, true, false } },
+        { "-a", Arg { {}, true, true } },
+        { "-q", Arg { {}, true, false } },
+        { "-o", Arg { {}, true, true } },
+        { "-r", Arg { {}, true, false } },
+        { "-k", Arg { {}, true, false } },
+        { "-ac", Arg { {}, true, false } },
+        { "-rm", Arg { {}, true, false } },
+        { "-rd", Arg { {}, true, false } },
+        { "-rc", Arg { {}, true, false } },
+        { "-rf", Arg { {}, true, false } },
+        { "-mq", Arg { {}, true, false } },
+        { "-sp", Arg { {}, true, false } },
+        { "-wb", Arg { {}, true, false } },
+        { "-wp", Arg { {}, true, false } },
+        { "-wd", Arg { {}, true, false } },
+        { "-wu", Arg { {}, true, false } },
+        { "-fd", Arg { {}, true, false } },
+        { "-fs", Arg { {}, true, false } },
+        { "-st", Arg { {}, true, false } },
+        { "-ss", Arg { {}, true, false } },
+        { "-hd", Arg { {}, true, false } },
+        { "-hn", Arg { {}, true, false } },
+        { "-hs", Arg { {}, true, false } },
+        { "-nb", Arg { {}, true, false } },
+        { "-vb", Arg { {}, true, false } },
+        { "-fm", Arg { {}, true, false } },
+        { "-mi", Arg { {}, true, false } },
+        { "-pd", Arg { {}, true, false } },
+        { "-ts", Arg { {}, true, false } },
+        { "-tc", Arg { {}, true, false } },
+        { "-ta", Arg { {}, true, false } },
+        { "-ml", Arg { {}, true, false } }
+    };
+
+    for(int i = 1; i < argc - 1; i += 2) {
+        auto it = args.find(argv[i]);
+        if(it == args.end()) {
+            fprintf(stderr, "Invalid argument '%s'\n", argv[i]);
+            usage();
+        }
+
+        if(!it->second.values.empty() && !it->second.list) {
+            fprintf(stderr, "Expected argument '%s' to only be specified once\n", argv[i]);
+            usage();
+        }
+
+        it->second.values.push_back(argv[i + 1]);
+    }
+
+    for(auto &it : args) {
+        if(!it.second.optional && !it.second.value()) {
+            fprintf(stderr, "Missing argument '%s'\n", it.first.c_str());
+            usage();
+        }
+    }
+
+    VideoCodec video_codec = VideoCodec::H265;
+    const char *video_codec_to_use = args["-k"].value();
+    if(!video_codec_to_use)
+        video_codec_to_use = "auto";
+
+    if(strcmp(video_codec_to_use, "h264") == 0) {
+        video_codec = VideoCodec::H264;
+    } else if(strcmp(video_codec_to_use, "h265") == 0) {
+        video_codec = VideoCodec::H265;
+    } else if(strcmp(video_codec_to_use, "auto") != 0) {
+        fprintf(stderr, "Error: -k should either be either 'auto', 'h264' or 'h265', got: '%s'\n", video_codec_to_use);
+        usage();
+    }
+
+    AudioCodec audio_codec = AudioCodec::AAC;
+    const char *audio_codec_to_use = args["-ac"].value();
+    if(!audio_codec_to_use)
+        audio_codec_to_use = "opus";
+
+    if(strcmp(audio_codec_to_use, "aac") == 0) {
+        audio_codec = AudioCodec::AAC;
+    } else if(strcmp(audio_codec_to_use, "opus") == 0) {
+        audio_codec = AudioCodec::OPUS;
+    } else if(strcmp(audio_codec_to_use, "flac") == 0) {
+        audio_codec = AudioCodec::FLAC;
+    } else {
+        fprintf(stderr, "Error: -ac should either be either 'aac', 'opus' or 'flac', got: '%s'\n", audio_codec_to_use);
+        usage();
+    }
+
+    const Arg &audio_input_arg = args["-a"];
+    const std::vector<AudioInput> audio_inputs = get_pulseaudio_inputs();
+    std::vector<MergedAudioInputs> requested_audio_inputs;
+
+    // Manually check if the audio inputs we give exist. This is only needed for pipewire, not pulseaudio.
+    // Pipewire instead DEFAULTS TO THE DEFAULT AUDIO INPUT. THAT'S RETARDED.
+    // OH, YOU MISSPELLED THE AUDIO INPUT? FUCK YOU
+    for(const char *audio_input : audio_input_arg.values) {
+        requested_audio_inputs.push_back({parse_audio_input_arg(audio_input)});
+        for(AudioInput &request_audio_input : requested_audio_inputs.back().audio_inputs) {
+            bool match = false;
+            for(const auto &existing_audio_input : audio_inputs) {
+                if(strcmp(request_audio_input.name.c_str(), existing_audio_input.name.c_str()) == 0) {
+                    if(request_audio_input.description.empty())
+                        request_audio_input.description = "gsr-" + existing_audio_input.description;
+
+                    match = true;
+                    break;
+                }
+            }
+
+            if(!match) {
+                fprintf(stderr, "Error: Audio input device '%s' is not a valid audio device, expected one of:\n", request_audio_input.name.c_str());
+                for(const auto &existing_audio_input : audio_inputs) {
+                    fprintf(stderr, "    %s\n", existing_audio_input.name.c_str());
+                }
+                exit(2);
+            }
+        }
+    }
+
+    const char *container_format = args["-c"].value();
+
+    const char *fail_fast_str = args["-e"].value();
+    if(!fail_fast_str)
+        fail_fast_str = "false";
+
+    bool fail_fast = false;    
+    if(strcmp(fail_fast_str, "true") == 0) {
+        fail_fast = true;
+        fprintf(stderr, "Warning: Easy crash mode is enabled. This will make the program crash more easily when it encounters an error.\n");
+    } else if(strcmp(fail_fast_str, "false") != 0) {
+        fprintf(stderr, "Error: -e should either be either 'true' or 'false', got: '%s'\n", fail_fast_str);
+        usage();
+    }
+
+    int fps = atoi(args["-f"].value());
+    if(fps == 0) {
+        fprintf(stderr, "Invalid fps argument: %s\n", args["-f"].value());
+        return 1;
+    }
+    if(fps < 1)
+        fps = 1;
+
+    const char *quality_str = args["-q"].value();
+    if(!quality_str)
+        quality_str = "very_high";
+
+    VideoQuality quality;
+    if(strcmp(quality_str, "medium") == 0) {
+        quality = VideoQuality::MEDIUM;
+    } else if(strcmp(quality_str, "high") == 0) {
+        quality = VideoQuality::HIGH;
+    } else if(strcmp(quality_str, "very_high") == 0) {
+        quality = VideoQuality::VERY_HIGH;
+    } else if(strcmp(quality_str, "ultra") == 0) {
+        quality = VideoQuality::ULTRA;
+    } else {
+        fprintf(stderr, "Error: -q should either be either 'medium', 'high', 'very_high' or 'ultra', got: '%s'\n", quality_str);
+        usage();
+    }
+
+    int replay_buffer_size_secs = -1;
+    const char *replay_buffer_size_secs_str = args["-r"].value();
+    if(replay_buffer_size_secs_str) {
+        replay_buffer_size_secs = atoi(replay_buffer_size_secs_str);
+        if(replay_buffer_size_secs < 5 || replay_buffer_size_secs > 1200) {
+            fprintf(stderr, "Error: option -r has to be between 5 and 1200, was: %s\n", replay_buffer_size_secs_str);
+            return 1;
+        }
+    }
+
+    // The replay buffer always keeps at least |replay_buffer_size_secs| of data since only whole gops are removed from it
+    size_t replay_buffer_max_size = 0;
+    bool replay_buffer_preallocate = false;
+    const char *replay_buffer_max_size_str = args["-rm"].value();
+    if(replay_buffer_max_size_str) {
+        if(replay_buffer_size_secs == -1) {
+            fprintf(stderr, "Error: option -rm is only available when using -r\n");
+            usage();
+        }
+
+        if(!parse_size_str(replay_buffer_max_size_str, &replay_buffer_max_size)) {
+            fprintf(stderr, "Error: invalid value for option -rm '%s', expected a size such as 512M or 2G\n", replay_buffer_max_size_str);
+            usage();
+        }
+        replay_buffer_preallocate = true;
+    } else if(replay_buffer_size_secs != -1) {
+        replay_buffer_max_size = (size_t)(replay_buffer_size_secs + REPLAY_BUFFER_MAX_GOP_SECS) * (size_t)(REPLAY_BUFFER_MAX_BITRATE / 8);
+    }
+
+    const char *replay_buffer_dir = args["-rd"].value();
+    if(replay_buffer_dir) {
+        if(replay_buffer_size_secs == -1) {
+            fprintf(stderr, "Error: option -rd is only available when using -r\n");
+            usage();
+        }
+
+        struct stat buf;
+        if(stat(replay_buffer_dir, &buf) == -1 || !S_ISDIR(buf.st_mode)) {
+            fprintf(stderr, "Error: directory \"%s\" does not exist or is not a directory\n", replay_buffer_dir);
+            usage();
+        }
+    }
+
+    const char *replay_clip_duration_str = args["-rc"].value();
+    if(replay_clip_duration_str) {
+        if(replay_buffer_size_secs == -1) {
+            fprintf(stderr, "Error: option -rc is only available when using -r\n");
+            usage();
+        }
+
+        const int replay_clip_duration_secs = atoi(replay_clip_duration_str);
+        if(replay_clip_duration_secs < 1 || replay_clip_duration_secs > SAVE_REPLAY_CLIP_MAX_DURATION_SECS) {
+            fprintf(stderr, "Error: option -rc has to be between 1 and %d, was: %s\n", SAVE_REPLAY_CLIP_MAX_DURATION_SECS, replay_clip_duration_str);
+            return 1;
+        }
+        save_replay_clip_duration_secs = replay_clip_duration_secs;
+    }
+
+    const char *replay_fragments_str = args["-rf"].value();
+    if(!replay_fragments_str)
+        replay_fragments_str = "false";
+
+    bool replay_fragments = false;
+    if(strcmp(replay_fragments_str, "true") == 0) {
+        replay_fragments = true;
+    } else if(strcmp(replay_fragments_str, "false") != 0) {
+        fprintf(stderr, "Error: -rf should either be either 'true' or 'false', got: '%s'\n", replay_fragments_str);
+        usage();
+    }
+
+    if(replay_fragments) {
+        if(replay_buffer_size_secs == -1) {
+            fprintf(stderr, "Error: option -rf is only available when using -r\n");
+            usage();
+        }
+
+        if(!container_format || strcmp(container_format, "mp4") != 0) {
+            fprintf(stderr, "Error: option -rf is only available when -c is mp4\n");
+            usage();
+        }
+    }
+
+    OutputQueuePolicy output_queue_policy = OutputQueuePolicy::BLOCK;
+    const char *output_queue_policy_str = args["-mq"].value();
+    if(output_queue_policy_str) {
+        if(replay_buffer_size_secs != -1) {
+            fprintf(stderr, "Error: option -mq is not available when using -r\n");
+            usage();
+        }
+
+        if(strcmp(output_queue_policy_str, "block") == 0) {
+            output_queue_policy = OutputQueuePolicy::BLOCK;
+        } else if(strcmp(output_queue_policy_str, "drop-silence") == 0) {
+            output_queue_policy = OutputQueuePolicy::DROP_SILENCE;
+        } else if(strcmp(output_queue_policy_str, "drop-video") == 0) {
+            output_queue_policy = OutputQueuePolicy::DROP_VIDEO;
+        } else {
+            fprintf(stderr, "Error: -mq should either be either 'block', 'drop-silence' or 'drop-video', got: '%s'\n", output_queue_policy_str);
+            usage();
+        }
+    }
+
+    PipePolicy pipe_policy = PipePolicy::BLOCK;
+    const char *pipe_policy_str = args["-sp"].value();
+    if(pipe_policy_str) {
+        if(strcmp(pipe_policy_str, "block") == 0) {
+            pipe_policy = PipePolicy::BLOCK;
+        } else if(strcmp(pipe_policy_str, "drop") == 0) {
+            pipe_policy = PipePolicy::DROP;
+        } else if(strcmp(pipe_policy_str, "abort") == 0) {
+            pipe_policy = PipePolicy::ABORT;
+        } else {
+            fprintf(stderr, "Error: -sp should either be either 'block', 'drop' or 'abort', got: '%s'\n", pipe_policy_str);
+            usage();
+        }
+    }
+
+    gsr_file_writer_params file_writer_params;
+    file_writer_params.buffer_size = 4 * 1024 * 1024;
+    file_writer_params.preallocate_size = 0;
+    file_writer_params.direct_io = false;
+    file_writer_params.io_uring = false;
+
+    const char *write_buffer_size_str = args["-wb"].value();
+    if(write_buffer_size_str) {
+        if(!parse_size_str(write_buffer_size_str, &file_writer_params.buffer_size) || file_writer_params.buffer_size == 0) {
+            fprintf(stderr, "Error: invalid value for option -wb '%s', expected a size such as 512K or 8M\n", write_buffer_size_str);
+            usage();
+        }
+    }
+
+    const char *write_preallocate_size_str = args["-wp"].value();
+    if(write_preallocate_size_str) {
+        if(!parse_size_str(write_preallocate_size_str, &file_writer_params.preallocate_size)) {
+            fprintf(stderr, "Error: invalid value for option -wp '%s', expected a size such as 64M or 1G\n", write_preallocate_size_str);
+            usage();
+        }
+    }
+
+    const char *write_direct_io_str = args["-wd"].value();
+    if(!write_direct_io_str)
+        write_direct_io_str = "false";
+
+    if(strcmp(write_direct_io_str, "true") == 0) {
+        file_writer_params.direct_io = true;
+    } else if(strcmp(write_direct_io_str, "false") != 0) {
+        fprintf(stderr, "Error: -wd should either be either 'true' or 'false', got: '%s'\n", write_direct_io_str);
+        usage();
+    }
+
+    const char *write_io_uring_str = args["-wu"].value();
+    if(!write_io_uring_str)
+        write_io_uring_str = "false";
+
+    if(strcmp(write_io_uring_str, "true") == 0) {
+        file_writer_params.io_uring = true;
+    } else if(strcmp(write_io_uring_str, "false") != 0) {
+        fprintf(stderr, "Error: -wu should either be either 'true' or 'false', got: '%s'\n", write_io_uring_str);
+        usage();
+    }
+
+    double fragment_duration_secs = 0.0;
+    const char *fragment_duration_str = args["-fd"].value();
+    if(fragment_duration_str) {
+        if(replay_buffer_size_secs != -1) {
+            fprintf(stderr, "Error: option -fd is not available when using -r\n");
+            usage();
+        }
+
+        fragment_duration_secs = atof(fragment_duration_str);
+        if(fragment_duration_secs < 0.1 || fragment_duration_secs > 600.0) {
+            fprintf(stderr, "Error: option -fd has to be between 0.1 and 600, was: %s\n", fragment_duration_str);
+            return 1;
+        }
+    }
+
+    const char *faststart_str = args["-fs"].value();
+    if(!faststart_str)
+        faststart_str = "false";
 
-    std::map<std::string, Arg> args = {
-        //                optional?, list?
-        { "-w", Arg { {}, false, false } },
-        { "-c", Arg { {}, true, false } },
-        { "-e", Arg { {}, true, false } },
-        { "-f", Arg { {}, false, false } },
-        { "-s", Arg { {}, true, false } },
-        { "-a", Arg { {}, true, true } },
-        { "-q", Arg { {}, true, false } },
-        { "-o", Arg { {}, true, false } },
-        { "-r", Arg { {}, true, false } },
-        { "-k", Arg { {}, true, false } },
-        { "-ac", Arg { {}, true, false } }
-    };
+    bool faststart = false;
+    if(strcmp(faststart_str, "true") == 0) {
+        faststart = true;
+    } else if(strcmp(faststart_str, "false") != 0) {
+        fprintf(stderr, "Error: -fs should either be either 'true' or 'false', got: '%s'\n", faststart_str);
+        usage();
+    }
 
-    for(int i = 1; i < argc - 1; i += 2) {
-        auto it = args.find(argv[i]);
-        if(it == args.end()) {
-            fprintf(stderr, "Invalid argument '%s'\n", argv[i]);
+    if(faststart) {
+        if(replay_buffer_size_secs != -1) {
+            fprintf(stderr, "Error: option -fs is not available when using -r\n");
             usage();
         }
 
-        if(!it->second.values.empty() && !it->second.list) {
-            fprintf(stderr, "Expected argument '%s' to only be specified once\n", argv[i]);
+        if(fragment_duration_secs > 0.0) {
+            fprintf(stderr, "Error: option -fs can't be used together with -fd\n");
             usage();
         }
 
-        it->second.values.push_back(argv[i + 1]);
+        if(!args["-o"].value()) {
+            fprintf(stderr, "Error: option -fs requires an output file (-o)\n");
+            usage();
+        }
     }
 
-    for(auto &it : args) {
-        if(!it.second.optional && !it.second.value()) {
-            fprintf(stderr, "Missing argument '%s'\n", it.first.c_str());
+    double segment_time_secs = 0.0;
+    const char *segment_time_str = args["-st"].value();
+    if(segment_time_str) {
+        segment_time_secs = atof(segment_time_str);
+        if(segment_time_secs < 1.0) {
+            fprintf(stderr, "Error: option -st has to be at least 1, was: %s\n", segment_time_str);
+            return 1;
+        }
+    }
+
+    size_t segment_size = 0;
+    const char *segment_size_str = args["-ss"].value();
+    if(segment_size_str) {
+        if(!parse_size_str(segment_size_str, &segment_size) || segment_size == 0) {
+            fprintf(stderr, "Error: invalid value for option -ss '%s', expected a size such as 512M or 2G\n", segment_size_str);
             usage();
         }
     }
 
-    VideoCodec video_codec = VideoCodec::H265;
-    const char *video_codec_to_use = args["-k"].value();
-    if(!video_codec_to_use)
-        video_codec_to_use = "auto";
+    HlsParams hls_params;
+    const char *hls_segment_duration_str = args["-hd"].value();
+    if(hls_segment_duration_str) {
+        hls_params.segment_duration_secs = atof(hls_segment_duration_str);
+        if(hls_params.segment_duration_secs < 0.5 || hls_params.segment_duration_secs > 60.0) {
+            fprintf(stderr, "Error: option -hd has to be between 0.5 and 60, was: %s\n", hls_segment_duration_str);
+            return 1;
+        }
+    }
 
-    if(strcmp(video_codec_to_use, "h264") == 0) {
-        video_codec = VideoCodec::H264;
-    } else if(strcmp(video_codec_to_use, "h265") == 0) {
-        video_codec = VideoCodec::H265;
-    } else if(strcmp(video_codec_to_use, "auto") != 0) {
-        fprintf(stderr, "Error: -k should either be either 'auto', 'h264' or 'h265', got: '%s'\n", video_codec_to_use);
-        usage();
+    const char *hls_playlist_size_str = args["-hn"].value();
+    if(hls_playlist_size_str) {
+        hls_params.playlist_size = atoi(hls_playlist_size_str);
+        if(hls_params.playlist_size < 1 || hls_params.playlist_size > 1000) {
+            fprintf(stderr, "Error: option -hn has to be between 1 and 1000, was: %s\n", hls_playlist_size_str);
+            return 1;
+        }
     }
 
-    AudioCodec audio_codec = AudioCodec::AAC;
-    const char *audio_codec_to_use = args["-ac"].value();
-    if(!audio_codec_to_use)
-        audio_codec_to_use = "opus";
+    const char *hls_segment_type_str = args["-hs"].value();
+    if(hls_segment_type_str) {
+        if(strcmp(hls_segment_type_str, "fmp4") == 0) {
+            hls_params.fmp4 = true;
+        } else if(strcmp(hls_segment_type_str, "ts") != 0) {
+            fprintf(stderr, "Error: -hs should either be either 'ts' or 'fmp4', got: '%s'\n", hls_segment_type_str);
+            usage();
+        }
+    }
 
-    if(strcmp(audio_codec_to_use, "aac") == 0) {
-        audio_codec = AudioCodec::AAC;
-    } else if(strcmp(audio_codec_to_use, "opus") == 0) {
-        audio_codec = AudioCodec::OPUS;
-    } else if(strcmp(audio_codec_to_use, "flac") == 0) {
-        audio_codec = AudioCodec::FLAC;
-    } else {
-        fprintf(stderr, "Error: -ac should either be either 'aac', 'opus' or 'flac', got: '%s'\n", audio_codec_to_use);
-        usage();
+    size_t network_backlog_size = 64 * 1024 * 1024;
+    const char *network_backlog_size_str = args["-nb"].value();
+    if(network_backlog_size_str) {
+        if(!parse_size_str(network_backlog_size_str, &network_backlog_size)) {
+            fprintf(stderr, "Error: invalid value for option -nb '%s', expected a size such as 128M\n", network_backlog_size_str);
+            usage();
+        }
     }
 
-    const Arg &audio_input_arg = args["-a"];
-    const std::vector<AudioInput> audio_inputs = get_pulseaudio_inputs();
-    std::vector<MergedAudioInputs> requested_audio_inputs;
+    int64_t livestream_max_bitrate = 0;
+    const char *livestream_max_bitrate_str = args["-vb"].value();
+    if(livestream_max_bitrate_str) {
+        livestream_max_bitrate = atoll(livestream_max_bitrate_str);
+        if(livestream_max_bitrate < 100 || livestream_max_bitrate > 500000) {
+            fprintf(stderr, "Error: option -vb has to be between 100 and 500000, was: %s\n", livestream_max_bitrate_str);
+            return 1;
+        }
+        livestream_max_bitrate *= 1000;
+    }
 
-    // Manually check if the audio inputs we give exist. This is only needed for pipewire, not pulseaudio.
-    // Pipewire instead DEFAULTS TO THE DEFAULT AUDIO INPUT. THAT'S RETARDED.
-    // OH, YOU MISSPELLED THE AUDIO INPUT? FUCK YOU
-    for(const char *audio_input : audio_input_arg.values) {
-        requested_audio_inputs.push_back({parse_audio_input_arg(audio_input)});
-        for(AudioInput &request_audio_input : requested_audio_inputs.back().audio_inputs) {
-            bool match = false;
-            for(const auto &existing_audio_input : audio_inputs) {
-                if(strcmp(request_audio_input.name.c_str(), existing_audio_input.name.c_str()) == 0) {
-                    if(request_audio_input.description.empty())
-                        request_audio_input.description = "gsr-" + existing_audio_input.description;
+    bool variable_frame_rate = false;
+    const char *frame_rate_mode_str = args["-fm"].value();
+    if(frame_rate_mode_str) {
+        if(strcmp(frame_rate_mode_str, "vfr") == 0) {
+            variable_frame_rate = true;
+        } else if(strcmp(frame_rate_mode_str, "cfr") != 0) {
+            fprintf(stderr, "Error: -fm should either be either 'cfr' or 'vfr', got: '%s'\n", frame_rate_mode_str);
+            usage();
+        }
+    }
 
-                    match = true;
-                    break;
-                }
-            }
+    double max_frame_interval_secs = 1.0;
+    const char *max_frame_interval_str = args["-mi"].value();
+    if(max_frame_interval_str) {
+        if(!variable_frame_rate) {
+            fprintf(stderr, "Error: option -mi is only available when -fm is 'vfr'\n");
+            usage();
+        }
 
-            if(!match) {
-                fprintf(stderr, "Error: Audio input device '%s' is not a valid audio device, expected one of:\n", request_audio_input.name.c_str());
-                for(const auto &existing_audio_input : audio_inputs) {
-                    fprintf(stderr, "    %s\n", existing_audio_input.name.c_str());
-                }
-                exit(2);
-            }
+        max_frame_interval_secs = atof(max_frame_interval_str);
+        if(max_frame_interval_secs < 0.1 || max_frame_interval_secs > 10.0) {
+            fprintf(stderr, "Error: option -mi has to be between 0.1 and 10, was: %s\n", max_frame_interval_str);
+            return 1;
         }
     }
 
-    const char *container_format = args["-c"].value();
+    int pipeline_depth = 3;
+    const char *pipeline_depth_str = args["-pd"].value();
+    if(pipeline_depth_str) {
+        pipeline_depth = atoi(pipeline_depth_str);
+        if(pipeline_depth < 1 || pipeline_depth > 8) {
+            fprintf(stderr, "Error: option -pd has to be between 1 and 8, was: %s\n", pipeline_depth_str);
+            return 1;
+        }
+    }
 
-    const char *fail_fast_str = args["-e"].value();
-    if(!fail_fast_str)
-        fail_fast_str = "false";
+    gsr_thread_config capture_thread_config;
+    gsr_thread_config_init(&capture_thread_config);
+    const char *thread_scheduling_str = args["-ts"].value();
+    if(thread_scheduling_str && !gsr_thread_config_parse_scheduling(&capture_thread_config, thread_scheduling_str)) {
+        fprintf(stderr, "Error: -ts should either be either 'fifo:<priority>', 'rr:<priority>' (priority between 1 and 99) or 'nice:<niceness>' (niceness between -20 and 19), got: '%s'\n", thread_scheduling_str);
+        usage();
+    }
 
-    bool fail_fast = false;    
-    if(strcmp(fail_fast_str, "true") == 0) {
-        fail_fast = true;
-        fprintf(stderr, "Warning: Easy crash mode is enabled. This will make the program crash more easily when it encounters an error.\n");
-    } else if(strcmp(fail_fast_str, "false") != 0) {
-        fprintf(stderr, "Error: -e should either be either 'true' or 'false', got: '%s'\n", fail_fast_str);
+    gsr_thread_config audio_thread_config = capture_thread_config;
+    const char *capture_cpus_str = args["-tc"].value();
+    if(capture_cpus_str && !gsr_thread_config_parse_cpus(&capture_thread_config, capture_cpus_str)) {
+        fprintf(stderr, "Error: -tc should be a list of cpus between 0 and %d, for example '2' or '4-7,10', got: '%s'\n", GSR_THREAD_CONFIG_MAX_CPUS - 1, capture_cpus_str);
         usage();
     }
 
-    int fps = atoi(args["-f"].value());
-    if(fps == 0) {
-        fprintf(stderr, "Invalid fps argument: %s\n", args["-f"].value());
-        return 1;
+    const char *audio_cpus_str = args["-ta"].value();
+    if(audio_cpus_str && !gsr_thread_config_parse_cpus(&audio_thread_config, audio_cpus_str)) {
+        fprintf(stderr, "Error: -ta should be a list of cpus between 0 and %d, for example '3' or '0,1', got: '%s'\n", GSR_THREAD_CONFIG_MAX_CPUS - 1, audio_cpus_str);
+        usage();
     }
-    if(fps < 1)
-        fps = 1;
 
-    const char *quality_str = args["-q"].value();
-    if(!quality_str)
-        quality_str = "very_high";
+    const char *lock_memory_str = args["-ml"].value();
+    if(!lock_memory_str)
+        lock_memory_str = "false";
 
-    VideoQuality quality;
-    if(strcmp(quality_str, "medium") == 0) {
-        quality = VideoQuality::MEDIUM;
-    } else if(strcmp(quality_str, "high") == 0) {
-        quality = VideoQuality::HIGH;
-    } else if(strcmp(quality_str, "very_high") == 0) {
-        quality = VideoQuality::VERY_HIGH;
-    } else if(strcmp(quality_str, "ultra") == 0) {
-        quality = VideoQuality::ULTRA;
-    } else {
-        fprintf(stderr, "Error: -q should either be either 'medium', 'high', 'very_high' or 'ultra', got: '%s'\n", quality_str);
+    bool lock_memory = false;
+    if(strcmp(lock_memory_str, "true") == 0) {
+        lock_memory = true;
+    } else if(strcmp(lock_memory_str, "false") != 0) {
+        fprintf(stderr, "Error: -ml should either be either 'true' or 'false', got: '%s'\n", lock_memory_str);
         usage();
     }
 
-    int replay_buffer_size_secs = -1;
-    const char *replay_buffer_size_secs_str = args["-r"].value();
-    if(replay_buffer_size_secs_str) {
-        replay_buffer_size_secs = atoi(replay_buffer_size_secs_str);
-        if(replay_buffer_size_secs < 5 || replay_buffer_size_secs > 1200) {
-            fprintf(stderr, "Error: option -r has to be between 5 and 1200, was: %s\n", replay_buffer_size_secs_str);
-            return 1;
+    const bool segmented_output = segment_time_str || segment_size_str;
+    if(segmented_output) {
+        if(replay_buffer_size_secs != -1) {
+            fprintf(stderr, "Error: options -st and -ss are not available when using -r\n");
+            usage();
+        }
+
+        if(!args["-o"].value() || strstr(args["-o"].value(), "://")) {
+            fprintf(stderr, "Error: options -st and -ss require an output file (-o)\n");
+            usage();
         }
-        replay_buffer_size_secs += 5; // Add a few seconds to account of lost packets because of non-keyframe packets skipped
     }
 
     Display *dpy = XOpenDisplay(nullptr);
@@ -1335,6 +3278,11 @@ int main(int argc, char **argv) {
     const char *filename = args["-o"].value();
     if(filename) {
         if(replay_buffer_size_secs != -1) {
+            if(args["-o"].values.size() > 1) {
+                fprintf(stderr, "Error: option -o can only be specified once when using option -r\n");
+                usage();
+            }
+
             if(!container_format) {
                 fprintf(stderr, "Error: option -c is required when using option -r\n");
                 usage();
@@ -1372,11 +3320,57 @@ int main(int argc, char **argv) {
     av_format_context->flags |= AVFMT_FLAG_GENPTS;
     const AVOutputFormat *output_format = av_format_context->oformat;
 
-    std::string file_extension = output_format->extensions;
-    {
-        size_t comma_index = file_extension.find(',');
-        if(comma_index != std::string::npos)
-            file_extension = file_extension.substr(0, comma_index);
+    std::string file_extension = output_format_get_file_extension(output_format);
+
+    // Outputs after the first -o. They get the same streams as the first output
+    std::vector<std::string> additional_output_filepaths;
+    std::vector<AVFormatContext*> additional_output_format_contexts;
+    for(size_t i = 1; i < args["-o"].values.size(); ++i) {
+        std::string additional_container_format;
+        std::string additional_filepath = parse_output_container_format(args["-o"].values[i], additional_container_format);
+        // Livestreaming services that use rtmp expect flv
+        if(additional_container_format.empty() && (strncmp(additional_filepath.c_str(), "rtmp://", 7) == 0 || strncmp(additional_filepath.c_str(), "rtmps://", 8) == 0))
+            additional_container_format = "flv";
+
+        AVFormatContext *additional_format_context = nullptr;
+        avformat_alloc_output_context2(&additional_format_context, nullptr, additional_container_format.empty() ? nullptr : additional_container_format.c_str(), additional_filepath.c_str());
+        if(!additional_format_context) {
+            fprintf(stderr, "Error: Failed to deduce container format for output '%s', add the container format before the output like this: [mp4]%s\n", additional_filepath.c_str(), additional_filepath.c_str());
+            return 1;
+        }
+        additional_format_context->flags = av_format_context->flags;
+
+        additional_output_filepaths.push_back(std::move(additional_filepath));
+        additional_output_format_contexts.push_back(additional_format_context);
+    }
+
+    // The codecs have to be supported by every output
+    bool all_outputs_support_opus_flac = file_extension == "mp4" || file_extension == "mkv";
+    bool any_output_is_flv = file_extension == "flv";
+    // Hls segments have to be decodable on their own, which the livestream encoder settings make sure of
+    bool any_output_is_hls = is_hls_output(av_format_context);
+    bool any_output_is_livestream = is_livestream_path(filename) || any_output_is_hls;
+    for(size_t i = 0; i < additional_output_format_contexts.size(); ++i) {
+        const std::string additional_file_extension = output_format_get_file_extension(additional_output_format_contexts[i]->oformat);
+        if(additional_file_extension != "mp4" && additional_file_extension != "mkv")
+            all_outputs_support_opus_flac = false;
+        if(additional_file_extension == "flv")
+            any_output_is_flv = true;
+        if(is_hls_output(additional_output_format_contexts[i]))
+            any_output_is_hls = true;
+        if(is_livestream_path(additional_output_filepaths[i].c_str()) || is_hls_output(additional_output_format_contexts[i]))
+            any_output_is_livestream = true;
+    }
+
+    const bool is_mov_output = strcmp(output_format->name, "mp4") == 0 || strcmp(output_format->name, "mov") == 0;
+    if((fragment_duration_secs > 0.0 || faststart) && !is_mov_output) {
+        fprintf(stderr, "Error: options -fd and -fs are only available for mp4 and mov files, the container format is %s\n", output_format->name);
+        usage();
+    }
+
+    if(segmented_output && (output_format->flags & AVFMT_NOFILE)) {
+        fprintf(stderr, "Error: options -st and -ss are not available for the container format %s\n", output_format->name);
+        usage();
     }
 
     switch(audio_codec) {
@@ -1384,7 +3378,7 @@ int main(int argc, char **argv) {
             break;
         }
         case AudioCodec::OPUS: {
-            if(file_extension != "mp4" && file_extension != "mkv") {
+            if(!all_outputs_support_opus_flac) {
                 audio_codec_to_use = "aac";
                 audio_codec = AudioCodec::AAC;
                 fprintf(stderr, "Warning: opus audio codec is only supported by .mp4 and .mkv files, falling back to aac instead\n");
@@ -1392,7 +3386,7 @@ int main(int argc, char **argv) {
             break;
         }
         case AudioCodec::FLAC: {
-            if(file_extension != "mp4" && file_extension != "mkv") {
+            if(!all_outputs_support_opus_flac) {
                 audio_codec_to_use = "aac";
                 audio_codec = AudioCodec::AAC;
                 fprintf(stderr, "Warning: flac audio codec is only supported by .mp4 and .mkv files, falling back to aac instead\n");
@@ -1425,7 +3419,7 @@ int main(int argc, char **argv) {
     }
 
     //bool use_hevc = strcmp(window_str, "screen") == 0 || strcmp(window_str, "screen-direct") == 0;
-    if(video_codec != VideoCodec::H264 && strcmp(file_extension.c_str(), "flv") == 0) {
+    if(video_codec != VideoCodec::H264 && any_output_is_flv) {
         video_codec_to_use = "h264";
         video_codec = VideoCodec::H264;
         fprintf(stderr, "Warning: h265 is not compatible with flv, falling back to h264 instead.\n");
@@ -1446,7 +3440,12 @@ int main(int argc, char **argv) {
         exit(2);
     }
 
-    const bool is_livestream = is_livestream_path(filename);
+    const bool is_livestream = any_output_is_livestream;
+    if(livestream_max_bitrate > 0 && !is_livestream) {
+        fprintf(stderr, "Error: option -vb can only be used when livestreaming\n");
+        usage();
+    }
+
     // (Some?) livestreaming services require at least one audio track to work.
     // If not audio is provided then create one silent audio track.
     if(is_livestream && requested_audio_inputs.empty()) {
@@ -1468,10 +3467,22 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    if(any_output_is_hls && replay_buffer_size_secs == -1)
+        video_codec_context->gop_size = std::max(1, std::min(video_codec_context->gop_size, (int)std::round(fps * hls_params.segment_duration_secs)));
+
+    if(livestream_max_bitrate > 0) {
+        video_codec_context->bit_rate = livestream_max_bitrate;
+        video_codec_context->rc_max_rate = livestream_max_bitrate;
+        video_codec_context->rc_buffer_size = livestream_max_bitrate;
+    }
+
     open_video(video_codec_context, quality, very_old_gpu);
     if(video_stream)
         avcodec_parameters_from_context(video_stream->codecpar, video_codec_context);
 
+    SoundContext sound_context;
+    sound_context.handle = nullptr;
+
     int audio_stream_index = VIDEO_STREAM_INDEX + 1;
     for(const MergedAudioInputs &merged_audio_inputs : requested_audio_inputs) {
         AVCodecContext *audio_codec_context = create_audio_codec_context(fps, audio_codec);
@@ -1521,7 +3532,12 @@ int main(int argc, char **argv) {
                 audio_device.sound_device.handle = NULL;
                 audio_device.sound_device.frames = 0;
             } else {
-                if(sound_device_get_by_name(&audio_device.sound_device, audio_input.name.c_str(), audio_input.description.c_str(), num_channels, audio_codec_context->frame_size, audio_codec_context_get_audio_format(audio_codec_context)) != 0) {
+                if(!sound_context.handle && sound_context_create(&sound_context, &audio_thread_config) != 0) {
+                    fprintf(stderr, "Error: failed to connect to pulseaudio\n");
+                    exit(1);
+                }
+
+                if(sound_device_get_by_name(&sound_context, &audio_device.sound_device, audio_input.name.c_str(), audio_input.description.c_str(), num_channels, audio_codec_context->frame_size, audio_codec_context_get_audio_format(audio_codec_context)) != 0) {
                     fprintf(stderr, "Error: failed to get \"%s\" sound device\n", audio_input.name.c_str());
                     exit(1);
                 }
@@ -1545,31 +3561,101 @@ int main(int argc, char **argv) {
 
     //av_dump_format(av_format_context, 0, filename, 1);
 
-    if (replay_buffer_size_secs == -1 && !(output_format->flags & AVFMT_NOFILE)) {
-        int ret = avio_open(&av_format_context->pb, filename, AVIO_FLAG_WRITE);
-        if (ret < 0) {
-            fprintf(stderr, "Error: Could not open '%s': %s\n", filename, av_error_to_string(ret));
-            return 1;
-        }
+    AVDictionary *header_options = nullptr;
+    av_dict_set(&header_options, "strict", "experimental", 0);
+    if(fragment_duration_secs > 0.0) {
+        // The muxer starts a new fragment at the first video keyframe after the minimum duration. The sample tables are written and freed with each fragment
+        av_dict_set(&header_options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+        av_dict_set_int(&header_options, "min_frag_duration", (int64_t)(fragment_duration_secs * 1000000.0), 0);
+    } else if(faststart) {
+        // The muxer moves the moov atom to the beginning of the file in av_write_trailer by reading the file back and shifting the data
+        av_dict_set(&header_options, "movflags", "+faststart", 0);
     }
 
-    if(replay_buffer_size_secs == -1) {
-        AVDictionary *options = nullptr;
-        av_dict_set(&options, "strict", "experimental", 0);
+    if(is_hls_output(av_format_context))
+        hls_add_header_options(&header_options, hls_params);
 
-        int ret = avformat_write_header(av_format_context, &options);
-        if (ret < 0) {
-            fprintf(stderr, "Error occurred when writing header to output file: %s\n", av_error_to_string(ret));
+    // The first output is |av_format_context|. The header options, file splitting and the replay buffer only apply to the first output
+    std::deque<OutputWriter> output_writers;
+    OutputSegmenter output_segmenter;
+    if(replay_buffer_size_secs == -1) {
+        output_writers.emplace_back();
+        OutputWriter &output_writer = output_writers.back();
+        output_writer.filepath = filename;
+        output_writer.format_context = av_format_context;
+
+        // In segmented mode |av_format_context| only describes the streams, the files are created by the output writer thread
+        if(segmented_output) {
+            output_segmenter.header_options = header_options;
+            header_options = nullptr;
+            output_segmenter.file_writer_params = file_writer_params;
+            output_segmenter.segment_time_secs = segment_time_secs;
+            output_segmenter.segment_size = segment_size;
+            if(!output_segmenter_init(&output_segmenter, av_format_context, video_stream->index, filename, file_extension))
+                return 1;
+            output_writer.segmenter = &output_segmenter;
+        } else if(!output_writer_open(&output_writer, file_writer_params, network_backlog_size, &header_options)) {
             return 1;
         }
+    }
+    av_dict_free(&header_options);
+
+    for(size_t i = 0; i < additional_output_format_contexts.size(); ++i) {
+        AVFormatContext *additional_format_context = additional_output_format_contexts[i];
+        for(unsigned int stream_index = 0; stream_index < av_format_context->nb_streams; ++stream_index) {
+            const AVStream *first_output_stream = av_format_context->streams[stream_index];
+            AVStream *stream = avformat_new_stream(additional_format_context, nullptr);
+            if(!stream) {
+                fprintf(stderr, "Error: Could not allocate stream\n");
+                exit(1);
+            }
+            stream->id = first_output_stream->id;
+            stream->time_base = first_output_stream->time_base;
+            stream->avg_frame_rate = first_output_stream->avg_frame_rate;
+            avcodec_parameters_copy(stream->codecpar, first_output_stream->codecpar);
+        }
+
+        output_writers.emplace_back();
+        OutputWriter &output_writer = output_writers.back();
+        output_writer.filepath = additional_output_filepaths[i];
+        output_writer.format_context = additional_format_context;
 
+        AVDictionary *options = nullptr;
+        av_dict_set(&options, "strict", "experimental", 0);
+        if(is_hls_output(additional_format_context))
+            hls_add_header_options(&options, hls_params);
+        const bool opened = output_writer_open(&output_writer, file_writer_params, network_backlog_size, &options);
         av_dict_free(&options);
+        // Only the first output is required, the recording continues without the additional outputs that can't be opened
+        if(!opened) {
+            fprintf(stderr, "Error: failed to open output '%s'. Recording continues without this output\n", output_writer.filepath.c_str());
+            output_writer.failed = true;
+        }
     }
 
     const double start_time_pts = clock_get_monotonic_seconds();
 
+    gsr_bitrate_controller *bitrate_controller = nullptr;
+    if(livestream_max_bitrate > 0) {
+        gsr_bitrate_controller_params bitrate_controller_params;
+        bitrate_controller_params.max_bitrate = livestream_max_bitrate;
+        bitrate_controller_params.min_bitrate = std::max((int64_t)100000, livestream_max_bitrate / 8);
+        // The frame rate is never lowered below 15 fps
+        bitrate_controller_params.max_frame_rate_divisor = std::max(1, std::min(4, fps / 15));
+        bitrate_controller = gsr_bitrate_controller_create(&bitrate_controller_params, start_time_pts);
+        if(!bitrate_controller)
+            return 1;
+    }
+    int video_frame_rate_divisor = 1;
+    bool output_aborted = false;
+
+    // In variable frame rate mode frames that haven't changed are not encoded and the timestamps are left as a gap
+    double last_encoded_frame_time = -1.0;
+    int64_t last_forced_keyframe_pts = 0;
+    int64_t num_encoded_frames = 0;
+    int64_t num_unchanged_frames_skipped = 0;
+
     double start_time = clock_get_monotonic_seconds();
-    double frame_timer_start = start_time;
     int fps_counter = 0;
 
     AVFrame *frame = av_frame_alloc();
@@ -1585,145 +3671,109 @@ int main(int argc, char **argv) {
     std::mutex write_output_mutex;
     std::mutex audio_filter_mutex;
 
-    const double record_start_time = clock_get_monotonic_seconds();
-    std::deque<AVPacket> frame_data_queue;
-    bool frames_erased = false;
-
-    const size_t audio_buffer_size = 1024 * 4 * 2; // max 4 bytes/sample, 2 channels
-    uint8_t *empty_audio = (uint8_t*)malloc(audio_buffer_size);
-    if(!empty_audio) {
-        fprintf(stderr, "Error: failed to create empty audio\n");
-        exit(1);
+    ReplayFragmentMuxer replay_fragment_muxer_storage;
+    ReplayFragmentMuxer *replay_fragment_muxer = nullptr;
+    if(replay_fragments) {
+        if(!replay_fragment_muxer_init(&replay_fragment_muxer_storage, video_codec_context, VIDEO_STREAM_INDEX, audio_tracks))
+            return 1;
+        replay_fragment_muxer = &replay_fragment_muxer_storage;
     }
-    memset(empty_audio, 0, audio_buffer_size);
 
-    for(AudioTrack &audio_track : audio_tracks) {
-        for(AudioDevice &audio_device : audio_track.audio_devices) {
-            audio_device.thread = std::thread([record_start_time, replay_buffer_size_secs, &frame_data_queue, &frames_erased, &audio_track, empty_audio, &audio_device, &audio_filter_mutex, &write_output_mutex](AVFormatContext *av_format_context) mutable {
-                const AVSampleFormat sound_device_sample_format = audio_format_to_sample_format(audio_codec_context_get_audio_format(audio_track.codec_context));
-                const bool needs_audio_conversion = audio_track.codec_context->sample_fmt != sound_device_sample_format;
-                SwrContext *swr = nullptr;
-                if(needs_audio_conversion) {
-                    swr = swr_alloc();
-                    if(!swr) {
-                        fprintf(stderr, "Failed to create SwrContext\n");
-                        exit(1);
-                    }
-                    av_opt_set_int(swr, "in_channel_layout", AV_CH_LAYOUT_STEREO, 0);
-                    av_opt_set_int(swr, "out_channel_layout", AV_CH_LAYOUT_STEREO, 0);
-                    av_opt_set_int(swr, "in_sample_rate", audio_track.codec_context->sample_rate, 0);
-                    av_opt_set_int(swr, "out_sample_rate", audio_track.codec_context->sample_rate, 0);
-                    av_opt_set_sample_fmt(swr, "in_sample_fmt", sound_device_sample_format, 0);
-                    av_opt_set_sample_fmt(swr, "out_sample_fmt", audio_track.codec_context->sample_fmt, 0);
-                    swr_init(swr);
-                }
+    // Vaapi frames are mapped directly to the texture the window is copied to, so there is only one frame to capture to
+    const bool pooled_video_frames = video_codec_context->pix_fmt == AV_PIX_FMT_CUDA;
+    if(pipeline_depth_str && !pooled_video_frames)
+        fprintf(stderr, "Warning: option -pd is only supported on NVIDIA, one frame will be encoded at a time\n");
 
-                const double target_audio_hz = 1.0 / (double)audio_track.codec_context->sample_rate;
-                double received_audio_time = clock_get_monotonic_seconds();
-                const int64_t timeout_ms = std::round((1000.0 / (double)audio_track.codec_context->sample_rate) * 1000.0);
-
-                while(running) {
-                    void *sound_buffer;
-                    int sound_buffer_size = -1;
-                    if(audio_device.sound_device.handle)
-                        sound_buffer_size = sound_device_read_next_chunk(&audio_device.sound_device, &sound_buffer);
-                    const bool got_audio_data = sound_buffer_size >= 0;
-
-                    const double this_audio_frame_time = clock_get_monotonic_seconds();
-                    if(got_audio_data)
-                        received_audio_time = this_audio_frame_time;
-
-                    int ret = av_frame_make_writable(audio_track.frame);
-                    if (ret < 0) {
-                        fprintf(stderr, "Failed to make audio frame writable\n");
-                        break;
-                    }
+    // Initialized before any thread is started, so failing can return without stopping the threads
+    VideoEncodePipeline video_encode_pipeline;
+    if(!video_encode_pipeline_init(&video_encode_pipeline, video_codec_context, pooled_video_frames, pipeline_depth))
+        return 1;
 
-                    int64_t num_missing_frames = std::round((this_audio_frame_time - received_audio_time) / target_audio_hz / (int64_t)audio_track.frame->nb_samples);
-                    if(got_audio_data)
-                        num_missing_frames = std::max((int64_t)0, num_missing_frames - 1);
-
-                    if(!audio_device.sound_device.handle)
-                        num_missing_frames = std::max((int64_t)1, num_missing_frames);
-
-                    // Jesus is there a better way to do this? I JUST WANT TO KEEP VIDEO AND AUDIO SYNCED HOLY FUCK I WANT TO KILL MYSELF NOW.
-                    // THIS PIECE OF SHIT WANTS EMPTY FRAMES OTHERWISE VIDEO PLAYS TOO FAST TO KEEP UP WITH AUDIO OR THE AUDIO PLAYS TOO EARLY.
-                    // BUT WE CANT USE DELAYS TO GIVE DUMMY DATA BECAUSE PULSEAUDIO MIGHT GIVE AUDIO A BIG DELAYED!!!
-                    if(num_missing_frames >= 5 || !audio_device.sound_device.handle) {
-                        // TODO:
-                        //audio_track.frame->data[0] = empty_audio;
-                        received_audio_time = this_audio_frame_time;
-                        if(needs_audio_conversion)
-                            swr_convert(swr, &audio_track.frame->data[0], audio_track.frame->nb_samples, (const uint8_t**)&empty_audio, audio_track.codec_context->frame_size);
-                        else
-                            audio_track.frame->data[0] = empty_audio;
-
-                        // TODO: Check if duplicate frame can be saved just by writing it with a different pts instead of sending it again
-                        std::lock_guard<std::mutex> lock(audio_filter_mutex);
-                        for(int i = 0; i < num_missing_frames; ++i) {
-                            if(audio_track.graph) {
-                                // TODO: av_buffersrc_add_frame
-                                if(av_buffersrc_write_frame(audio_device.src_filter_ctx, audio_track.frame) < 0) {
-                                    fprintf(stderr, "Error: failed to add audio frame to filter\n");
-                                }
-                            } else {
-                                audio_track.frame->pts = audio_track.pts;
-                                audio_track.pts += audio_track.frame->nb_samples;
-                                ret = avcodec_send_frame(audio_track.codec_context, audio_track.frame);
-                                if(ret >= 0){
-                                    receive_frames(audio_track.codec_context, audio_track.stream_index, audio_track.stream, audio_track.frame, av_format_context, record_start_time, frame_data_queue, replay_buffer_size_secs, frames_erased, write_output_mutex);
-                                } else {
-                                    fprintf(stderr, "Failed to encode audio!\n");
-                                }
-                            }
-                        }
-                    }
+    for(OutputWriter &output_writer : output_writers) {
+        output_writer.queue = gsr_packet_queue_create(OUTPUT_QUEUE_SIZE);
+        if(!output_writer.queue)
+            return 1;
+        output_writer.policy = output_queue_policy;
+        output_writer.pipe_policy = pipe_policy;
+        output_writer.video_stream_index = VIDEO_STREAM_INDEX;
+        for(unsigned int i = 0; i < output_writer.format_context->nb_streams; ++i) {
+            output_writer.stream_time_bases.push_back(output_writer.format_context->streams[i]->time_base);
+        }
+    }
 
-                    if(!audio_device.sound_device.handle)
-                        usleep(timeout_ms * 1000);
-
-                    if(got_audio_data) {
-                        // TODO: Instead of converting audio, get float audio from alsa. Or does alsa do conversion internally to get this format?
-                        if(needs_audio_conversion)
-                            swr_convert(swr, &audio_track.frame->data[0], audio_track.frame->nb_samples, (const uint8_t**)&sound_buffer, audio_track.codec_context->frame_size);
-                        else
-                            audio_track.frame->data[0] = (uint8_t*)sound_buffer;
-
-                        if(audio_track.graph) {
-                            std::lock_guard<std::mutex> lock(audio_filter_mutex);
-                            // TODO: av_buffersrc_add_frame
-                            if(av_buffersrc_write_frame(audio_device.src_filter_ctx, audio_track.frame) < 0) {
-                                fprintf(stderr, "Error: failed to add audio frame to filter\n");
-                            }
-                        } else {
-                            audio_track.frame->pts = audio_track.pts;
-                            audio_track.pts += audio_track.frame->nb_samples;
-                            ret = avcodec_send_frame(audio_track.codec_context, audio_track.frame);
-                            if(ret >= 0){
-                                receive_frames(audio_track.codec_context, audio_track.stream_index, audio_track.stream, audio_track.frame, av_format_context, record_start_time, frame_data_queue, replay_buffer_size_secs, frames_erased, write_output_mutex);
-                            } else {
-                                fprintf(stderr, "Failed to encode audio!\n");
-                            }
-                        }
-                    }
-                }
+    // Everything that is used while recording has been allocated at this point, except for the replay buffer.
+    // The replay buffer is created after locking so that it's only locked when it's preallocated (it's not locked at all when it's stored on disk)
+    if(lock_memory)
+        gsr_lock_memory();
+
+    gsr_replay_buffer *replay_buffer = nullptr;
+    if(replay_buffer_size_secs != -1) {
+        gsr_replay_buffer_params replay_buffer_params;
+        replay_buffer_params.max_size_bytes = replay_buffer_max_size;
+        replay_buffer_params.preallocate = replay_buffer_preallocate;
+        replay_buffer_params.lock_memory = lock_memory;
+        replay_buffer_params.spool_dir = replay_buffer_dir;
+        replay_buffer_params.duration_secs = replay_buffer_size_secs;
+        replay_buffer_params.video_stream_index = VIDEO_STREAM_INDEX;
+        replay_buffer = gsr_replay_buffer_create(&replay_buffer_params);
+        if(!replay_buffer)
+            return 1;
+    }
 
-                if(swr)
-                    swr_free(&swr);
-            }, av_format_context);
-        }
+    for(OutputWriter &output_writer : output_writers) {
+        output_writer.thread = std::thread(output_writer_run, &output_writer);
     }
 
-    // Set update_fps to 24 to test if duplicate/delayed frames cause video/audio desync or too fast/slow video.
-    const double update_fps = fps + 190;
+    std::thread audio_thread;
+    if(!audio_tracks.empty())
+        audio_thread = std::thread(audio_thread_run, std::ref(audio_tracks), &sound_context, &audio_thread_config, std::ref(audio_filter_mutex), std::ref(output_writers), replay_buffer, replay_fragment_muxer, std::ref(write_output_mutex));
+
     int64_t video_pts_counter = 0;
     bool should_stop_error = false;
 
+    // The loop sleeps until the next frame is due, or until the next audio frame is due if audio has to be taken from the audio filters.
+    // Frames are due on the same grid as the video timestamps, so a frame that is captured on time gets exactly the next timestamp
+    double audio_drain_interval = 0.0;
+    for(const AudioTrack &audio_track : audio_tracks) {
+        if(!audio_track.sink)
+            continue;
+        const double audio_frame_duration = (double)audio_track.codec_context->frame_size / (double)audio_track.codec_context->sample_rate;
+        if(audio_drain_interval == 0.0 || audio_frame_duration < audio_drain_interval)
+            audio_drain_interval = audio_frame_duration;
+    }
+    double next_frame_time = start_time_pts + target_fps;
+    double next_audio_drain_time = start_time_pts;
+
+    // Wakeup jitter is how late the loop wakes up after the next frame was due
+    double frame_wakeup_jitter_sum = 0.0;
+    double frame_wakeup_jitter_max = 0.0;
+    double frame_wakeup_jitter_total_sum = 0.0;
+    double frame_wakeup_jitter_total_max = 0.0;
+    int64_t num_frame_wakeups = 0;
+    int64_t num_frame_wakeups_total = 0;
+    int64_t num_duplicate_frames_skipped = 0;
+
+    gsr_capture_damage_stats prev_damage_stats;
+    memset(&prev_damage_stats, 0, sizeof(prev_damage_stats));
+
+    video_encode_pipeline.thread = std::thread(video_encode_pipeline_run, &video_encode_pipeline, &capture_thread_config, std::ref(output_writers), replay_buffer, replay_fragment_muxer, std::ref(write_output_mutex));
+
+    // The main thread captures the video. It's not renamed because that would also change the process name
+    gsr_thread_config_apply(&capture_thread_config, nullptr);
+    uint64_t prev_num_video_frames_dropped = 0;
+    double capture_secs = 0.0;
+    double max_capture_secs = 0.0;
+    int64_t num_captures = 0;
+
     AVFrame *aframe = av_frame_alloc();
+    bool capture_failed = false;
 
-    while (running) {
-        double frame_start = clock_get_monotonic_seconds();
+    ReplaySaveWorkers replay_save_workers;
+    if(replay_buffer)
+        replay_save_workers_start(&replay_save_workers, REPLAY_SAVE_NUM_WORKERS);
 
+    while (running) {
+        const double wakeup_time = clock_get_monotonic_seconds();
         gsr_capture_tick(capture, video_codec_context, &frame);
         should_stop_error = false;
         if(gsr_capture_should_stop(capture, &should_stop_error)) {
@@ -1744,7 +3794,7 @@ int main(int argc, char **argv) {
                     audio_track.pts += audio_track.codec_context->frame_size;
                     err = avcodec_send_frame(audio_track.codec_context, aframe);
                     if(err >= 0){
-                        receive_frames(audio_track.codec_context, audio_track.stream_index, audio_track.stream, aframe, av_format_context, record_start_time, frame_data_queue, replay_buffer_size_secs, frames_erased, write_output_mutex);
+                        receive_frames(audio_track.codec_context, audio_track.stream_index, aframe, output_writers, replay_buffer, replay_fragment_muxer, write_output_mutex);
                     } else {
                         fprintf(stderr, "Failed to encode audio!\n");
                     }
@@ -1754,90 +3804,259 @@ int main(int argc, char **argv) {
         }
 
         double time_now = clock_get_monotonic_seconds();
-        double frame_timer_elapsed = time_now - frame_timer_start;
         double elapsed = time_now - start_time;
         if (elapsed >= 1.0) {
-            fprintf(stderr, "update fps: %d\n", fps_counter);
+            uint64_t num_video_frames_dropped = 0;
+            {
+                std::lock_guard<std::mutex> lock(video_encode_pipeline.mutex);
+                num_video_frames_dropped = video_encode_pipeline.num_frames_dropped;
+            }
+            // Frames that are waiting to be encoded build up when the encoder can't keep up, after that frames are dropped
+            fprintf(stderr, "update fps: %d, wakeup jitter: avg %.3f ms, max %.3f ms, encode queue: %d/%d, dropped frames: %llu\n", fps_counter,
+                num_frame_wakeups > 0 ? frame_wakeup_jitter_sum / num_frame_wakeups * 1000.0 : 0.0, frame_wakeup_jitter_max * 1000.0,
+                video_encode_pipeline_get_num_frames_in_flight(&video_encode_pipeline), video_encode_pipeline.max_frames,
+                (unsigned long long)(num_video_frames_dropped - prev_num_video_frames_dropped));
+            prev_num_video_frames_dropped = num_video_frames_dropped;
             start_time = time_now;
             fps_counter = 0;
+            frame_wakeup_jitter_sum = 0.0;
+            frame_wakeup_jitter_max = 0.0;
+            num_frame_wakeups = 0;
+
+            gsr_capture_damage_stats damage_stats;
+            if(gsr_capture_get_damage_stats(capture, &damage_stats)) {
+                const uint64_t num_damage_updates = damage_stats.num_damage_updates - prev_damage_stats.num_damage_updates;
+                const uint64_t damaged_area = damage_stats.damaged_area - prev_damage_stats.damaged_area;
+                const double frame_area = (double)video_codec_context->width * (double)video_codec_context->height;
+                fprintf(stderr, "update damage: %llu updates, avg %.1f%% of the frame damaged per update, %llu copies, %llu copies skipped\n",
+                    (unsigned long long)num_damage_updates, num_damage_updates > 0 ? (double)damaged_area / (double)num_damage_updates / frame_area * 100.0 : 0.0,
+                    (unsigned long long)(damage_stats.num_copies - prev_damage_stats.num_copies), (unsigned long long)(damage_stats.num_copies_skipped - prev_damage_stats.num_copies_skipped));
+                prev_damage_stats = damage_stats;
+            }
         }
 
-        double frame_time_overflow = frame_timer_elapsed - target_fps;
-        if (frame_time_overflow >= 0.0) {
-            frame_timer_start = time_now - frame_time_overflow;
-            int was_valid = gsr_capture_capture(capture, frame);
-            if (fail_fast && was_valid == -1) // -1 means not valid
-                return 4; // Some probably recoverable error but since fail_fast is enabled, just crash
-
-            const double this_video_frame_time = clock_get_monotonic_seconds();
-            const int64_t expected_frames = std::round((this_video_frame_time - start_time_pts) / target_fps);
-
-            const int num_frames = std::max(0L, expected_frames - video_pts_counter);
+        if (time_now >= next_frame_time) {
+            const double frame_wakeup_jitter = std::max(0.0, wakeup_time - next_frame_time);
+            frame_wakeup_jitter_sum += frame_wakeup_jitter;
+            frame_wakeup_jitter_max = std::max(frame_wakeup_jitter_max, frame_wakeup_jitter);
+            frame_wakeup_jitter_total_sum += frame_wakeup_jitter;
+            frame_wakeup_jitter_total_max = std::max(frame_wakeup_jitter_total_max, frame_wakeup_jitter);
+            ++num_frame_wakeups;
+            ++num_frame_wakeups_total;
+
+            // Frames that were missed because capturing or encoding took too long are skipped, they become a gap in the timestamps of the next encoded frame
+            next_frame_time += target_fps;
+            if(next_frame_time <= time_now)
+                next_frame_time = start_time_pts + (std::floor((time_now - start_time_pts) / target_fps) + 1.0) * target_fps;
+
+            AVFrame *capture_frame = nullptr;
+            if(!video_encode_pipeline_get_frame(&video_encode_pipeline, frame, &capture_frame)) {
+                running = 0;
+                break;
+            }
+            // The frame is dropped when the encoder is behind. The next frame that is encoded is shown until then
+            if(capture_frame) {
+                const double capture_start = clock_get_monotonic_seconds();
+                int was_valid = gsr_capture_capture(capture, capture_frame);
+                const double capture_time = clock_get_monotonic_seconds() - capture_start;
+                capture_secs += capture_time;
+                max_capture_secs = std::max(max_capture_secs, capture_time);
+                ++num_captures;
+                if (fail_fast && was_valid == -1) { // -1 means not valid
+                    // Some probably recoverable error but since fail_fast is enabled, stop recording. The threads are stopped and the outputs are finished as usual
+                    video_encode_pipeline_cancel_frame(&video_encode_pipeline, capture_frame);
+                    capture_failed = true;
+                    running = 0;
+                    break;
+                }
 
-            frame->flags &= ~AV_FRAME_FLAG_DISCARD;
-            // TODO: Check if duplicate frame can be saved just by writing it with a different pts instead of sending it again
-            for(int i = 0; i < num_frames; ++i) {
-                if(i > 0)
-                    frame->flags |= AV_FRAME_FLAG_DISCARD;
+                const double this_video_frame_time = clock_get_monotonic_seconds();
+                const int64_t expected_frames = std::round((this_video_frame_time - start_time_pts) / target_fps);
+
+                const int64_t num_frames = std::max(0L, expected_frames - video_pts_counter);
+                // The frame rate is lowered by the bitrate controller by only encoding every nth frame
+                const int64_t min_frames = video_frame_rate_divisor;
+                bool encode_frame = num_frames >= min_frames;
+                if(encode_frame && variable_frame_rate && !gsr_capture_is_damaged(capture) && last_encoded_frame_time >= 0.0
+                    && this_video_frame_time - last_encoded_frame_time < max_frame_interval_secs)
+                {
+                    encode_frame = false;
+                    ++num_unchanged_frames_skipped;
+                    video_pts_counter = expected_frames;
+                }
 
-                frame->pts = video_pts_counter + i;
-                int ret = avcodec_send_frame(video_codec_context, frame);
-                if (ret >= 0) {
-                    receive_frames(video_codec_context, VIDEO_STREAM_INDEX, video_stream, frame, av_format_context,
-                                record_start_time, frame_data_queue, replay_buffer_size_secs, frames_erased, write_output_mutex);
+                if(encode_frame) {
+                    // Frames that were missed are not encoded as duplicates. Only the last one is encoded and the timestamps of the
+                    // others are left as a gap, so the previous frame is shown until then. This doesn't add load to an encoder that is already behind
+                    num_duplicate_frames_skipped += num_frames - 1;
+                    video_pts_counter += num_frames - 1;
+                    capture_frame->pts = video_pts_counter;
+                    capture_frame->pict_type = AV_PICTURE_TYPE_NONE;
+                    if(variable_frame_rate) {
+                        gsr_capture_clear_damage(capture);
+                        last_encoded_frame_time = this_video_frame_time;
+                        // The encoder counts keyframe intervals in frames, which can be a long time when frames are skipped
+                        if(capture_frame->pts - last_forced_keyframe_pts >= video_codec_context->gop_size) {
+                            capture_frame->pict_type = AV_PICTURE_TYPE_I;
+                            last_forced_keyframe_pts = capture_frame->pts;
+                        }
+                    }
+                    ++num_encoded_frames;
+                    video_encode_pipeline_submit(&video_encode_pipeline, capture_frame);
+                    ++video_pts_counter;
                 } else {
-                    fprintf(stderr, "Error: avcodec_send_frame failed, error: %s\n", av_error_to_string(ret));
+                    video_encode_pipeline_cancel_frame(&video_encode_pipeline, capture_frame);
                 }
             }
-            video_pts_counter += num_frames;
         }
 
-        if(save_replay_thread.valid() && save_replay_thread.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
-            save_replay_thread.get();
-            puts(save_replay_output_filepath.c_str());
-            save_replay_packets.clear();
+        for(const OutputWriter &output_writer : output_writers) {
+            if(output_writer.abort_recording) {
+                output_aborted = true;
+                running = 0;
+            }
+        }
+
+        if(bitrate_controller) {
+            // Only outputs that can be slower than the encoder (network and pipes) are taken into account
+            gsr_bitrate_controller_input bitrate_controller_input;
+            bitrate_controller_input.backlog_bytes = 0;
+            bitrate_controller_input.write_secs = 0.0;
+            bitrate_controller_input.disconnected = false;
+            for(const OutputWriter &output_writer : output_writers) {
+                if(output_writer.file_writer || output_writer.segmenter)
+                    continue;
+                bitrate_controller_input.backlog_bytes = std::max(bitrate_controller_input.backlog_bytes, output_writer.queued_bytes.load());
+                bitrate_controller_input.write_secs = std::max(bitrate_controller_input.write_secs, (double)output_writer.write_ns.load() * 0.000000001);
+                if(output_writer.disconnected)
+                    bitrate_controller_input.disconnected = true;
+            }
+
+            if(gsr_bitrate_controller_update(bitrate_controller, &bitrate_controller_input, clock_get_monotonic_seconds())) {
+                gsr_bitrate_controller_stats bitrate_controller_stats;
+                gsr_bitrate_controller_get_stats(bitrate_controller, &bitrate_controller_stats);
+                video_encode_pipeline.pending_bitrate = bitrate_controller_stats.bitrate;
+                video_frame_rate_divisor = bitrate_controller_stats.frame_rate_divisor;
+                fprintf(stderr, "Info: bitrate controller: %s, backlog %.2f seconds, write load %.0f%%. Video bitrate is now %lld kbps at %d fps\n",
+                    bitrate_controller_stats.congested ? "outputs are congested" : "outputs are keeping up", bitrate_controller_stats.backlog_secs, bitrate_controller_stats.write_load * 100.0,
+                    (long long)(bitrate_controller_stats.bitrate / 1000), fps / video_frame_rate_divisor);
+            }
+        }
+
+        // Saved replays are reported in the order they were requested, even if a later one finished first
+        while(!replay_saves.empty() && replay_saves.front().thread.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            replay_saves.front().thread.get();
+            puts(replay_saves.front().output_filepath.c_str());
+            fflush(stdout);
+            replay_saves.pop_front();
         }
 
-        if(save_replay == 1 && !save_replay_thread.valid() && replay_buffer_size_secs != -1) {
-            save_replay = 0;
-            save_replay_async(video_codec_context, VIDEO_STREAM_INDEX, audio_tracks, frame_data_queue, frames_erased, filename, container_format, file_extension, write_output_mutex);
+        // Requests are left in the queue until a worker is available
+        int save_replay_duration_secs = 0;
+        while(replay_buffer && replay_saves.size() < REPLAY_SAVE_NUM_WORKERS && pop_save_replay_request(&save_replay_duration_secs)) {
+            save_replay_async(&replay_save_workers, video_codec_context, VIDEO_STREAM_INDEX, audio_tracks, replay_buffer, filename, container_format, file_extension, replay_fragment_muxer, write_output_mutex, save_replay_duration_secs);
         }
 
+        const unsigned int num_dropped_save_replays = save_replay_queue_num_dropped.exchange(0);
+        if(num_dropped_save_replays > 0)
+            fprintf(stderr, "Warning: ignored %u replay save request(s) because %u saves were already queued\n", num_dropped_save_replays, SAVE_REPLAY_QUEUE_SIZE);
+
         // av_frame_free(&frame);
-        double frame_end = clock_get_monotonic_seconds();
-        double frame_sleep_fps = 1.0 / update_fps;
-        double sleep_time = frame_sleep_fps - (frame_end - frame_start);
-        if(sleep_time > 0.0)
-            usleep(sleep_time * 1000.0 * 1000.0);
+        double next_wakeup_time = next_frame_time;
+        if(audio_drain_interval > 0.0) {
+            while(next_audio_drain_time <= time_now)
+                next_audio_drain_time += audio_drain_interval;
+            next_wakeup_time = std::min(next_wakeup_time, next_audio_drain_time);
+        }
+        // Signals (stopping the recording, saving a replay) interrupt the sleep so they are handled right away
+        clock_sleep_until_monotonic_seconds(next_wakeup_time);
+    }
+
+    video_encode_pipeline_stop(&video_encode_pipeline);
+    {
+        const uint64_t num_frames_encoded = std::max((uint64_t)1, video_encode_pipeline.num_frames_encoded);
+        fprintf(stderr, "Info: video pipeline: capture avg %.3f ms, max %.3f ms. Queue avg %.3f ms, max %.3f ms. Encode avg %.3f ms, max %.3f ms."
+            " Up to %d of %d frames in flight, %llu frames were dropped because the encoder was behind\n",
+            num_captures > 0 ? capture_secs / num_captures * 1000.0 : 0.0, max_capture_secs * 1000.0,
+            video_encode_pipeline.queue_secs / num_frames_encoded * 1000.0, video_encode_pipeline.max_queue_secs * 1000.0,
+            video_encode_pipeline.encode_secs / num_frames_encoded * 1000.0, video_encode_pipeline.max_encode_secs * 1000.0,
+            video_encode_pipeline.max_frames_in_flight, video_encode_pipeline.max_frames,
+            (unsigned long long)video_encode_pipeline.num_frames_dropped);
+    }
+    video_encode_pipeline_deinit(&video_encode_pipeline);
+    if(num_frame_wakeups_total > 0) {
+        fprintf(stderr, "Info: frame wakeup jitter: avg %.3f ms, max %.3f ms over %lld frames\n",
+            frame_wakeup_jitter_total_sum / num_frame_wakeups_total * 1000.0, frame_wakeup_jitter_total_max * 1000.0, (long long)num_frame_wakeups_total);
+    }
+    if(num_duplicate_frames_skipped > 0) {
+        fprintf(stderr, "Info: %lld late frames were written as gaps in the timestamps instead of being encoded again\n", (long long)num_duplicate_frames_skipped);
+    }
+    gsr_capture_damage_stats damage_stats;
+    if(gsr_capture_get_damage_stats(capture, &damage_stats)) {
+        fprintf(stderr, "Info: the window was copied %llu times, %llu copies were skipped because nothing had changed\n",
+            (unsigned long long)damage_stats.num_copies, (unsigned long long)damage_stats.num_copies_skipped);
+    }
+    if(variable_frame_rate) {
+        fprintf(stderr, "Info: variable frame rate: %lld frames were encoded and %lld unchanged frames were skipped\n",
+            (long long)num_encoded_frames, (long long)num_unchanged_frames_skipped);
     }
 
 	running = 0;
     av_frame_free(&aframe);
 
-    if(save_replay_thread.valid()) {
-        save_replay_thread.get();
-        puts(save_replay_output_filepath.c_str());
+    for(ReplaySave &replay_save : replay_saves) {
+        replay_save.thread.get();
+        puts(replay_save.output_filepath.c_str());
     }
+    replay_saves.clear();
+    replay_save_workers_stop(&replay_save_workers);
+
+    if(audio_thread.joinable())
+        audio_thread.join();
 
     for(AudioTrack &audio_track : audio_tracks) {
         for(AudioDevice &audio_device : audio_track.audio_devices) {
-            audio_device.thread.join();
             sound_device_close(&audio_device.sound_device);
         }
     }
+    sound_context_destroy(&sound_context);
 
-    if (replay_buffer_size_secs == -1 && av_write_trailer(av_format_context) != 0) {
-        fprintf(stderr, "Failed to write trailer\n");
+    for(OutputWriter &output_writer : output_writers) {
+        output_writer.stopping = true;
+        gsr_packet_queue_close(output_writer.queue);
     }
 
-    if(replay_buffer_size_secs == -1 && !(output_format->flags & AVFMT_NOFILE))
-        avio_close(av_format_context->pb);
+    for(OutputWriter &output_writer : output_writers) {
+        output_writer.thread.join();
+        output_writer_close(&output_writer);
+    }
+
+    if(bitrate_controller) {
+        gsr_bitrate_controller_stats bitrate_controller_stats;
+        gsr_bitrate_controller_get_stats(bitrate_controller, &bitrate_controller_stats);
+        fprintf(stderr, "Info: bitrate controller: lowered the quality %llu times and raised it %llu times, lowest bitrate %lld kbps, lowered frame rate for %.1f seconds\n",
+            (unsigned long long)bitrate_controller_stats.num_decreases, (unsigned long long)bitrate_controller_stats.num_increases,
+            (long long)(bitrate_controller_stats.lowest_bitrate / 1000), bitrate_controller_stats.reduced_frame_rate_secs);
+        gsr_bitrate_controller_destroy(bitrate_controller);
+    }
+
+    if(replay_fragment_muxer) {
+        if(replay_fragment_muxer->num_dropped_fragments > 0)
+            fprintf(stderr, "Warning: %llu replay fragments didn't fit in the replay buffer and were dropped\n", (unsigned long long)replay_fragment_muxer->num_dropped_fragments);
+        replay_fragment_muxer_deinit(replay_fragment_muxer);
+    }
+
+    if(replay_buffer)
+        gsr_replay_buffer_destroy(replay_buffer);
 
     gsr_capture_destroy(capture, video_codec_context);
 
     if(dpy)
         XCloseDisplay(dpy);
 
-    free(empty_audio);
+    if(capture_failed)
+        return 4;
+    if(output_aborted)
+        return 1;
     return should_stop_error ? 3 : 0;
 }
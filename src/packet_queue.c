@@ -0,0 +1,210 @@
+#include "../include/packet_queue.h"
+#include "../include/time.h"
+#include <libavcodec/avcodec.h>
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <time.h>
+
+/* How long |gsr_packet_queue_push| sleeps at most before checking if there is space in the queue again */
+#define PUSH_WAIT_TIMEOUT_NS (5 * 1000 * 1000)
+
+typedef struct {
+    /* Equal to the position of the cell when it's free to be written, position + 1 when it contains a packet */
+    atomic_size_t sequence;
+    AVPacket *packet;
+} gsr_packet_queue_cell;
+
+struct gsr_packet_queue {
+    gsr_packet_queue_cell *cells;
+    size_t capacity;
+    size_t mask;
+
+    /* Kept on separate cache lines since they are written by different threads */
+    alignas(64) atomic_size_t enqueue_pos;
+    alignas(64) atomic_size_t dequeue_pos;
+
+    alignas(64) atomic_size_t max_size;
+    atomic_uint_fast64_t num_push_waits;
+    atomic_uint_fast64_t push_wait_ns;
+    atomic_int num_waiting_pushers;
+    atomic_bool closed;
+
+    sem_t packets_available;
+    sem_t space_available;
+};
+
+static size_t next_power_of_two(size_t value) {
+    size_t result = 1;
+    while(result < value)
+        result <<= 1;
+    return result;
+}
+
+static void update_max_size(gsr_packet_queue *self, size_t size) {
+    size_t max_size = atomic_load_explicit(&self->max_size, memory_order_relaxed);
+    while(size > max_size && !atomic_compare_exchange_weak_explicit(&self->max_size, &max_size, size, memory_order_relaxed, memory_order_relaxed)) {}
+}
+
+static void sem_wait_uninterrupted(sem_t *sem) {
+    while(sem_wait(sem) == -1 && errno == EINTR) {}
+}
+
+/* Returns NULL if the packet at the front of the queue hasn't been pushed (yet) */
+static AVPacket* try_pop(gsr_packet_queue *self) {
+    size_t pos = atomic_load_explicit(&self->dequeue_pos, memory_order_relaxed);
+    gsr_packet_queue_cell *cell = NULL;
+    for(;;) {
+        cell = &self->cells[pos & self->mask];
+        const size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        const intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if(diff == 0) {
+            if(atomic_compare_exchange_weak_explicit(&self->dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if(diff < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&self->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    AVPacket *av_packet = cell->packet;
+    atomic_store_explicit(&cell->sequence, pos + self->mask + 1, memory_order_release);
+    return av_packet;
+}
+
+gsr_packet_queue* gsr_packet_queue_create(size_t capacity) {
+    gsr_packet_queue *self = calloc(1, sizeof(gsr_packet_queue));
+    if(!self) {
+        fprintf(stderr, "gsr error: gsr_packet_queue_create: failed to allocate packet queue\n");
+        return NULL;
+    }
+
+    self->capacity = next_power_of_two(capacity < 2 ? 2 : capacity);
+    self->mask = self->capacity - 1;
+    self->cells = calloc(self->capacity, sizeof(gsr_packet_queue_cell));
+    if(!self->cells) {
+        fprintf(stderr, "gsr error: gsr_packet_queue_create: failed to allocate packet queue\n");
+        free(self);
+        return NULL;
+    }
+
+    for(size_t i = 0; i < self->capacity; ++i) {
+        atomic_init(&self->cells[i].sequence, i);
+    }
+
+    atomic_init(&self->enqueue_pos, 0);
+    atomic_init(&self->dequeue_pos, 0);
+    atomic_init(&self->max_size, 0);
+    atomic_init(&self->num_push_waits, 0);
+    atomic_init(&self->push_wait_ns, 0);
+    atomic_init(&self->num_waiting_pushers, 0);
+    atomic_init(&self->closed, false);
+    sem_init(&self->packets_available, 0, 0);
+    sem_init(&self->space_available, 0, 0);
+    return self;
+}
+
+void gsr_packet_queue_destroy(gsr_packet_queue *self) {
+    AVPacket *av_packet = NULL;
+    while((av_packet = try_pop(self))) {
+        av_packet_free(&av_packet);
+    }
+
+    sem_destroy(&self->packets_available);
+    sem_destroy(&self->space_available);
+    free(self->cells);
+    free(self);
+}
+
+bool gsr_packet_queue_try_push(gsr_packet_queue *self, AVPacket *av_packet) {
+    size_t pos = atomic_load_explicit(&self->enqueue_pos, memory_order_relaxed);
+    gsr_packet_queue_cell *cell = NULL;
+    for(;;) {
+        cell = &self->cells[pos & self->mask];
+        const size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        const intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if(diff == 0) {
+            if(atomic_compare_exchange_weak_explicit(&self->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if(diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&self->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    cell->packet = av_packet;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    const size_t dequeue_pos = atomic_load_explicit(&self->dequeue_pos, memory_order_relaxed);
+    if(dequeue_pos <= pos + 1)
+        update_max_size(self, pos + 1 - dequeue_pos);
+    sem_post(&self->packets_available);
+    return true;
+}
+
+void gsr_packet_queue_push(gsr_packet_queue *self, AVPacket *av_packet) {
+    if(gsr_packet_queue_try_push(self, av_packet))
+        return;
+
+    const double wait_start = clock_get_monotonic_seconds();
+    atomic_fetch_add_explicit(&self->num_waiting_pushers, 1, memory_order_seq_cst);
+    while(!gsr_packet_queue_try_push(self, av_packet)) {
+        /* The timeout is only needed if the popping thread misses that this thread started waiting */
+        struct timespec timeout;
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_nsec += PUSH_WAIT_TIMEOUT_NS;
+        if(timeout.tv_nsec >= 1000000000) {
+            timeout.tv_nsec -= 1000000000;
+            ++timeout.tv_sec;
+        }
+        sem_timedwait(&self->space_available, &timeout);
+    }
+    atomic_fetch_sub_explicit(&self->num_waiting_pushers, 1, memory_order_seq_cst);
+
+    atomic_fetch_add_explicit(&self->num_push_waits, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&self->push_wait_ns, (uint64_t)((clock_get_monotonic_seconds() - wait_start) * 1000000000.0), memory_order_relaxed);
+}
+
+AVPacket* gsr_packet_queue_pop(gsr_packet_queue *self) {
+    sem_wait_uninterrupted(&self->packets_available);
+    for(;;) {
+        AVPacket *av_packet = try_pop(self);
+        if(av_packet) {
+            if(atomic_load_explicit(&self->num_waiting_pushers, memory_order_seq_cst) > 0)
+                sem_post(&self->space_available);
+            return av_packet;
+        }
+
+        if(atomic_load_explicit(&self->closed, memory_order_acquire) && gsr_packet_queue_size(self) == 0) {
+            /* Wake up the next thread waiting for a packet, it has to return NULL as well */
+            sem_post(&self->packets_available);
+            return NULL;
+        }
+
+        /* A packet has been pushed, but the packet in front of it is still being pushed by another thread */
+        sched_yield();
+    }
+}
+
+void gsr_packet_queue_close(gsr_packet_queue *self) {
+    atomic_store_explicit(&self->closed, true, memory_order_release);
+    sem_post(&self->packets_available);
+}
+
+size_t gsr_packet_queue_size(gsr_packet_queue *self) {
+    const size_t dequeue_pos = atomic_load_explicit(&self->dequeue_pos, memory_order_relaxed);
+    const size_t enqueue_pos = atomic_load_explicit(&self->enqueue_pos, memory_order_relaxed);
+    return enqueue_pos - dequeue_pos;
+}
+
+void gsr_packet_queue_get_stats(gsr_packet_queue *self, gsr_packet_queue_stats *stats) {
+    stats->capacity = self->capacity;
+    stats->max_size = atomic_load_explicit(&self->max_size, memory_order_relaxed);
+    stats->num_push_waits = atomic_load_explicit(&self->num_push_waits, memory_order_relaxed);
+    stats->push_wait_secs = (double)atomic_load_explicit(&self->push_wait_ns, memory_order_relaxed) * 0.000000001;
+}
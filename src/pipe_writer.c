@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include "../include/pipe_writer.h"
+#include "../include/time.h"
+#include <libavformat/avformat.h>
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define AVIO_BUFFER_SIZE (64 * 1024)
+/* How long the writing thread waits for the consumer before checking if it should stop */
+#define POLL_TIMEOUT_MS 100
+/* How long |gsr_pipe_writer_destroy| waits for the consumer to read the remaining data */
+#define DESTROY_TIMEOUT_SECS 5.0
+
+struct gsr_pipe_writer {
+    int fd;
+    AVIOContext *avio_context;
+    pthread_t thread;
+    bool thread_started;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t data_available;
+    pthread_cond_t space_available;
+
+    /* Ring buffer, protected by |mutex| */
+    uint8_t *data;
+    size_t capacity;
+    size_t read_pos;
+    size_t size;
+    bool closing;
+    double close_deadline;
+    bool failed;
+
+    gsr_pipe_writer_stats stats;
+};
+
+/* Returns false if the data can't be written anymore. |would_block| is set to true if the consumer is not reading fast enough */
+static bool write_chunk(gsr_pipe_writer *self, const uint8_t *chunk, size_t chunk_size, size_t *written, bool *would_block) {
+    *would_block = false;
+    const ssize_t bytes_written = write(self->fd, chunk, chunk_size);
+    if(bytes_written >= 0) {
+        *written = bytes_written;
+        return true;
+    }
+
+    *written = 0;
+    if(errno == EINTR)
+        return true;
+
+    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+        fprintf(stderr, "gsr error: gsr_pipe_writer: failed to write, error: %s\n", strerror(errno));
+        return false;
+    }
+
+    /* Wait until the consumer has read from the pipe */
+    *would_block = true;
+    struct pollfd poll_fd;
+    poll_fd.fd = self->fd;
+    poll_fd.events = POLLOUT;
+    poll_fd.revents = 0;
+    if(poll(&poll_fd, 1, POLL_TIMEOUT_MS) > 0 && (poll_fd.revents & (POLLERR | POLLHUP))) {
+        fprintf(stderr, "gsr error: gsr_pipe_writer: the consumer closed the pipe\n");
+        return false;
+    }
+    return true;
+}
+
+static void* pipe_writer_thread(void *userdata) {
+    gsr_pipe_writer *self = userdata;
+    pthread_setname_np(pthread_self(), "gsr-pipe");
+    pthread_mutex_lock(&self->mutex);
+    for(;;) {
+        while(self->size == 0 && !self->closing)
+            pthread_cond_wait(&self->data_available, &self->mutex);
+
+        if(self->size == 0 || self->failed)
+            break;
+
+        if(self->closing && clock_get_monotonic_seconds() >= self->close_deadline) {
+            fprintf(stderr, "gsr warning: gsr_pipe_writer: the consumer is not reading, %zu bytes were not written\n", self->size);
+            self->failed = true;
+            break;
+        }
+
+        /* Only the data up to the end of the ring buffer is written at a time, this thread is the only one that removes data */
+        const uint8_t *chunk = self->data + self->read_pos;
+        const size_t chunk_size = FFMIN(self->size, self->capacity - self->read_pos);
+        pthread_mutex_unlock(&self->mutex);
+
+        size_t written = 0;
+        bool would_block = false;
+        const bool success = write_chunk(self, chunk, chunk_size, &written, &would_block);
+
+        pthread_mutex_lock(&self->mutex);
+        ++self->stats.num_write_syscalls;
+        if(would_block)
+            ++self->stats.num_would_block;
+        if(!success) {
+            self->failed = true;
+            break;
+        }
+
+        self->read_pos = (self->read_pos + written) % self->capacity;
+        self->size -= written;
+        self->stats.bytes_written += written;
+        if(written > 0)
+            pthread_cond_broadcast(&self->space_available);
+    }
+
+    /* Wake up the muxer if it's waiting for space */
+    pthread_cond_broadcast(&self->space_available);
+    pthread_mutex_unlock(&self->mutex);
+    return NULL;
+}
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int avio_write_callback(void *opaque, const uint8_t *buf, int buf_size) {
+#else
+static int avio_write_callback(void *opaque, uint8_t *buf, int buf_size) {
+#endif
+    gsr_pipe_writer *self = opaque;
+    const int total_size = buf_size;
+
+    pthread_mutex_lock(&self->mutex);
+    double wait_start = 0.0;
+    while(buf_size > 0 && !self->failed) {
+        if(self->size == self->capacity) {
+            if(wait_start == 0.0)
+                wait_start = clock_get_monotonic_seconds();
+            pthread_cond_wait(&self->space_available, &self->mutex);
+            continue;
+        }
+
+        const size_t write_pos = (self->read_pos + self->size) % self->capacity;
+        const size_t copy_size = FFMIN((size_t)buf_size, FFMIN(self->capacity - self->size, self->capacity - write_pos));
+        memcpy(self->data + write_pos, buf, copy_size);
+        self->size += copy_size;
+        buf += copy_size;
+        buf_size -= copy_size;
+
+        if(self->size > self->stats.max_buffered)
+            self->stats.max_buffered = self->size;
+        pthread_cond_signal(&self->data_available);
+    }
+
+    if(wait_start > 0.0)
+        self->stats.full_wait_secs += clock_get_monotonic_seconds() - wait_start;
+
+    const bool failed = self->failed;
+    pthread_mutex_unlock(&self->mutex);
+    return failed ? AVERROR(EPIPE) : total_size;
+}
+
+gsr_pipe_writer* gsr_pipe_writer_create(const char *filepath, size_t buffer_size) {
+    gsr_pipe_writer *self = calloc(1, sizeof(gsr_pipe_writer));
+    if(!self) {
+        fprintf(stderr, "gsr error: gsr_pipe_writer_create: failed to allocate pipe writer\n");
+        return NULL;
+    }
+
+    /* Opening the file again (instead of using the existing stdout file descriptor) gives a separate file description, so O_NONBLOCK doesn't affect other processes using the same pipe */
+    self->fd = open(filepath, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if(self->fd == -1) {
+        fprintf(stderr, "gsr error: gsr_pipe_writer_create: failed to open %s, error: %s\n", filepath, strerror(errno));
+        free(self);
+        return NULL;
+    }
+
+    self->capacity = buffer_size > AVIO_BUFFER_SIZE ? buffer_size : AVIO_BUFFER_SIZE;
+    self->data = malloc(self->capacity);
+    if(!self->data) {
+        fprintf(stderr, "gsr error: gsr_pipe_writer_create: failed to allocate %zu bytes for write buffer\n", self->capacity);
+        close(self->fd);
+        free(self);
+        return NULL;
+    }
+
+    pthread_mutex_init(&self->mutex, NULL);
+    pthread_cond_init(&self->data_available, NULL);
+    pthread_cond_init(&self->space_available, NULL);
+
+    uint8_t *avio_buffer = av_malloc(AVIO_BUFFER_SIZE);
+    if(avio_buffer)
+        self->avio_context = avio_alloc_context(avio_buffer, AVIO_BUFFER_SIZE, 1, self, NULL, avio_write_callback, NULL);
+    if(!self->avio_context) {
+        fprintf(stderr, "gsr error: gsr_pipe_writer_create: failed to create AVIOContext\n");
+        av_free(avio_buffer);
+        gsr_pipe_writer_destroy(self, NULL);
+        return NULL;
+    }
+
+    if(pthread_create(&self->thread, NULL, pipe_writer_thread, self) != 0) {
+        fprintf(stderr, "gsr error: gsr_pipe_writer_create: failed to create thread\n");
+        gsr_pipe_writer_destroy(self, NULL);
+        return NULL;
+    }
+    self->thread_started = true;
+
+    return self;
+}
+
+bool gsr_pipe_writer_destroy(gsr_pipe_writer *self, gsr_pipe_writer_stats *stats) {
+    if(self->thread_started) {
+        pthread_mutex_lock(&self->mutex);
+        self->closing = true;
+        self->close_deadline = clock_get_monotonic_seconds() + DESTROY_TIMEOUT_SECS;
+        pthread_cond_signal(&self->data_available);
+        pthread_mutex_unlock(&self->mutex);
+        pthread_join(self->thread, NULL);
+    }
+
+    if(self->avio_context) {
+        av_freep(&self->avio_context->buffer);
+        avio_context_free(&self->avio_context);
+    }
+
+    if(close(self->fd) == -1) {
+        fprintf(stderr, "gsr error: gsr_pipe_writer_destroy: failed to close file, error: %s\n", strerror(errno));
+        self->failed = true;
+    }
+
+    pthread_cond_destroy(&self->space_available);
+    pthread_cond_destroy(&self->data_available);
+    pthread_mutex_destroy(&self->mutex);
+    free(self->data);
+
+    if(stats)
+        *stats = self->stats;
+
+    const bool success = !self->failed;
+    free(self);
+    return success;
+}
+
+AVIOContext* gsr_pipe_writer_get_avio_context(gsr_pipe_writer *self) {
+    return self->avio_context;
+}
+
+size_t gsr_pipe_writer_get_free_space(gsr_pipe_writer *self) {
+    /* Data in the AVIOContext buffer is moved to the ring buffer when the AVIOContext buffer is full */
+    const size_t avio_buffered = self->avio_context->buf_ptr - self->avio_context->buffer;
+    pthread_mutex_lock(&self->mutex);
+    const size_t free_space = self->capacity - self->size;
+    pthread_mutex_unlock(&self->mutex);
+    return free_space > avio_buffered ? free_space - avio_buffered : 0;
+}
+
+bool gsr_pipe_writer_has_failed(gsr_pipe_writer *self) {
+    pthread_mutex_lock(&self->mutex);
+    const bool failed = self->failed;
+    pthread_mutex_unlock(&self->mutex);
+    return failed;
+}
+
+void gsr_pipe_writer_get_stats(gsr_pipe_writer *self, gsr_pipe_writer_stats *stats) {
+    pthread_mutex_lock(&self->mutex);
+    *stats = self->stats;
+    pthread_mutex_unlock(&self->mutex);
+}
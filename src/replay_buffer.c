@@ -0,0 +1,584 @@
+#define _GNU_SOURCE
+#include "../include/replay_buffer.h"
+#include <libavcodec/avcodec.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define MIN_SLAB_SIZE (2 * 1024 * 1024)
+#define MAX_SLAB_SIZE (32 * 1024 * 1024)
+#define TARGET_NUM_SLABS 64
+#define MAX_NUM_SLABS 512
+#define MIN_NUM_SLABS 4
+#define RECORD_ALIGNMENT 16
+#define INITIAL_GOP_INDEX_CAPACITY 256
+#define SIZE_LIMIT_WARNING_INTERVAL_SECS 10.0
+
+typedef struct {
+    int64_t pts;
+    int64_t dts;
+    double timestamp;
+    int32_t size;
+    int32_t stream_index;
+    int32_t flags;
+} gsr_replay_packet_header;
+
+/* Position of a video keyframe in the log */
+typedef struct {
+    uint64_t slab_seq;
+    size_t offset;
+    double timestamp;
+} gsr_replay_gop;
+
+typedef struct {
+    uint8_t *data;
+    int fd; /* The segment file the slab is mapped from, or -1 if the slab is in the memory arena */
+    size_t size_used;
+    /* 1 while the slab is a part of the log, +1 for every packet that references data in the slab */
+    atomic_int refcount;
+} gsr_replay_slab;
+
+struct gsr_replay_buffer {
+    gsr_replay_buffer_params params;
+    uint8_t *arena; /* NULL if the slabs are segment files in |params.spool_dir| */
+    size_t arena_size;
+    size_t slab_size;
+
+    gsr_replay_slab *slabs;
+    size_t num_slabs;
+
+    /* Slabs in the order they were filled, oldest first. Indexed by slab sequence number modulo |num_slabs| */
+    size_t *log;
+    uint64_t log_first_seq;
+    size_t log_count;
+    size_t head_offset; /* Offset to the first packet in the oldest slab */
+
+    /* Ring buffer of every video keyframe in the buffer after the first packet, oldest first. The buffer starts at the first one after the oldest gop is removed */
+    gsr_replay_gop *gops;
+    size_t gops_capacity;
+    size_t gops_start;
+    size_t gops_count;
+    bool head_is_keyframe;
+    double newest_timestamp;
+
+    bool packets_erased;
+    bool drop_until_keyframe;
+    bool size_limit_warning_shown;
+    double size_limit_warning_timestamp;
+    uint64_t num_gops_evicted_for_size;
+    uint64_t num_dropped_packets;
+};
+
+static size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static size_t min_size(size_t a, size_t b) {
+    return a < b ? a : b;
+}
+
+static size_t max_size(size_t a, size_t b) {
+    return a > b ? a : b;
+}
+
+static size_t record_size(size_t packet_size) {
+    return align_up(sizeof(gsr_replay_packet_header) + packet_size + AV_INPUT_BUFFER_PADDING_SIZE, RECORD_ALIGNMENT);
+}
+
+static gsr_replay_slab* log_get_slab(gsr_replay_buffer *self, uint64_t seq) {
+    return &self->slabs[self->log[seq % self->num_slabs]];
+}
+
+static bool is_video_keyframe(const gsr_replay_buffer *self, const gsr_replay_packet_header *header) {
+    return header->stream_index == self->params.video_stream_index && (header->flags & AV_PKT_FLAG_KEY);
+}
+
+/* Prefers the slab with the lowest address to keep the memory that is in use compact when the buffer isn't full */
+static gsr_replay_slab* get_free_slab(gsr_replay_buffer *self, size_t *slab_index) {
+    for(size_t i = 0; i < self->num_slabs; ++i) {
+        if(atomic_load_explicit(&self->slabs[i].refcount, memory_order_acquire) == 0) {
+            *slab_index = i;
+            return &self->slabs[i];
+        }
+    }
+    return NULL;
+}
+
+static void slab_unref(gsr_replay_slab *slab) {
+    atomic_fetch_sub_explicit(&slab->refcount, 1, memory_order_release);
+}
+
+static gsr_replay_gop* gop_index_get(gsr_replay_buffer *self, size_t index) {
+    return &self->gops[(self->gops_start + index) % self->gops_capacity];
+}
+
+/* Makes sure there is space for one more gop in the index */
+static bool gop_index_reserve(gsr_replay_buffer *self) {
+    if(self->gops_count < self->gops_capacity)
+        return true;
+
+    const size_t new_capacity = self->gops_capacity == 0 ? INITIAL_GOP_INDEX_CAPACITY : self->gops_capacity * 2;
+    gsr_replay_gop *new_gops = malloc(new_capacity * sizeof(gsr_replay_gop));
+    if(!new_gops) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_append: failed to grow the gop index\n");
+        return false;
+    }
+
+    for(size_t i = 0; i < self->gops_count; ++i) {
+        new_gops[i] = *gop_index_get(self, i);
+    }
+
+    free(self->gops);
+    self->gops = new_gops;
+    self->gops_capacity = new_capacity;
+    self->gops_start = 0;
+    return true;
+}
+
+static bool gop_index_push(gsr_replay_buffer *self, uint64_t slab_seq, size_t offset, double timestamp) {
+    if(!gop_index_reserve(self))
+        return false;
+
+    gsr_replay_gop *gop = &self->gops[(self->gops_start + self->gops_count) % self->gops_capacity];
+    gop->slab_seq = slab_seq;
+    gop->offset = offset;
+    gop->timestamp = timestamp;
+    ++self->gops_count;
+    return true;
+}
+
+/* Removes the oldest gop. Returns false if there is only one gop in the buffer */
+static bool evict_oldest_gop(gsr_replay_buffer *self) {
+    if(self->gops_count == 0)
+        return false;
+
+    const gsr_replay_gop next_gop = *gop_index_get(self, 0);
+    self->gops_start = (self->gops_start + 1) % self->gops_capacity;
+    --self->gops_count;
+
+    while(self->log_first_seq < next_gop.slab_seq) {
+        slab_unref(log_get_slab(self, self->log_first_seq));
+        ++self->log_first_seq;
+        --self->log_count;
+    }
+
+    self->head_offset = next_gop.offset;
+    self->head_is_keyframe = true;
+    self->packets_erased = true;
+    return true;
+}
+
+/* Removes the oldest gop because the buffer is full, even though it's not older than |duration_secs|. A warning is shown every few seconds while this happens */
+static bool evict_oldest_gop_for_size(gsr_replay_buffer *self) {
+    if(!evict_oldest_gop(self))
+        return false;
+
+    ++self->num_gops_evicted_for_size;
+    if(!self->size_limit_warning_shown || self->newest_timestamp - self->size_limit_warning_timestamp >= SIZE_LIMIT_WARNING_INTERVAL_SECS) {
+        self->size_limit_warning_shown = true;
+        self->size_limit_warning_timestamp = self->newest_timestamp;
+        fprintf(stderr, "Warning: the replay buffer size limit (%zu MiB) has been reached, the replay will be shorter than %d seconds (%llu gops removed because of the size limit so far). Increase the limit with the -rm option\n",
+            self->arena_size / 1024 / 1024, (int)self->params.duration_secs, (unsigned long long)self->num_gops_evicted_for_size);
+    }
+    return true;
+}
+
+/* Starts writing the finished segment to disk and removes it from the process memory, it's read back from the page cache (or disk) when a replay is saved */
+static void segment_finish(gsr_replay_slab *slab) {
+    sync_file_range(slab->fd, 0, slab->size_used, SYNC_FILE_RANGE_WRITE);
+    madvise(slab->data, slab->size_used, MADV_DONTNEED);
+}
+
+/* Marks the old data in the segment as zero without freeing the disk space, so writing to the segment again doesn't read the old data from disk */
+static void segment_recycle(gsr_replay_slab *slab, size_t slab_size) {
+    if(fallocate(slab->fd, FALLOC_FL_KEEP_SIZE | FALLOC_FL_ZERO_RANGE, 0, slab_size) == -1 && errno == EOPNOTSUPP)
+        fallocate(slab->fd, FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE, 0, slab_size);
+}
+
+static bool segment_create(gsr_replay_buffer *self, gsr_replay_slab *slab, size_t index) {
+    char filepath[PATH_MAX];
+    snprintf(filepath, sizeof(filepath), "%s/gsr-replay-%d-%zu.seg", self->params.spool_dir, (int)getpid(), index);
+
+    slab->fd = open(filepath, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if(slab->fd == -1) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_create: failed to create replay segment file %s, error: %s\n", filepath, strerror(errno));
+        return false;
+    }
+    /* The file stays alive until it's closed, this makes sure it's removed even if the program crashes */
+    unlink(filepath);
+
+    const int ret = self->params.preallocate ? posix_fallocate(slab->fd, 0, self->slab_size) : (ftruncate(slab->fd, self->slab_size) == -1 ? errno : 0);
+    if(ret != 0) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_create: failed to allocate %zu bytes for replay segment file %s, error: %s\n", self->slab_size, filepath, strerror(ret));
+        return false;
+    }
+
+    void *data = mmap(NULL, self->slab_size, PROT_READ | PROT_WRITE, MAP_SHARED, slab->fd, 0);
+    if(data == MAP_FAILED) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_create: failed to map replay segment file %s, error: %s\n", filepath, strerror(errno));
+        return false;
+    }
+    slab->data = data;
+    return true;
+}
+
+static bool log_push_slab(gsr_replay_buffer *self) {
+    if(self->log_count > 0) {
+        gsr_replay_slab *tail_slab = log_get_slab(self, self->log_first_seq + self->log_count - 1);
+        if(tail_slab->fd != -1)
+            segment_finish(tail_slab);
+    }
+
+    size_t slab_index = 0;
+    gsr_replay_slab *slab = get_free_slab(self, &slab_index);
+    while(!slab && evict_oldest_gop_for_size(self)) {
+        slab = get_free_slab(self, &slab_index);
+    }
+
+    if(!slab)
+        return false;
+
+    if(self->log_count == 0) {
+        self->log_first_seq = 0;
+        self->head_offset = 0;
+    }
+
+    if(slab->fd != -1 && slab->size_used > 0)
+        segment_recycle(slab, self->slab_size);
+
+    slab->size_used = 0;
+    atomic_store_explicit(&slab->refcount, 1, memory_order_relaxed);
+    self->log[(self->log_first_seq + self->log_count) % self->num_slabs] = slab_index;
+    ++self->log_count;
+    return true;
+}
+
+static void drop_packet(gsr_replay_buffer *self, const AVPacket *av_packet) {
+    ++self->num_dropped_packets;
+    if(av_packet->stream_index == self->params.video_stream_index)
+        self->drop_until_keyframe = true;
+}
+
+gsr_replay_buffer* gsr_replay_buffer_create(const gsr_replay_buffer_params *params) {
+    gsr_replay_buffer *self = calloc(1, sizeof(gsr_replay_buffer));
+    if(!self) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_create: failed to allocate replay buffer\n");
+        return NULL;
+    }
+
+    self->params = *params;
+    /* Very large buffers use larger slabs, so that the number of slabs (and segment files) stays small */
+    const size_t slab_size = max_size(min_size(MAX_SLAB_SIZE, params->max_size_bytes / TARGET_NUM_SLABS), params->max_size_bytes / MAX_NUM_SLABS);
+    self->slab_size = align_up(max_size(MIN_SLAB_SIZE, slab_size), RECORD_ALIGNMENT);
+    self->num_slabs = params->max_size_bytes / self->slab_size;
+    if(self->num_slabs < MIN_NUM_SLABS) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_create: the replay buffer size has to be at least %d MiB\n", (MIN_NUM_SLABS * MIN_SLAB_SIZE) / 1024 / 1024);
+        free(self);
+        return NULL;
+    }
+    self->arena_size = self->num_slabs * self->slab_size;
+
+    self->slabs = calloc(self->num_slabs, sizeof(gsr_replay_slab));
+    self->log = calloc(self->num_slabs, sizeof(size_t));
+    if(!self->slabs || !self->log) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_create: failed to allocate replay buffer\n");
+        gsr_replay_buffer_destroy(self);
+        return NULL;
+    }
+
+    for(size_t i = 0; i < self->num_slabs; ++i) {
+        self->slabs[i].data = NULL;
+        self->slabs[i].fd = -1;
+        self->slabs[i].size_used = 0;
+        atomic_init(&self->slabs[i].refcount, 0);
+    }
+
+    if(params->spool_dir) {
+        for(size_t i = 0; i < self->num_slabs; ++i) {
+            if(!segment_create(self, &self->slabs[i], i)) {
+                gsr_replay_buffer_destroy(self);
+                return NULL;
+            }
+        }
+    } else {
+        /* Memory that isn't preallocated is only reserved, so that a large buffer doesn't count against the overcommit limit before it's used */
+        self->arena = mmap(NULL, self->arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | (params->preallocate ? MAP_POPULATE : MAP_NORESERVE), -1, 0);
+        if(self->arena == MAP_FAILED) {
+            fprintf(stderr, "gsr error: gsr_replay_buffer_create: failed to allocate %zu bytes for the replay buffer\n", self->arena_size);
+            self->arena = NULL;
+            gsr_replay_buffer_destroy(self);
+            return NULL;
+        }
+
+        for(size_t i = 0; i < self->num_slabs; ++i) {
+            self->slabs[i].data = self->arena + i * self->slab_size;
+        }
+
+        if(params->lock_memory && params->preallocate && mlock(self->arena, self->arena_size) != 0)
+            fprintf(stderr, "gsr warning: gsr_replay_buffer_create: failed to lock the replay buffer memory, error: %s. Locking memory requires the CAP_IPC_LOCK capability or a memlock limit for the user that is large enough (see limits.conf)\n", strerror(errno));
+    }
+
+    return self;
+}
+
+void gsr_replay_buffer_destroy(gsr_replay_buffer *self) {
+    if(self->arena) {
+        munmap(self->arena, self->arena_size);
+    } else if(self->slabs) {
+        for(size_t i = 0; i < self->num_slabs; ++i) {
+            if(self->slabs[i].data)
+                munmap(self->slabs[i].data, self->slab_size);
+            if(self->slabs[i].fd != -1)
+                close(self->slabs[i].fd);
+        }
+    }
+    free(self->slabs);
+    free(self->log);
+    free(self->gops);
+    free(self);
+}
+
+bool gsr_replay_buffer_append(gsr_replay_buffer *self, const AVPacket *av_packet, double timestamp) {
+    const bool is_video = av_packet->stream_index == self->params.video_stream_index;
+    const size_t size = record_size(av_packet->size);
+    if(size > self->slab_size) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_append: packet of size %d is too large for the replay buffer, dropping it\n", av_packet->size);
+        drop_packet(self, av_packet);
+        return false;
+    }
+
+    if(self->drop_until_keyframe && is_video) {
+        if(!(av_packet->flags & AV_PKT_FLAG_KEY)) {
+            ++self->num_dropped_packets;
+            return false;
+        }
+        self->drop_until_keyframe = false;
+    }
+
+    const bool was_empty = self->log_count == 0;
+    gsr_replay_slab *slab = self->log_count > 0 ? log_get_slab(self, self->log_first_seq + self->log_count - 1) : NULL;
+    if(!slab || slab->size_used + size > self->slab_size) {
+        if(!log_push_slab(self)) {
+            drop_packet(self, av_packet);
+            return false;
+        }
+        slab = log_get_slab(self, self->log_first_seq + self->log_count - 1);
+    }
+
+    const uint64_t seq = self->log_first_seq + self->log_count - 1;
+    const size_t offset = slab->size_used;
+
+    gsr_replay_packet_header *header = (gsr_replay_packet_header*)(slab->data + offset);
+    header->pts = av_packet->pts;
+    header->dts = av_packet->dts;
+    header->timestamp = timestamp;
+    header->size = av_packet->size;
+    header->stream_index = av_packet->stream_index;
+    header->flags = av_packet->flags;
+
+    uint8_t *payload = (uint8_t*)(header + 1);
+    memcpy(payload, av_packet->data, av_packet->size);
+    memset(payload + av_packet->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    slab->size_used += size;
+    self->newest_timestamp = timestamp;
+
+    if(was_empty) {
+        self->head_is_keyframe = is_video_keyframe(self, header);
+    } else if(is_video_keyframe(self, header) && !gop_index_push(self, seq, offset, timestamp)) {
+        /* The packet can't be removed again, but the next gop will be found once there is memory for the index */
+        self->drop_until_keyframe = true;
+    }
+
+    /* Only remove the oldest gop if the buffer still contains |duration_secs| of data after removing it */
+    while(self->gops_count > 0 && timestamp - gop_index_get(self, 0)->timestamp >= self->params.duration_secs) {
+        evict_oldest_gop(self);
+    }
+
+    return true;
+}
+
+static size_t count_free_slabs(const gsr_replay_buffer *self) {
+    size_t num_free_slabs = 0;
+    for(size_t i = 0; i < self->num_slabs; ++i) {
+        if(atomic_load_explicit(&self->slabs[i].refcount, memory_order_acquire) == 0)
+            ++num_free_slabs;
+    }
+    return num_free_slabs;
+}
+
+static void drop_packets(gsr_replay_buffer *self, const AVPacket *av_packets, size_t num_packets) {
+    for(size_t i = 0; i < num_packets; ++i) {
+        drop_packet(self, &av_packets[i]);
+    }
+}
+
+bool gsr_replay_buffer_append_all(gsr_replay_buffer *self, const AVPacket *av_packets, size_t num_packets, double timestamp) {
+    if(num_packets == 0)
+        return true;
+
+    const AVPacket *first_packet = &av_packets[0];
+    if(self->drop_until_keyframe && first_packet->stream_index == self->params.video_stream_index && !(first_packet->flags & AV_PKT_FLAG_KEY)) {
+        self->num_dropped_packets += num_packets;
+        return false;
+    }
+
+    /* Find out how many new slabs the packets need, the same way |gsr_replay_buffer_append| places them */
+    const gsr_replay_slab *tail_slab = self->log_count > 0 ? log_get_slab(self, self->log_first_seq + self->log_count - 1) : NULL;
+    size_t slab_size_used = tail_slab ? tail_slab->size_used : self->slab_size;
+    size_t num_new_slabs = 0;
+    for(size_t i = 0; i < num_packets; ++i) {
+        const size_t size = record_size(av_packets[i].size);
+        if(size > self->slab_size) {
+            fprintf(stderr, "gsr error: gsr_replay_buffer_append_all: packet of size %d is too large for the replay buffer, dropping it\n", av_packets[i].size);
+            drop_packets(self, av_packets, num_packets);
+            return false;
+        }
+
+        if(slab_size_used + size > self->slab_size) {
+            ++num_new_slabs;
+            slab_size_used = 0;
+        }
+        slab_size_used += size;
+    }
+
+    /* Make space for all packets before any of them is added, so that either all of them or none of them are added */
+    size_t num_free_slabs = count_free_slabs(self);
+    while(num_free_slabs < num_new_slabs && evict_oldest_gop_for_size(self)) {
+        num_free_slabs = count_free_slabs(self);
+    }
+
+    const bool is_video_keyframe_first = first_packet->stream_index == self->params.video_stream_index && (first_packet->flags & AV_PKT_FLAG_KEY);
+    if(num_free_slabs < num_new_slabs || (is_video_keyframe_first && self->log_count > 0 && !gop_index_reserve(self))) {
+        drop_packets(self, av_packets, num_packets);
+        return false;
+    }
+
+    for(size_t i = 0; i < num_packets; ++i) {
+        gsr_replay_buffer_append(self, &av_packets[i], timestamp);
+    }
+    return true;
+}
+
+bool gsr_replay_buffer_packets_erased(const gsr_replay_buffer *self) {
+    return self->packets_erased;
+}
+
+uint64_t gsr_replay_buffer_num_dropped_packets(const gsr_replay_buffer *self) {
+    return self->num_dropped_packets;
+}
+
+static void packet_buffer_free(void *opaque, uint8_t *data) {
+    (void)data;
+    slab_unref(opaque);
+}
+
+/* Returns the index of the newest gop that starts at or before |timestamp|, or -1 if there is no such gop */
+static ssize_t gop_index_find(gsr_replay_buffer *self, double timestamp) {
+    size_t low = 0;
+    size_t high = self->gops_count;
+    while(low < high) {
+        const size_t mid = low + (high - low) / 2;
+        if(gop_index_get(self, mid)->timestamp <= timestamp)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return (ssize_t)low - 1;
+}
+
+bool gsr_replay_buffer_snapshot_init(gsr_replay_buffer *self, gsr_replay_buffer_snapshot *snapshot, double duration_secs) {
+    memset(snapshot, 0, sizeof(*snapshot));
+    if(self->log_count == 0 || (!self->head_is_keyframe && self->gops_count == 0))
+        return false;
+
+    uint64_t first_seq = self->log_first_seq;
+    size_t first_offset = self->head_offset;
+    bool packets_erased = self->packets_erased;
+    if(duration_secs > 0.0) {
+        const ssize_t gop_index = gop_index_find(self, self->newest_timestamp - duration_secs);
+        if(gop_index >= 0) {
+            const gsr_replay_gop *gop = gop_index_get(self, gop_index);
+            first_seq = gop->slab_seq;
+            first_offset = gop->offset;
+            packets_erased = true;
+        }
+    }
+
+    const size_t num_slabs = self->log_first_seq + self->log_count - first_seq;
+    snapshot->slab_indices = malloc(num_slabs * sizeof(size_t));
+    snapshot->slab_sizes = malloc(num_slabs * sizeof(size_t));
+    if(!snapshot->slab_indices || !snapshot->slab_sizes) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_snapshot_init: failed to allocate snapshot\n");
+        free(snapshot->slab_indices);
+        free(snapshot->slab_sizes);
+        memset(snapshot, 0, sizeof(*snapshot));
+        return false;
+    }
+
+    for(size_t i = 0; i < num_slabs; ++i) {
+        const size_t slab_index = self->log[(first_seq + i) % self->num_slabs];
+        gsr_replay_slab *slab = &self->slabs[slab_index];
+        atomic_fetch_add_explicit(&slab->refcount, 1, memory_order_relaxed);
+        snapshot->slab_indices[i] = slab_index;
+        snapshot->slab_sizes[i] = slab->size_used;
+    }
+
+    snapshot->replay_buffer = self;
+    snapshot->num_slabs = num_slabs;
+    snapshot->slab_index = 0;
+    snapshot->offset = first_offset;
+    snapshot->packets_erased = packets_erased;
+    return true;
+}
+
+void gsr_replay_buffer_snapshot_deinit(gsr_replay_buffer_snapshot *snapshot) {
+    if(!snapshot->replay_buffer)
+        return;
+
+    for(size_t i = 0; i < snapshot->num_slabs; ++i) {
+        slab_unref(&snapshot->replay_buffer->slabs[snapshot->slab_indices[i]]);
+    }
+
+    free(snapshot->slab_indices);
+    free(snapshot->slab_sizes);
+    memset(snapshot, 0, sizeof(*snapshot));
+}
+
+bool gsr_replay_buffer_snapshot_next_packet(gsr_replay_buffer_snapshot *snapshot, AVPacket *av_packet) {
+    if(!snapshot->replay_buffer)
+        return false;
+
+    while(snapshot->slab_index < snapshot->num_slabs && snapshot->offset >= snapshot->slab_sizes[snapshot->slab_index]) {
+        ++snapshot->slab_index;
+        snapshot->offset = 0;
+    }
+
+    if(snapshot->slab_index == snapshot->num_slabs)
+        return false;
+
+    gsr_replay_slab *slab = &snapshot->replay_buffer->slabs[snapshot->slab_indices[snapshot->slab_index]];
+    const gsr_replay_packet_header *header = (const gsr_replay_packet_header*)(slab->data + snapshot->offset);
+    uint8_t *payload = (uint8_t*)(header + 1);
+    av_packet->buf = av_buffer_create(payload, header->size, packet_buffer_free, slab, AV_BUFFER_FLAG_READONLY);
+    if(!av_packet->buf) {
+        fprintf(stderr, "gsr error: gsr_replay_buffer_snapshot_next_packet: failed to create packet buffer\n");
+        return false;
+    }
+    atomic_fetch_add_explicit(&slab->refcount, 1, memory_order_relaxed);
+
+    av_packet->data = payload;
+    av_packet->size = header->size;
+    av_packet->pts = header->pts;
+    av_packet->dts = header->dts;
+    av_packet->stream_index = header->stream_index;
+    av_packet->flags = header->flags;
+
+    snapshot->offset += record_size(header->size);
+    return true;
+}
@@ -1,6 +1,6 @@
 #include "../include/sound.hpp"
 extern "C" {
-#include "../include/time.h"
+#include <libavutil/buffer.h>
 }
 
 #include <stdlib.h>
@@ -8,125 +8,294 @@ extern "C" {
 #include <string.h>
 #include <cmath>
 #include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 
 #include <pulse/pulseaudio.h>
 #include <pulse/mainloop.h>
+#include <pulse/thread-mainloop.h>
 #include <pulse/xmalloc.h>
 #include <pulse/error.h>
 
-#define CHECK_DEAD_GOTO(p, rerror, label)                               \
-    do {                                                                \
-        if (!(p)->context || !PA_CONTEXT_IS_GOOD(pa_context_get_state((p)->context)) || \
-            !(p)->stream || !PA_STREAM_IS_GOOD(pa_stream_get_state((p)->stream))) { \
-            if (((p)->context && pa_context_get_state((p)->context) == PA_CONTEXT_FAILED) || \
-                ((p)->stream && pa_stream_get_state((p)->stream) == PA_STREAM_FAILED)) { \
-                if (rerror)                                             \
-                    *(rerror) = pa_context_errno((p)->context);         \
-            } else                                                      \
-                if (rerror)                                             \
-                    *(rerror) = PA_ERR_BADSTATE;                        \
-            goto label;                                                 \
-        }                                                               \
-    } while(false);
+// Audio is buffered for this many chunks, in case the thread that reads the audio is late
+#define RING_BUFFER_NUM_CHUNKS 8
 
-struct pa_handle {
-    pa_context *context;
-    pa_stream *stream;
-    pa_mainloop *mainloop;
-
-    const void *read_data;
-    size_t read_index, read_length;
+// All devices share the same connection. The connection is handled by the pulseaudio thread, which copies the audio
+// of each device to a chunk as soon as it's received and then wakes up the thread that reads the audio.
+// The chunks are refcounted buffers from a pool, so they can be given to the encoder without copying them again
+struct pa_sound_context {
+    pa_threaded_mainloop *mainloop = nullptr;
+    pa_context *context = nullptr;
+    gsr_thread_config thread_config;
 
-    uint8_t *output_data;
-    size_t output_index, output_length;
-
-    int operation_success;
+    std::mutex audio_available_mutex;
+    std::condition_variable audio_available_cv;
+    bool audio_available = false;
 };
 
-static void pa_sound_device_free(pa_handle *s) {
-    assert(s);
-
-    if (s->stream)
-        pa_stream_unref(s->stream);
+struct pa_handle {
+    pa_sound_context *sound_context = nullptr;
+    pa_stream *stream = nullptr;
+
+    AVBufferPool *chunk_pool = nullptr;
+    size_t chunk_size = 0;
+    // The chunk the pulseaudio thread is filling
+    AVBufferRef *write_chunk = nullptr;
+    size_t write_chunk_size = 0;
+
+    // Single producer (the pulseaudio thread), single consumer (the thread that reads the device) ring buffer of full chunks.
+    // The positions are the total number of chunks written and read
+    AVBufferRef *ring[RING_BUFFER_NUM_CHUNKS] = {};
+    std::atomic<size_t> ring_write_pos{0};
+    std::atomic<size_t> ring_read_pos{0};
+
+    std::atomic<bool> failed{false};
+    std::atomic<int64_t> latency_usec{-1};
+    std::atomic<uint64_t> num_overflows{0};
+    std::atomic<uint64_t> num_holes{0};
+    std::atomic<uint64_t> num_copies{0};
+};
 
-    if (s->context) {
-        pa_context_disconnect(s->context);
-        pa_context_unref(s->context);
+static void pa_sound_context_notify(pa_sound_context *c) {
+    {
+        std::lock_guard<std::mutex> lock(c->audio_available_mutex);
+        c->audio_available = true;
     }
+    c->audio_available_cv.notify_one();
+}
 
-    if (s->mainloop)
-        pa_mainloop_free(s->mainloop);
-
-    if (s->output_data) {
-        free(s->output_data);
-        s->output_data = NULL;
-    }
+static void pa_sound_context_state_cb(pa_context*, void *userdata) {
+    pa_sound_context *c = (pa_sound_context*)userdata;
+    pa_threaded_mainloop_signal(c->mainloop, 0);
+}
 
-    pa_xfree(s);
+// Runs on the pulseaudio thread. Audio is received on this thread, so it has to keep up just like the thread that reads the audio
+static void pa_sound_context_apply_thread_config(pa_mainloop_api*, void *userdata) {
+    pa_sound_context *c = (pa_sound_context*)userdata;
+    gsr_thread_config_apply(&c->thread_config, nullptr);
 }
 
-static pa_handle* pa_sound_device_new(const char *server,
-        const char *name,
-        const char *dev,
-        const char *stream_name,
-        const pa_sample_spec *ss,
-        const pa_buffer_attr *attr,
-        int *rerror) {
-    pa_handle *p;
-    int error = PA_ERR_INTERNAL, r;
+static void pa_sound_context_free(pa_sound_context *c) {
+    assert(c);
 
-    p = pa_xnew0(pa_handle, 1);
-    p->read_data = NULL;
-    p->read_length = 0;
-    p->read_index = 0;
+    // Stopping the thread first means that no callbacks can run while the context is freed
+    if (c->mainloop)
+        pa_threaded_mainloop_stop(c->mainloop);
 
-    const int buffer_size = attr->maxlength;
-    void *buffer = malloc(buffer_size);
-    if(!buffer) {
-        fprintf(stderr, "failed to allocate buffer for audio\n");
-        *rerror = -1;
-        return NULL;
+    if (c->context) {
+        pa_context_disconnect(c->context);
+        pa_context_unref(c->context);
     }
 
-    p->output_data = (uint8_t*)buffer;
-    p->output_length = buffer_size;
-    p->output_index = 0;
+    if (c->mainloop)
+        pa_threaded_mainloop_free(c->mainloop);
+
+    delete c;
+}
+
+static pa_sound_context* pa_sound_context_new(const char *server, const char *name, const gsr_thread_config *thread_config, int *rerror) {
+    int error = PA_ERR_INTERNAL;
+
+    pa_sound_context *c = new pa_sound_context();
+    c->thread_config = *thread_config;
 
-    if (!(p->mainloop = pa_mainloop_new()))
+    if (!(c->mainloop = pa_threaded_mainloop_new()))
         goto fail;
 
-    if (!(p->context = pa_context_new(pa_mainloop_get_api(p->mainloop), name)))
+    if (!(c->context = pa_context_new(pa_threaded_mainloop_get_api(c->mainloop), name)))
         goto fail;
 
-    if (pa_context_connect(p->context, server, PA_CONTEXT_NOFLAGS, NULL) < 0) {
-        error = pa_context_errno(p->context);
+    pa_context_set_state_callback(c->context, pa_sound_context_state_cb, c);
+
+    if (pa_context_connect(c->context, server, PA_CONTEXT_NOFLAGS, NULL) < 0) {
+        error = pa_context_errno(c->context);
         goto fail;
     }
 
+    pa_threaded_mainloop_set_name(c->mainloop, "gsr-pulse");
+    if (pa_threaded_mainloop_start(c->mainloop) < 0)
+        goto fail;
+
+    pa_threaded_mainloop_lock(c->mainloop);
+    pa_mainloop_api_once(pa_threaded_mainloop_get_api(c->mainloop), pa_sound_context_apply_thread_config, c);
     for (;;) {
-        pa_context_state_t state = pa_context_get_state(p->context);
+        pa_context_state_t state = pa_context_get_state(c->context);
 
         if (state == PA_CONTEXT_READY)
             break;
 
         if (!PA_CONTEXT_IS_GOOD(state)) {
-            error = pa_context_errno(p->context);
+            error = pa_context_errno(c->context);
+            pa_threaded_mainloop_unlock(c->mainloop);
             goto fail;
         }
 
-        pa_mainloop_iterate(p->mainloop, 1, NULL);
+        pa_threaded_mainloop_wait(c->mainloop);
     }
+    pa_threaded_mainloop_unlock(c->mainloop);
+
+    return c;
+
+fail:
+    if (rerror)
+        *rerror = error;
+    pa_sound_context_free(c);
+    return NULL;
+}
+
+static void pa_sound_device_free(pa_handle *s) {
+    assert(s);
+
+    if (s->stream) {
+        pa_threaded_mainloop_lock(s->sound_context->mainloop);
+        pa_stream_set_read_callback(s->stream, NULL, NULL);
+        pa_stream_set_state_callback(s->stream, NULL, NULL);
+        pa_stream_set_overflow_callback(s->stream, NULL, NULL);
+        pa_stream_disconnect(s->stream);
+        pa_stream_unref(s->stream);
+        pa_threaded_mainloop_unlock(s->sound_context->mainloop);
+    }
+
+    // The chunks that are still used by the encoder keep the pool alive until they are unreferenced
+    for (size_t i = s->ring_read_pos; i < s->ring_write_pos; ++i) {
+        av_buffer_unref(&s->ring[i % RING_BUFFER_NUM_CHUNKS]);
+    }
+    av_buffer_unref(&s->write_chunk);
+    av_buffer_pool_uninit(&s->chunk_pool);
+    delete s;
+}
+
+// Called by the pulseaudio thread
+static void pa_stream_state_cb(pa_stream *stream, void *userdata) {
+    pa_handle *p = (pa_handle*)userdata;
+    if (!PA_STREAM_IS_GOOD(pa_stream_get_state(stream))) {
+        p->failed = true;
+        // Wake up the reading thread so it sees that the device failed
+        pa_sound_context_notify(p->sound_context);
+    }
+    pa_threaded_mainloop_signal(p->sound_context->mainloop, 0);
+}
+
+// Called by the pulseaudio thread
+static void pa_stream_overflow_cb(pa_stream*, void *userdata) {
+    pa_handle *p = (pa_handle*)userdata;
+    ++p->num_overflows;
+}
+
+// Called by the pulseaudio thread when |write_chunk| is full. Returns false if the reading thread is too far behind,
+// in which case the audio in the chunk is dropped and the chunk is filled again
+static bool pa_sound_device_push_chunk(pa_handle *p) {
+    const size_t write_pos = p->ring_write_pos.load(std::memory_order_relaxed);
+    const size_t read_pos = p->ring_read_pos.load(std::memory_order_acquire);
+    p->write_chunk_size = 0;
+    if (write_pos - read_pos == RING_BUFFER_NUM_CHUNKS) {
+        ++p->num_overflows;
+        return false;
+    }
+
+    p->ring[write_pos % RING_BUFFER_NUM_CHUNKS] = p->write_chunk;
+    p->write_chunk = NULL;
+    p->ring_write_pos.store(write_pos + 1, std::memory_order_release);
+    return true;
+}
+
+// Called by the pulseaudio thread every time a fragment of audio has been received.
+// This is the only place the audio is copied, from the pulseaudio memory to the chunks
+static void pa_stream_read_cb(pa_stream *stream, size_t, void *userdata) {
+    pa_handle *p = (pa_handle*)userdata;
+    bool pushed_audio = false;
+
+    for (;;) {
+        const void *data = NULL;
+        size_t length = 0;
+        if (pa_stream_peek(stream, &data, &length) < 0) {
+            p->failed = true;
+            break;
+        }
+
+        if (!data && length == 0)
+            break;
+
+        if (!data) {
+            // There is a hole in the stream :( drop it. Maybe we should generate silence instead? TODO
+            ++p->num_holes;
+        }
 
-    if (!(p->stream = pa_stream_new(p->context, stream_name, ss, NULL))) {
-        error = pa_context_errno(p->context);
+        size_t offset = 0;
+        while (data && offset < length) {
+            if (!p->write_chunk) {
+                p->write_chunk = av_buffer_pool_get(p->chunk_pool);
+                p->write_chunk_size = 0;
+                if (!p->write_chunk) {
+                    fprintf(stderr, "failed to allocate buffer for audio\n");
+                    ++p->num_overflows;
+                    break;
+                }
+            }
+
+            const size_t copy_size = std::min(length - offset, p->chunk_size - p->write_chunk_size);
+            memcpy(p->write_chunk->data + p->write_chunk_size, (const uint8_t*)data + offset, copy_size);
+            ++p->num_copies;
+            p->write_chunk_size += copy_size;
+            offset += copy_size;
+
+            if (p->write_chunk_size == p->chunk_size && pa_sound_device_push_chunk(p))
+                pushed_audio = true;
+        }
+
+        if (pa_stream_drop(stream) != 0) {
+            p->failed = true;
+            break;
+        }
+    }
+
+    pa_usec_t latency_usec = 0;
+    int negative = 0;
+    if (pa_stream_get_latency(stream, &latency_usec, &negative) == 0)
+        p->latency_usec = negative ? 0 : (int64_t)latency_usec;
+
+    if (pushed_audio || p->failed)
+        pa_sound_context_notify(p->sound_context);
+}
+
+static pa_handle* pa_sound_device_new(pa_sound_context *sound_context,
+        const char *dev,
+        const char *stream_name,
+        const pa_sample_spec *ss,
+        const pa_buffer_attr *attr,
+        int *rerror) {
+    int error = PA_ERR_INTERNAL, r;
+
+    pa_handle *p = new pa_handle();
+    p->sound_context = sound_context;
+    p->chunk_size = attr->maxlength;
+    p->chunk_pool = av_buffer_pool_init(p->chunk_size, NULL);
+    if(!p->chunk_pool) {
+        fprintf(stderr, "failed to allocate buffer for audio\n");
+        *rerror = -1;
+        pa_sound_device_free(p);
+        return NULL;
+    }
+
+    pa_threaded_mainloop_lock(sound_context->mainloop);
+
+    if (!(p->stream = pa_stream_new(sound_context->context, stream_name, ss, NULL))) {
+        error = pa_context_errno(sound_context->context);
         goto fail;
     }
 
+    pa_stream_set_state_callback(p->stream, pa_stream_state_cb, p);
+    pa_stream_set_read_callback(p->stream, pa_stream_read_cb, p);
+    pa_stream_set_overflow_callback(p->stream, pa_stream_overflow_cb, p);
+
     r = pa_stream_connect_record(p->stream, dev, attr,
         (pa_stream_flags_t)(PA_STREAM_INTERPOLATE_TIMING|PA_STREAM_ADJUST_LATENCY|PA_STREAM_AUTO_TIMING_UPDATE));
 
     if (r < 0) {
-        error = pa_context_errno(p->context);
+        error = pa_context_errno(sound_context->context);
         goto fail;
     }
 
@@ -137,94 +306,39 @@ static pa_handle* pa_sound_device_new(const char *server,
             break;
 
         if (!PA_STREAM_IS_GOOD(state)) {
-            error = pa_context_errno(p->context);
+            error = pa_context_errno(sound_context->context);
             goto fail;
         }
 
-        pa_mainloop_iterate(p->mainloop, 1, NULL);
+        pa_threaded_mainloop_wait(sound_context->mainloop);
     }
 
+    pa_threaded_mainloop_unlock(sound_context->mainloop);
     return p;
 
 fail:
+    pa_threaded_mainloop_unlock(sound_context->mainloop);
     if (rerror)
         *rerror = error;
     pa_sound_device_free(p);
     return NULL;
 }
 
-// Returns a negative value on failure or if |p->output_length| data is not available within the time frame specified by the sample rate
-static int pa_sound_device_read(pa_handle *p) {
+// Takes the next chunk of audio from the ring buffer, without waiting for more audio.
+// Returns 1 if a chunk was read, 0 if a whole chunk hasn't been received yet and a negative value on failure
+static int pa_sound_device_read(pa_handle *p, AVBufferRef **chunk) {
     assert(p);
 
-    const int64_t timeout_ms = std::round((1000.0 / (double)pa_stream_get_sample_spec(p->stream)->rate) * 1000.0);
-    const double start_time = clock_get_monotonic_seconds();
-
-    bool success = false;
-    int r = 0;
-    int *rerror = &r;
-    CHECK_DEAD_GOTO(p, rerror, fail);
-
-    while (p->output_index < p->output_length) {
-        if((clock_get_monotonic_seconds() - start_time) * 1000 >= timeout_ms)
-            return -1;
-
-        if(!p->read_data) {
-            pa_mainloop_prepare(p->mainloop, 1 * 1000); // 1 ms
-            pa_mainloop_poll(p->mainloop);
-            pa_mainloop_dispatch(p->mainloop);
-
-            if(pa_stream_peek(p->stream, &p->read_data, &p->read_length) < 0)
-                goto fail;
-
-            if(!p->read_data && p->read_length == 0)
-                continue;
+    const size_t read_pos = p->ring_read_pos.load(std::memory_order_relaxed);
+    const size_t write_pos = p->ring_write_pos.load(std::memory_order_acquire);
+    if (write_pos == read_pos)
+        return p->failed ? -1 : 0;
 
-            if(!p->read_data && p->read_length > 0) {
-                // There is a hole in the stream :( drop it. Maybe we should generate silence instead? TODO
-                if(pa_stream_drop(p->stream) != 0)
-                    goto fail;
-                continue;
-            }
-
-            if(p->read_length <= 0) {
-                p->read_data = NULL;
-                if(pa_stream_drop(p->stream) != 0)
-                    goto fail;
-
-                CHECK_DEAD_GOTO(p, rerror, fail);
-                continue;
-            }
-        }
-
-        const size_t space_free_in_output_buffer = p->output_length - p->output_index;
-        if(space_free_in_output_buffer < p->read_length) {
-            memcpy(p->output_data + p->output_index, (const uint8_t*)p->read_data + p->read_index, space_free_in_output_buffer);
-            p->output_index = 0;
-            p->read_index += space_free_in_output_buffer;
-            p->read_length -= space_free_in_output_buffer;
-            break;
-        } else {
-            memcpy(p->output_data + p->output_index, (const uint8_t*)p->read_data + p->read_index, p->read_length);
-            p->output_index += p->read_length;
-            p->read_data = NULL;
-            p->read_length = 0;
-            p->read_index = 0;
-            
-            if(pa_stream_drop(p->stream) != 0)
-                goto fail;
-
-            if(p->output_index == p->output_length) {
-                p->output_index = 0;
-                break;
-            }
-        }
-    }
-
-    success = true;
-
-    fail:
-    return success ? 0 : -1;
+    AVBufferRef **ring_chunk = &p->ring[read_pos % RING_BUFFER_NUM_CHUNKS];
+    *chunk = *ring_chunk;
+    *ring_chunk = NULL;
+    p->ring_read_pos.store(read_pos + 1, std::memory_order_release);
+    return 1;
 }
 
 static pa_sample_format_t audio_format_to_pulse_audio_format(AudioFormat audio_format) {
@@ -247,7 +361,33 @@ static int audio_format_to_get_bytes_per_sample(AudioFormat audio_format) {
     return 2;
 }
 
-int sound_device_get_by_name(SoundDevice *device, const char *device_name, const char *description, unsigned int num_channels, unsigned int period_frame_size, AudioFormat audio_format) {
+int sound_context_create(SoundContext *context, const gsr_thread_config *thread_config) {
+    int error = 0;
+    pa_sound_context *handle = pa_sound_context_new(nullptr, "gpu-screen-recorder", thread_config, &error);
+    if(!handle) {
+        fprintf(stderr, "pa_sound_context_new() failed: %s\n", pa_strerror(error));
+        return -1;
+    }
+
+    context->handle = handle;
+    return 0;
+}
+
+void sound_context_destroy(SoundContext *context) {
+    if(context->handle)
+        pa_sound_context_free((pa_sound_context*)context->handle);
+    context->handle = NULL;
+}
+
+int sound_context_wait(SoundContext *context, int timeout_ms) {
+    pa_sound_context *c = (pa_sound_context*)context->handle;
+    std::unique_lock<std::mutex> lock(c->audio_available_mutex);
+    c->audio_available_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), [c]{ return c->audio_available; });
+    c->audio_available = false;
+    return 0;
+}
+
+int sound_device_get_by_name(SoundContext *context, SoundDevice *device, const char *device_name, const char *description, unsigned int num_channels, unsigned int period_frame_size, AudioFormat audio_format) {
     pa_sample_spec ss;
     ss.format = audio_format_to_pulse_audio_format(audio_format);
     ss.rate = 48000;
@@ -261,7 +401,7 @@ int sound_device_get_by_name(SoundDevice *device, const char *device_name, const
     buffer_attr.fragsize = buffer_attr.maxlength;
 
     int error = 0;
-    pa_handle *handle = pa_sound_device_new(nullptr, description, device_name, description, &ss, &buffer_attr, &error);
+    pa_handle *handle = pa_sound_device_new((pa_sound_context*)context->handle, device_name, description, &ss, &buffer_attr, &error);
     if(!handle) {
         fprintf(stderr, "pa_sound_device_new() failed: %s. Audio input device %s might not be valid\n", pa_strerror(error), description);
         return -1;
@@ -278,16 +418,23 @@ void sound_device_close(SoundDevice *device) {
     device->handle = NULL;
 }
 
-int sound_device_read_next_chunk(SoundDevice *device, void **buffer) {
+int sound_device_read_next_chunk(SoundDevice *device, AVBufferRef **buffer) {
     pa_handle *pa = (pa_handle*)device->handle;
-    if(pa_sound_device_read(pa) < 0) {
-        //fprintf(stderr, "pa_simple_read() failed: %s\n", pa_strerror(error));
-        return -1;
-    }
-    *buffer = pa->output_data;
+    const int ret = pa_sound_device_read(pa, buffer);
+    if(ret <= 0)
+        return ret;
     return device->frames;
 }
 
+void sound_device_get_stats(SoundDevice *device, SoundDeviceStats *stats) {
+    pa_handle *pa = (pa_handle*)device->handle;
+    const int64_t latency_usec = pa->latency_usec;
+    stats->latency_secs = latency_usec >= 0 ? (double)latency_usec / 1000000.0 : -1.0;
+    stats->num_overflows = pa->num_overflows;
+    stats->num_holes = pa->num_holes;
+    stats->num_copies = pa->num_copies;
+}
+
 static void pa_state_cb(pa_context *c, void *userdata) {
     pa_context_state state = pa_context_get_state(c);
     int *pa_ready = (int*)userdata;
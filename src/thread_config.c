@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include "../include/thread_config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+/* Every thread applies the same config, so each kind of failure is only reported once */
+static atomic_flag scheduling_warning_shown = ATOMIC_FLAG_INIT;
+static atomic_flag affinity_warning_shown = ATOMIC_FLAG_INIT;
+
+static cpu_set_t process_cpu_set;
+static bool process_cpu_set_saved = false;
+
+void gsr_thread_config_save_process_affinity(void) {
+    CPU_ZERO(&process_cpu_set);
+    process_cpu_set_saved = sched_getaffinity(0, sizeof(process_cpu_set), &process_cpu_set) == 0;
+    if(!process_cpu_set_saved)
+        fprintf(stderr, "gsr warning: gsr_thread_config_save_process_affinity: failed to get the cpu affinity, error: %s\n", strerror(errno));
+}
+
+void gsr_thread_config_init(gsr_thread_config *self) {
+    memset(self, 0, sizeof(*self));
+    self->scheduling = GSR_THREAD_SCHEDULING_DEFAULT;
+}
+
+static bool parse_int(const char *str, int *value) {
+    char *end = NULL;
+    errno = 0;
+    const long result = strtol(str, &end, 10);
+    if(errno != 0 || end == str || *end != '\0')
+        return false;
+    *value = (int)result;
+    return true;
+}
+
+bool gsr_thread_config_parse_scheduling(gsr_thread_config *self, const char *str) {
+    const char *separator = strchr(str, ':');
+    if(!separator)
+        return false;
+
+    const size_t name_len = separator - str;
+    int priority = 0;
+    if(!parse_int(separator + 1, &priority))
+        return false;
+
+    if(name_len == 4 && memcmp(str, "fifo", 4) == 0) {
+        self->scheduling = GSR_THREAD_SCHEDULING_FIFO;
+    } else if(name_len == 2 && memcmp(str, "rr", 2) == 0) {
+        self->scheduling = GSR_THREAD_SCHEDULING_RR;
+    } else if(name_len == 4 && memcmp(str, "nice", 4) == 0) {
+        self->scheduling = GSR_THREAD_SCHEDULING_NICE;
+    } else {
+        return false;
+    }
+
+    if(self->scheduling == GSR_THREAD_SCHEDULING_NICE) {
+        if(priority < -20 || priority > 19)
+            return false;
+    } else if(priority < 1 || priority > 99) {
+        return false;
+    }
+
+    self->priority = priority;
+    return true;
+}
+
+bool gsr_thread_config_parse_cpus(gsr_thread_config *self, const char *str) {
+    memset(self->cpus, 0, sizeof(self->cpus));
+    self->pin_cpus = false;
+
+    const char *p = str;
+    while(*p != '\0') {
+        const char *end = strchr(p, ',');
+        if(!end)
+            end = p + strlen(p);
+
+        char range[64];
+        const size_t range_len = end - p;
+        if(range_len == 0 || range_len >= sizeof(range))
+            return false;
+        memcpy(range, p, range_len);
+        range[range_len] = '\0';
+
+        int first = 0;
+        int last = 0;
+        char *dash = strchr(range, '-');
+        if(dash) {
+            *dash = '\0';
+            if(!parse_int(range, &first) || !parse_int(dash + 1, &last))
+                return false;
+        } else {
+            if(!parse_int(range, &first))
+                return false;
+            last = first;
+        }
+
+        if(first < 0 || last < first || last >= GSR_THREAD_CONFIG_MAX_CPUS)
+            return false;
+
+        for(int i = first; i <= last; ++i) {
+            self->cpus[i] = true;
+        }
+        self->pin_cpus = true;
+
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return self->pin_cpus;
+}
+
+static void apply_scheduling(const gsr_thread_config *self) {
+    int res = 0;
+    switch(self->scheduling) {
+        case GSR_THREAD_SCHEDULING_DEFAULT:
+            return;
+        case GSR_THREAD_SCHEDULING_FIFO:
+        case GSR_THREAD_SCHEDULING_RR: {
+            struct sched_param param;
+            memset(&param, 0, sizeof(param));
+            param.sched_priority = self->priority;
+            res = pthread_setschedparam(pthread_self(), self->scheduling == GSR_THREAD_SCHEDULING_FIFO ? SCHED_FIFO : SCHED_RR, &param);
+            break;
+        }
+        case GSR_THREAD_SCHEDULING_NICE: {
+            /* On Linux the niceness is per thread */
+            res = setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), self->priority) == 0 ? 0 : errno;
+            break;
+        }
+    }
+
+    if(res != 0 && !atomic_flag_test_and_set(&scheduling_warning_shown)) {
+        fprintf(stderr, "gsr warning: gsr_thread_config_apply: failed to change the thread scheduling, error: %s. The threads will use the default scheduling."
+            " Real-time scheduling and negative niceness require the CAP_SYS_NICE capability or a rtprio/nice limit for the user (see limits.conf)\n", strerror(res));
+    }
+}
+
+static void apply_affinity(const gsr_thread_config *self) {
+    if(!self->pin_cpus)
+        return;
+
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for(int i = 0; i < GSR_THREAD_CONFIG_MAX_CPUS && i < CPU_SETSIZE; ++i) {
+        if(self->cpus[i])
+            CPU_SET(i, &cpu_set);
+    }
+
+    const int res = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    if(res != 0 && !atomic_flag_test_and_set(&affinity_warning_shown))
+        fprintf(stderr, "gsr warning: gsr_thread_config_apply: failed to set the cpu affinity, error: %s. The threads can run on any cpu\n", strerror(res));
+}
+
+void gsr_thread_config_apply(const gsr_thread_config *self, const char *name) {
+    /* Thread names are limited to 15 characters */
+    if(name)
+        pthread_setname_np(pthread_self(), name);
+    apply_scheduling(self);
+    apply_affinity(self);
+}
+
+void gsr_thread_config_apply_default(const char *name) {
+    if(name)
+        pthread_setname_np(pthread_self(), name);
+
+    /* Lowering the priority is always allowed */
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+    if(getpriority(PRIO_PROCESS, 0) < 0)
+        setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 0);
+
+    if(process_cpu_set_saved)
+        pthread_setaffinity_np(pthread_self(), sizeof(process_cpu_set), &process_cpu_set);
+}
+
+bool gsr_lock_memory(void) {
+    if(mlockall(MCL_CURRENT) != 0) {
+        fprintf(stderr, "gsr warning: gsr_lock_memory: failed to lock memory, error: %s. Locking memory requires the CAP_IPC_LOCK capability or a memlock limit for the user that is large enough (see limits.conf)\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
@@ -1,5 +1,6 @@
 #include "../include/time.h"
 #include <time.h>
+#include <errno.h>
 
 double clock_get_monotonic_seconds() {
     struct timespec ts;
@@ -8,3 +9,18 @@ double clock_get_monotonic_seconds() {
     clock_gettime(CLOCK_MONOTONIC, &ts);
     return (double)ts.tv_sec + (double)ts.tv_nsec * 0.000000001;
 }
+
+bool clock_sleep_until_monotonic_seconds(double deadline) {
+    if(deadline <= 0.0)
+        return true;
+
+    struct timespec ts;
+    ts.tv_sec = (time_t)deadline;
+    ts.tv_nsec = (long)((deadline - (double)ts.tv_sec) * 1000000000.0);
+    if(ts.tv_nsec >= 1000000000) {
+        ts.tv_nsec -= 1000000000;
+        ++ts.tv_sec;
+    }
+    /* An absolute deadline doesn't drift when the thread wakes up late or the sleep is restarted */
+    return clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != EINTR;
+}